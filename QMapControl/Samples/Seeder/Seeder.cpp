@@ -0,0 +1,144 @@
+//
+// Command line tool filling a persistent tile cache with the tiles of an area, for offline use.
+//
+// Example:
+//   Seeder --cache /media/vehicle/QMapControl.cache --bbox 2.05,41.45,2.25,41.30 --zoom 8:16 --jobs 4
+//
+
+#include "QMapControl/MapAdapterOSM.h"
+#include "QMapControl/MapAdapterTile.h"
+#include "QMapControl/PersistentCache.h"
+#include "QMapControl/QMapControl.h"
+#include "QMapControl/TileSeeder.h"
+
+#include <QCommandLineParser>
+#include <QGuiApplication>
+#include <QMetaObject>
+#include <QTextStream>
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+using namespace qmapcontrol;
+
+namespace {
+bool parsePoint(const QString &text, PointWorldCoord &point)
+{
+    const auto values = text.split(',');
+    bool lon_ok = false, lat_ok = false;
+    if (values.size() == 2) {
+        point = PointWorldCoord(values[0].toDouble(&lon_ok), values[1].toDouble(&lat_ok));
+    }
+    return lon_ok && lat_ok;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    // No display needed (the image manager still creates its placeholder pixmaps).
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+    QGuiApplication::setApplicationName("Seeder");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Downloads the tiles of an area into a QMapControl persistent cache.");
+    parser.addHelpOption();
+    QCommandLineOption cacheOption("cache", "The persistent cache directory.", "dir",
+                                   QMapControl::PersistentCacheDefaultPath.absolutePath());
+    QCommandLineOption bboxOption("bbox", "The area, as two corners: lon,lat,lon,lat.", "bbox");
+    QCommandLineOption polygonOption("polygon", "The area, as a polygon: \"lon,lat lon,lat lon,lat ...\".", "points");
+    QCommandLineOption zoomOption("zoom", "The zoom levels: min:max.", "range", "0:12");
+    QCommandLineOption urlOption("url", "The tile url template (%zoom, %x and %y are replaced), OpenStreetMap if not set.",
+                                 "template");
+    QCommandLineOption jobsOption("jobs", "The maximum number of concurrent downloads.", "count",
+                                  QString::number(TileSeeder::DefaultMaxConcurrentDownloads));
+    QCommandLineOption expiryOption("expiry", "The cache expiration, in minutes (0 to keep forever).", "minutes", "0");
+    parser.addOptions({cacheOption, bboxOption, polygonOption, zoomOption, urlOption, jobsOption, expiryOption});
+    parser.process(app);
+
+    QTextStream err(stderr);
+
+    // The area.
+    std::vector<PointWorldCoord> polygon;
+    if (parser.isSet(bboxOption)) {
+        const auto values = parser.value(bboxOption).split(',');
+        PointWorldCoord top_left, bottom_right;
+        if (values.size() != 4 || !parsePoint(values[0] + ',' + values[1], top_left) ||
+            !parsePoint(values[2] + ',' + values[3], bottom_right)) {
+            err << "Invalid bounding box: " << parser.value(bboxOption) << endl;
+            return 1;
+        }
+        polygon = {top_left, PointWorldCoord(bottom_right.longitude(), top_left.latitude()), bottom_right,
+                   PointWorldCoord(top_left.longitude(), bottom_right.latitude())};
+    } else if (parser.isSet(polygonOption)) {
+        for (const auto &text : parser.value(polygonOption).split(' ', QString::SkipEmptyParts)) {
+            PointWorldCoord point;
+            if (!parsePoint(text, point)) {
+                err << "Invalid polygon point: " << text << endl;
+                return 1;
+            }
+            polygon.push_back(point);
+        }
+    }
+    if (polygon.size() < 3) {
+        err << "An area is required (--bbox or --polygon)." << endl;
+        parser.showHelp(1);
+    }
+
+    // The zoom levels.
+    const auto zooms = parser.value(zoomOption).split(':');
+    bool min_ok = false, max_ok = false;
+    const int min_zoom = zooms.value(0).toInt(&min_ok);
+    const int max_zoom = zooms.size() > 1 ? zooms.value(1).toInt(&max_ok) : min_zoom;
+    if (!min_ok || (zooms.size() > 1 && !max_ok)) {
+        err << "Invalid zoom range: " << parser.value(zoomOption) << endl;
+        return 1;
+    }
+
+    // The tile source.
+    std::shared_ptr<MapAdapter> mapadapter;
+    if (parser.isSet(urlOption)) {
+        mapadapter = std::make_shared<MapAdapterTile>(QUrl(parser.value(urlOption)),
+                                                      std::set<projection::EPSG>{projection::EPSG::SphericalMercator},
+                                                      0, 22);
+    } else {
+        mapadapter = std::make_shared<MapAdapterOSM>();
+    }
+
+    std::unique_ptr<PersistentCache> cache;
+    try {
+        cache = std::make_unique<PersistentCache>(QDir(parser.value(cacheOption)),
+                                                  std::chrono::minutes(parser.value(expiryOption).toInt()));
+    } catch (std::exception &e) {
+        err << "Cannot open the cache: " << e.what() << endl;
+        return 1;
+    }
+
+    TileSeeder seeder(mapadapter, *cache);
+    seeder.setArea(polygon);
+    seeder.setZoomRange(min_zoom, max_zoom);
+    seeder.setMaxConcurrentDownloads(parser.value(jobsOption).toInt());
+
+    err << "Seeding " << seeder.tileCount() << " tiles, zoom " << min_zoom << " to " << max_zoom << " into "
+        << parser.value(cacheOption) << endl;
+
+    QObject::connect(&seeder, &TileSeeder::progressChanged, [&err](const TileSeeder::Progress &progress) {
+        err << QString("\r%1/%2 tiles (%3 downloaded, %4 skipped, %5 failed), %6 tiles/s, %7 KiB/s   ")
+                .arg(progress.processed()).arg(progress.total)
+                .arg(progress.downloaded).arg(progress.skipped).arg(progress.failed)
+                .arg(progress.tilesPerSecond(), 0, 'f', 1).arg(progress.bytesPerSecond() / 1024.0, 0, 'f', 1);
+        err.flush();
+    });
+    QObject::connect(&seeder, &TileSeeder::finished, [&app, &err](const TileSeeder::Progress &progress) {
+        err << endl << "Done in " << progress.elapsed_ms / 1000.0 << " s, " << progress.bytes / 1024 << " KiB stored."
+            << endl;
+        app.exit(progress.failed > 0 ? 2 : 0);
+    });
+
+    // Start once the event loop runs (an empty area finishes straight away).
+    QMetaObject::invokeMethod(&seeder, "start", Qt::QueuedConnection);
+    return app.exec();
+}
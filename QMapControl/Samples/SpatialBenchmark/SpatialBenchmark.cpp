@@ -0,0 +1,366 @@
+//
+// Command line tool timing the spatial indexes of LayerGeometry: the RTreeContainer (each feature stored once, by its
+// envelope) against the QuadTreeContainer it replaced (each vertex of a feature stored as a point), and the
+// FlatQuadTreeContainer running the same workload as the QuadTreeContainer.
+// The R-tree query results are checked against a brute-force scan after each way of building and changing it (one
+// by one, bulkInsert, erase, erase of a moved feature and bulkInsert into a filled tree), and the FlatQuadTreeContainer
+// results against the QuadTreeContainer ones: the exit code is 1 if any differs.
+//
+// Example:
+//   SpatialBenchmark --features 1000000 --vertices 5 --queries 1000 --view 5
+//
+
+#include "QMapControl/FlatQuadTreeContainer.h"
+#include "QMapControl/QuadTreeContainer.h"
+#include "QMapControl/RTreeContainer.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace qmapcontrol;
+
+namespace {
+/// A feature: its vertices (a single one for a point) and their envelope.
+struct Feature {
+    std::vector<PointWorldCoord> vertices;
+    RectWorldCoord envelope;
+};
+
+/// Pi (M_PI is not standard).
+const double Pi = 3.14159265358979323846;
+
+/// The area covered by the features (the whole world, as LayerGeometry's former quad tree).
+const RectWorldCoord WorldCoord(PointWorldCoord(-180.0, 90.0), PointWorldCoord(180.0, -90.0));
+
+/// The node capacity of LayerGeometry's former quad tree.
+const std::size_t QuadTreeCapacity = 50;
+
+/// The maximum number of entries of LayerGeometry's R-tree nodes.
+const std::size_t RTreeMaxEntries = 16;
+
+/// The number of queries checked against a brute-force scan, after each change.
+const std::size_t CheckedQueries = 20;
+
+/// The number of features erased by an outdated envelope (as if moved since inserted).
+const std::size_t MovedFeatures = 100;
+
+std::vector<Feature> makeFeatures(std::size_t count, int vertex_count, double size, std::mt19937 &random)
+{
+    std::uniform_real_distribution<double> longitude(-180.0 + size, 180.0 - size);
+    std::uniform_real_distribution<double> latitude(-90.0 + size, 90.0 - size);
+    std::uniform_real_distribution<double> radius(size / 10.0, size);
+
+    std::vector<Feature> features;
+    features.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const PointWorldCoord center(longitude(random), latitude(random));
+        std::vector<PointWorldCoord> vertices;
+        if (vertex_count <= 1) {
+            vertices.push_back(center);
+        } else {
+            // A convex polygon around the centre.
+            const double feature_radius = radius(random);
+            for (int vertex = 0; vertex < vertex_count; ++vertex) {
+                const double angle = 2.0 * Pi * vertex / vertex_count;
+                vertices.emplace_back(center.longitude() + feature_radius * std::cos(angle),
+                                      center.latitude() + feature_radius * std::sin(angle));
+            }
+        }
+
+        // The envelope of the vertices.
+        double min_x = center.longitude(), max_x = min_x, min_y = center.latitude(), max_y = min_y;
+        for (const auto &vertex : vertices) {
+            min_x = std::min(min_x, vertex.longitude());
+            max_x = std::max(max_x, vertex.longitude());
+            min_y = std::min(min_y, vertex.latitude());
+            max_y = std::max(max_y, vertex.latitude());
+        }
+        const RectWorldCoord envelope(PointWorldCoord(min_x, max_y), PointWorldCoord(max_x, min_y));
+        features.push_back(Feature{std::move(vertices), envelope});
+    }
+    return features;
+}
+
+std::vector<RectWorldCoord> makeViews(std::size_t count, double view, std::mt19937 &random)
+{
+    std::uniform_real_distribution<double> longitude(-180.0, 180.0 - view);
+    std::uniform_real_distribution<double> latitude(-90.0 + view, 90.0);
+
+    std::vector<RectWorldCoord> views;
+    views.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const PointWorldCoord top_left(longitude(random), latitude(random));
+        views.emplace_back(top_left, PointWorldCoord(top_left.longitude() + view, top_left.latitude() - view));
+    }
+    return views;
+}
+
+/// The timings of one container, in milliseconds, and the objects found by the queries.
+struct Result {
+    qint64 insert_ms = 0;
+    qint64 bulk_insert_ms = 0;
+    qint64 query_ms = 0;
+    qint64 erase_ms = 0;
+    std::size_t entries = 0;
+    std::size_t found = 0;
+    std::size_t mismatches = 0;
+
+    /// The sorted features found in each view after bulkInsert(), then in the checked views after the erasures.
+    std::vector<std::vector<std::size_t>> views_found;
+};
+
+/*!
+ * Counts the queries of an R-tree whose results differ from a brute-force scan of the features it stores.
+ * @param tree The R-tree, each feature stored by its envelope with its index.
+ * @param features The features.
+ * @param stored Whether each feature is stored.
+ * @param views The views queried (the first CheckedQueries ones).
+ * @return the number of views with different results.
+ */
+std::size_t checkRTree(const RTreeContainer<std::size_t> &tree, const std::vector<Feature> &features,
+                       const std::vector<bool> &stored, const std::vector<RectWorldCoord> &views)
+{
+    std::size_t mismatches = 0;
+    std::vector<std::size_t> found, expected;
+    for (std::size_t i = 0; i < std::min(CheckedQueries, views.size()); ++i) {
+        found.clear();
+        tree.query(std::back_inserter(found), views[i]);
+        std::sort(found.begin(), found.end());
+
+        // The features whose envelope overlaps the view (touching counts).
+        const QRectF view = views[i].rawRect();
+        const qreal view_min_x = std::min(view.left(), view.right()), view_max_x = std::max(view.left(), view.right());
+        const qreal view_min_y = std::min(view.top(), view.bottom()), view_max_y = std::max(view.top(), view.bottom());
+        expected.clear();
+        for (std::size_t feature = 0; feature < features.size(); ++feature) {
+            const QRectF envelope = features[feature].envelope.rawRect();
+            if (stored[feature] && std::min(envelope.left(), envelope.right()) <= view_max_x &&
+                view_min_x <= std::max(envelope.left(), envelope.right()) &&
+                std::min(envelope.top(), envelope.bottom()) <= view_max_y &&
+                view_min_y <= std::max(envelope.top(), envelope.bottom())) {
+                expected.push_back(feature);
+            }
+        }
+
+        if (found != expected) {
+            ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+Result benchmarkRTree(const std::vector<Feature> &features, const std::vector<RectWorldCoord> &views,
+                      std::size_t erase_count)
+{
+    Result result;
+    QElapsedTimer timer;
+
+    std::vector<bool> stored(features.size(), true);
+
+    // One by one (the R* split).
+    {
+        RTreeContainer<std::size_t> tree(RTreeMaxEntries);
+        timer.start();
+        for (std::size_t i = 0; i < features.size(); ++i) {
+            tree.insert(features[i].envelope, i);
+        }
+        result.insert_ms = timer.elapsed();
+        result.mismatches += checkRTree(tree, features, stored, views);
+    }
+
+    // At once.
+    RTreeContainer<std::size_t> tree(RTreeMaxEntries);
+    std::vector<std::pair<RectWorldCoord, std::size_t>> entries;
+    entries.reserve(features.size());
+    for (std::size_t i = 0; i < features.size(); ++i) {
+        entries.emplace_back(features[i].envelope, i);
+    }
+    timer.start();
+    tree.bulkInsert(entries);
+    result.bulk_insert_ms = timer.elapsed();
+    result.entries = tree.size();
+    result.mismatches += checkRTree(tree, features, stored, views);
+
+    // Into a reused buffer, as LayerGeometry::draw().
+    std::vector<std::size_t> found;
+    timer.start();
+    for (const auto &view : views) {
+        found.clear();
+        tree.query(std::back_inserter(found), view);
+        result.found += found.size();
+    }
+    result.query_ms = timer.elapsed();
+
+    timer.start();
+    for (std::size_t i = 0; i < erase_count; ++i) {
+        tree.erase(features[i].envelope, i);
+    }
+    result.erase_ms = timer.elapsed();
+    std::fill(stored.begin(), stored.begin() + erase_count, false);
+    result.mismatches += checkRTree(tree, features, stored, views);
+
+    // Erase features by an envelope they are not in (the whole tree is searched).
+    const RectWorldCoord outdated_envelope(PointWorldCoord(-180.0, 90.0), PointWorldCoord(-180.0, 90.0));
+    const std::size_t moved_end = std::min(features.size(), erase_count + MovedFeatures);
+    for (std::size_t i = erase_count; i < moved_end; ++i) {
+        tree.erase(outdated_envelope, i);
+    }
+    std::fill(stored.begin() + erase_count, stored.begin() + moved_end, false);
+    result.mismatches += checkRTree(tree, features, stored, views);
+
+    // Insert the erased features back (a small batch is inserted one by one, a large one repacks the tree).
+    entries.erase(entries.begin() + moved_end, entries.end());
+    tree.bulkInsert(entries);
+    std::fill(stored.begin(), stored.begin() + moved_end, true);
+    result.mismatches += checkRTree(tree, features, stored, views);
+    if (tree.size() != features.size()) {
+        ++result.mismatches;
+    }
+
+    return result;
+}
+
+/*!
+ * Appends the sorted features found in views to a result.
+ * @param tree The point tree, each vertex stored with the index of its feature.
+ * @param views The views queried.
+ * @param count The number of views queried (the first ones).
+ * @param result The result the features found are appended to.
+ */
+template <class PointTree>
+void collectFound(const PointTree &tree, const std::vector<RectWorldCoord> &views, std::size_t count, Result &result)
+{
+    for (std::size_t i = 0; i < std::min(count, views.size()); ++i) {
+        std::set<std::size_t> found;
+        tree.query(found, views[i]);
+        result.views_found.emplace_back(found.begin(), found.end());
+    }
+}
+
+/// Runs the workload of LayerGeometry's former quad tree on a point tree (QuadTreeContainer or FlatQuadTreeContainer).
+template <class PointTree>
+Result benchmarkPointTree(const std::vector<Feature> &features, const std::vector<RectWorldCoord> &views,
+                          std::size_t erase_count)
+{
+    Result result;
+    QElapsedTimer timer;
+
+    // One by one (each vertex).
+    {
+        PointTree tree(QuadTreeCapacity, WorldCoord);
+        timer.start();
+        for (std::size_t i = 0; i < features.size(); ++i) {
+            for (const auto &vertex : features[i].vertices) {
+                tree.insert(vertex, i);
+            }
+        }
+        result.insert_ms = timer.elapsed();
+    }
+
+    // At once.
+    PointTree tree(QuadTreeCapacity, WorldCoord);
+    std::vector<std::pair<PointWorldCoord, std::size_t>> points;
+    for (std::size_t i = 0; i < features.size(); ++i) {
+        for (const auto &vertex : features[i].vertices) {
+            points.emplace_back(vertex, i);
+        }
+    }
+    timer.start();
+    result.entries = tree.bulkInsert(std::move(points));
+    result.bulk_insert_ms = timer.elapsed();
+
+    // Into a set, to report each feature once (the features without a vertex in the view are missed).
+    std::set<std::size_t> found;
+    timer.start();
+    for (const auto &view : views) {
+        found.clear();
+        tree.query(found, view);
+        result.found += found.size();
+    }
+    result.query_ms = timer.elapsed();
+    collectFound(tree, views, views.size(), result);
+
+    timer.start();
+    for (std::size_t i = 0; i < erase_count; ++i) {
+        for (const auto &vertex : features[i].vertices) {
+            tree.erase(vertex, i);
+        }
+    }
+    result.erase_ms = timer.elapsed();
+    collectFound(tree, views, CheckedQueries, result);
+
+    return result;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("SpatialBenchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times the insertions, queries and erasures of the QMapControl spatial indexes.");
+    parser.addHelpOption();
+    QCommandLineOption featuresOption("features", "The number of features.", "count", "1000000");
+    QCommandLineOption verticesOption("vertices", "The number of vertices of a feature (1 for points).", "count", "5");
+    QCommandLineOption sizeOption("size", "The maximum radius of a feature, in degrees.", "degrees", "0.05");
+    QCommandLineOption queriesOption("queries", "The number of queries.", "count", "1000");
+    QCommandLineOption viewOption("view", "The width and height of a queried view, in degrees.", "degrees", "5");
+    QCommandLineOption eraseOption("erase", "The percentage of the features erased.", "percent", "10");
+    QCommandLineOption seedOption("seed", "The random seed.", "seed", "1");
+    parser.addOptions({featuresOption, verticesOption, sizeOption, queriesOption, viewOption, eraseOption, seedOption});
+    parser.process(app);
+
+    QTextStream out(stdout);
+
+    const std::size_t feature_count = parser.value(featuresOption).toULongLong();
+    const int vertex_count = std::max(1, parser.value(verticesOption).toInt());
+    const std::size_t erase_count = feature_count * std::min(100, std::max(0, parser.value(eraseOption).toInt())) / 100;
+
+    std::mt19937 random(parser.value(seedOption).toUInt());
+    const auto features = makeFeatures(feature_count, vertex_count, parser.value(sizeOption).toDouble(), random);
+    const auto views = makeViews(parser.value(queriesOption).toULongLong(), parser.value(viewOption).toDouble(),
+                                 random);
+
+    out << feature_count << " features of " << vertex_count << " vertices, " << views.size() << " queries, "
+        << erase_count << " erasures\n";
+    out.flush();
+
+    const auto print = [&out](const QString &name, const Result &result) {
+        out << QString("%1 %2 entries, insert %3 ms, bulkInsert %4 ms, query %5 ms (%6 found), erase %7 ms")
+                .arg(name, -21).arg(result.entries, 9)
+                .arg(result.insert_ms).arg(result.bulk_insert_ms).arg(result.query_ms).arg(result.found)
+                .arg(result.erase_ms)
+            << "\n";
+        out.flush();
+    };
+    const Result rtree = benchmarkRTree(features, views, erase_count);
+    print("RTreeContainer", rtree);
+    const Result quad_tree = benchmarkPointTree<QuadTreeContainer<std::size_t>>(features, views, erase_count);
+    print("QuadTreeContainer", quad_tree);
+    const Result flat_quad_tree = benchmarkPointTree<FlatQuadTreeContainer<std::size_t>>(features, views, erase_count);
+    print("FlatQuadTreeContainer", flat_quad_tree);
+
+    // The R-tree must find the same features as the brute-force scan, and both quad trees the same features.
+    bool failed = false;
+    if (rtree.mismatches > 0) {
+        out << "FAILED: " << rtree.mismatches << " R-tree checks differ from the brute-force scan\n";
+        failed = true;
+    }
+    if (flat_quad_tree.views_found != quad_tree.views_found) {
+        out << "FAILED: the FlatQuadTreeContainer queries differ from the QuadTreeContainer ones\n";
+        failed = true;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,437 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_FLATQUADTREECONTAINER_H
+#define QMAPCONTROL_FLATQUADTREECONTAINER_H
+
+#include "qmapcontrol_global.h"
+#include "Point.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace qmapcontrol {
+
+/*!
+ * Point quad tree with a flat, cache friendly layout, a drop-in for QuadTreeContainer (same public API).
+ * The nodes are stored in a single contiguous array, the four children of a node being consecutive, and the points in
+ * structure of arrays form: the x (longitude) and y (latitude) coordinates and the objects are separate arrays, in
+ * which each node holding points owns a block of capacity slots (allocated with its first point). A query walks the node array and tests the coordinates of a node
+ * with straight-line, branch-free comparisons the compiler can vectorise; the nodes fully within the range are
+ * reported without any test.
+ *
+ * Like QuadTreeContainer, a node holds up to capacity points before its children are created and used. Large sets
+ * are best inserted with bulkInsert(), which partitions the points down the tree instead of inserting them one by one.
+ *
+ * Memory trade-off: the empty nodes own no slots, but a node holding a single point owns a whole block of capacity
+ * slots in the three arrays. With sparse or clustered data, where many leaves hold a few points, the container can use
+ * several times the memory of QuadTreeContainer (which only stores the points it holds): prefer a small capacity then.
+ *
+ * Threading contract: none, the owner protects the container (const queries can run concurrently).
+ */
+template <class T>
+class QMAPCONTROL_EXPORT FlatQuadTreeContainer {
+public:
+    /*!
+     * Constructs an empty container.
+     * @param capacity The number of items a node can store before its children are created/used.
+     * @param boundary_coord The bounding box area that this container covers in coordinates.
+     */
+    FlatQuadTreeContainer(const std::size_t &capacity, const RectWorldCoord &boundary_coord)
+            : m_capacity(std::max<std::size_t>(capacity, 1)),
+              m_boundary(boundary_coord)
+    {
+        clear();
+    }
+
+    FlatQuadTreeContainer(const FlatQuadTreeContainer &) = delete;
+
+    FlatQuadTreeContainer &operator=(const FlatQuadTreeContainer &) = delete;
+
+    /*!
+     * Fetches objects within the specified bounding box range.
+     * @param return_points The objects that are within the specified range are added to this.
+     * @param range_coord The bounding box range.
+     */
+    void query(std::set<T> &return_points, const RectWorldCoord &range_coord) const
+    {
+        visit(range_coord, [&return_points](const T &object) { return_points.insert(object); });
+    }
+
+    /*!
+     * Fetches objects within the specified bounding box range, without any intermediate container.
+     * An object inserted at several points is written once for each of its points within the range.
+     * @param output The output iterator the objects are written to (eg: a back inserter into a reused vector).
+     * @param range_coord The bounding box range.
+     * @return the output iterator past the last object written.
+     */
+    template <class OutputIterator>
+    OutputIterator query(OutputIterator output, const RectWorldCoord &range_coord) const
+    {
+        visit(range_coord, [&output](const T &object) { *output++ = object; });
+        return output;
+    }
+
+    /*!
+     * Calls a visitor for each object within the specified bounding box range, as the tree is walked.
+     * No allocation is made and the objects are not copied. The visitor must not modify the container.
+     * @param range_coord The bounding box range.
+     * @param visitor The callable, called with each object (const T&), once for each of its points within the range.
+     */
+    template <class Visitor>
+    void visit(const RectWorldCoord &range_coord, Visitor &&visitor) const
+    {
+        visitNode(0, Bounds(range_coord.rawRect()), false, visitor);
+    }
+
+    /*!
+     * Inserts an object into the container.
+     * @param point_coord The objects's point in coordinates.
+     * @param object The object to insert.
+     * @return whether the object was inserted (false if the point is outside the boundary).
+     */
+    bool insert(const PointWorldCoord &point_coord, const T &object)
+    {
+        const qreal x = point_coord.longitude();
+        const qreal y = point_coord.latitude();
+        if (m_nodes[0].bounds.contains(x, y) == false) {
+            return false;
+        }
+
+        // Descend to the first node with a free slot, creating the children of the full ones.
+        std::uint32_t index = 0;
+        for (std::size_t depth = 0; m_nodes[index].count >= m_capacity; ++depth) {
+            if (depth >= MaxDepth) {
+                throw std::runtime_error("Unable to insert into quad tree container.");
+            }
+            if (m_nodes[index].first_child == 0) {
+                subdivide(index);
+            }
+            index = childContaining(index, x, y);
+        }
+
+        store(index, x, y, object);
+        return true;
+    }
+
+    /*!
+     * Removes an object from the container.
+     * @param point_coord The objects's point in coordinates.
+     * @param object The object to remove.
+     */
+    void erase(const PointWorldCoord &point_coord, const T &object)
+    {
+        eraseFrom(0, point_coord.longitude(), point_coord.latitude(), object);
+    }
+
+    /*!
+     * Removes all objects from the container (the storage is released).
+     */
+    void clear()
+    {
+        std::vector<Node>(1, Node(Bounds(m_boundary.rawRect()))).swap(m_nodes);
+        std::vector<qreal>().swap(m_x);
+        std::vector<qreal>().swap(m_y);
+        std::vector<T>().swap(m_objects);
+    }
+
+    /*!
+     * Inserts many objects into the container at once (as QuadTreeContainer::bulkInsert()).
+     * The free slots of each node are filled first, then the remaining points are partitioned in place between the
+     * children, so each point is placed with a single pass per level rather than descending the tree once.
+     * @param points The objects and their points (the points outside the boundary are dropped).
+     * @return the number of objects inserted.
+     */
+    std::size_t bulkInsert(std::vector<std::pair<PointWorldCoord, T>> points)
+    {
+        // Drop the points outside the boundary.
+        const Bounds &root_bounds = m_nodes[0].bounds;
+        const auto end = std::partition(points.begin(), points.end(), [&root_bounds](const std::pair<PointWorldCoord, T> &point) {
+            return root_bounds.contains(point.first.longitude(), point.first.latitude());
+        });
+
+        // Size the storage once: about one more node (and slot block) per capacity points, and their children.
+        const std::size_t count = static_cast<std::size_t>(end - points.begin());
+        const std::size_t node_estimate = m_nodes.size() + 4 * (count / m_capacity);
+        const std::size_t slot_estimate = m_objects.size() + 2 * (count / m_capacity + 1) * m_capacity;
+        m_nodes.reserve(node_estimate);
+        m_x.reserve(slot_estimate);
+        m_y.reserve(slot_estimate);
+        m_objects.reserve(slot_estimate);
+
+        loadNode(0, points.begin(), end, 0);
+        return count;
+    }
+
+private:
+    /// Maximum depth of the tree (the quadrants of coincident points can not be split forever).
+    static const std::size_t MaxDepth = 48;
+
+    /// The first slot of a node without a slot block.
+    static const std::size_t NoSlots = static_cast<std::size_t>(-1);
+
+    /// A normalised bounding box.
+    struct Bounds {
+        qreal min_x;
+        qreal min_y;
+        qreal max_x;
+        qreal max_y;
+
+        Bounds(qreal left, qreal top, qreal right, qreal bottom)
+                : min_x(left),
+                  min_y(top),
+                  max_x(right),
+                  max_y(bottom)
+        {
+        }
+
+        explicit Bounds(const QRectF &rect)
+                : min_x(std::min(rect.left(), rect.right())),
+                  min_y(std::min(rect.top(), rect.bottom())),
+                  max_x(std::max(rect.left(), rect.right())),
+                  max_y(std::max(rect.top(), rect.bottom()))
+        {
+        }
+
+        bool contains(qreal x, qreal y) const
+        {
+            return min_x <= x && x <= max_x && min_y <= y && y <= max_y;
+        }
+
+        bool contains(const Bounds &other) const
+        {
+            return min_x <= other.min_x && other.max_x <= max_x && min_y <= other.min_y && other.max_y <= max_y;
+        }
+
+        bool intersects(const Bounds &other) const
+        {
+            return min_x <= other.max_x && other.min_x <= max_x && min_y <= other.max_y && other.min_y <= max_y;
+        }
+    };
+
+    struct Node {
+        explicit Node(const Bounds &node_bounds)
+                : bounds(node_bounds),
+                  first_slot(NoSlots),
+                  first_child(0),
+                  count(0)
+        {
+        }
+
+        /// The boundary of the node.
+        Bounds bounds;
+
+        /// Index of the node's first slot, NoSlots until it stores a point.
+        std::size_t first_slot;
+
+        /// Index of the first of the four consecutive children, 0 if none (the root is never a child).
+        std::uint32_t first_child;
+
+        /// Number of points stored in the node's slots.
+        std::uint32_t count;
+    };
+
+    /*!
+     * Creates the four children of a node (without slots, allocated by store()).
+     * @param index The node index.
+     */
+    void subdivide(std::uint32_t index)
+    {
+        const Bounds bounds = m_nodes[index].bounds;
+        const qreal mid_x = bounds.min_x + (bounds.max_x - bounds.min_x) / 2.0;
+        const qreal mid_y = bounds.min_y + (bounds.max_y - bounds.min_y) / 2.0;
+
+        m_nodes[index].first_child = static_cast<std::uint32_t>(m_nodes.size());
+        m_nodes.emplace_back(Bounds(mid_x, bounds.min_y, bounds.max_x, mid_y));
+        m_nodes.emplace_back(Bounds(bounds.min_x, bounds.min_y, mid_x, mid_y));
+        m_nodes.emplace_back(Bounds(mid_x, mid_y, bounds.max_x, bounds.max_y));
+        m_nodes.emplace_back(Bounds(bounds.min_x, mid_y, mid_x, bounds.max_y));
+    }
+
+    /*!
+     * Fetches the first child of a node containing a point (the children cover the node, edges included).
+     * @param index The node index, which has children.
+     * @param x The point longitude.
+     * @param y The point latitude.
+     * @return the child index.
+     */
+    std::uint32_t childContaining(std::uint32_t index, qreal x, qreal y) const
+    {
+        const std::uint32_t first_child = m_nodes[index].first_child;
+        for (std::uint32_t child = first_child; child < first_child + 3; ++child) {
+            if (m_nodes[child].bounds.contains(x, y)) {
+                return child;
+            }
+        }
+        return first_child + 3;
+    }
+
+    void store(std::uint32_t index, qreal x, qreal y, const T &object)
+    {
+        // Allocate the node's slot block with its first point.
+        Node &node = m_nodes[index];
+        if (node.first_slot == NoSlots) {
+            node.first_slot = m_objects.size();
+            m_x.resize(node.first_slot + m_capacity, 0.0);
+            m_y.resize(node.first_slot + m_capacity, 0.0);
+            m_objects.resize(node.first_slot + m_capacity);
+        }
+
+        const std::size_t slot = node.first_slot + node.count++;
+        m_x[slot] = x;
+        m_y[slot] = y;
+        m_objects[slot] = object;
+    }
+
+    template <class Iterator>
+    void loadNode(std::uint32_t index, Iterator first, Iterator last, std::size_t depth)
+    {
+        // Fill the node's slots.
+        while (first != last && m_nodes[index].count < m_capacity) {
+            store(index, first->first.longitude(), first->first.latitude(), first->second);
+            ++first;
+        }
+        if (first == last) {
+            return;
+        }
+        if (depth >= MaxDepth) {
+            throw std::runtime_error("Unable to insert into quad tree container.");
+        }
+
+        // Partition the remaining points between the children (created if not yet).
+        if (m_nodes[index].first_child == 0) {
+            subdivide(index);
+        }
+        const std::uint32_t first_child = m_nodes[index].first_child;
+        for (std::uint32_t child = first_child; child < first_child + 4 && first != last; ++child) {
+            const Bounds bounds = m_nodes[child].bounds;
+            const bool last_child = child == first_child + 3;
+            const auto middle = last_child ? last : std::partition(first, last, [&bounds](const std::pair<PointWorldCoord, T> &point) {
+                return bounds.contains(point.first.longitude(), point.first.latitude());
+            });
+            loadNode(child, first, middle, depth + 1);
+            first = middle;
+        }
+    }
+
+    template <class Visitor>
+    void visitNode(std::uint32_t index, const Bounds &range, bool contained, Visitor &visitor) const
+    {
+        const Node &node = m_nodes[index];
+        if (contained == false) {
+            if (range.intersects(node.bounds) == false) {
+                return;
+            }
+            contained = range.contains(node.bounds);
+        }
+
+        const std::size_t begin = node.first_slot;
+        const std::size_t end = begin + node.count;
+        if (contained) {
+            // The whole node is within the range.
+            for (std::size_t slot = begin; slot < end; ++slot) {
+                visitor(m_objects[slot]);
+            }
+        } else {
+            // Test the coordinates without short-circuit, so the comparisons vectorise.
+            const qreal *xs = m_x.data();
+            const qreal *ys = m_y.data();
+            for (std::size_t slot = begin; slot < end; ++slot) {
+                const bool inside = (xs[slot] >= range.min_x) & (xs[slot] <= range.max_x) & (ys[slot] >= range.min_y) & (ys[slot] <= range.max_y);
+                if (inside) {
+                    visitor(m_objects[slot]);
+                }
+            }
+        }
+
+        if (node.first_child != 0) {
+            for (std::uint32_t child = node.first_child; child < node.first_child + 4; ++child) {
+                visitNode(child, range, contained, visitor);
+            }
+        }
+    }
+
+    void eraseFrom(std::uint32_t index, qreal x, qreal y, const T &object)
+    {
+        if (m_nodes[index].bounds.contains(x, y) == false) {
+            return;
+        }
+
+        // Remove the object, moving the node's last point into its slot.
+        const std::size_t begin = m_nodes[index].first_slot;
+        std::size_t slot = begin;
+        while (slot < begin + m_nodes[index].count) {
+            if (m_objects[slot] == object) {
+                const std::size_t last = begin + --m_nodes[index].count;
+                m_x[slot] = m_x[last];
+                m_y[slot] = m_y[last];
+                m_objects[slot] = std::move(m_objects[last]);
+                m_objects[last] = T();
+            } else {
+                ++slot;
+            }
+        }
+
+        const std::uint32_t first_child = m_nodes[index].first_child;
+        if (first_child != 0) {
+            for (std::uint32_t child = first_child; child < first_child + 4; ++child) {
+                eraseFrom(child, x, y, object);
+            }
+        }
+    }
+
+    /// The number of slots of a node.
+    const std::size_t m_capacity;
+
+    /// The boundary of the container.
+    const RectWorldCoord m_boundary;
+
+    /// The nodes, the root first.
+    std::vector<Node> m_nodes;
+
+    /// The point longitudes, capacity slots per node holding points.
+    std::vector<qreal> m_x;
+
+    /// The point latitudes, capacity slots per node holding points.
+    std::vector<qreal> m_y;
+
+    /// The objects, capacity slots per node holding points.
+    std::vector<T> m_objects;
+};
+
+template <class T>
+const std::size_t FlatQuadTreeContainer<T>::MaxDepth;
+
+template <class T>
+const std::size_t FlatQuadTreeContainer<T>::NoSlots;
+
+}
+
+#endif // QMAPCONTROL_FLATQUADTREECONTAINER_H
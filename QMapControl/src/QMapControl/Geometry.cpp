@@ -25,6 +25,9 @@
 
 #include "Geometry.h"
 
+// STL includes.
+#include <algorithm>
+
 namespace qmapcontrol
 {
     Geometry::Geometry(const GeometryType& geometry_type, const int& zoom_minimum, const int& zoom_maximum)
@@ -168,6 +171,23 @@ namespace qmapcontrol
         return m_metadata[key];
     }
 
+    QVariant Geometry::metadataValue(const std::string& key) const
+    {
+        // Default return value.
+        QVariant return_value;
+
+        // Find the key.
+        const auto find_itr = m_metadata.find(key);
+        if(find_itr != m_metadata.end())
+        {
+            // Fetch the value.
+            return_value = find_itr->second;
+        }
+
+        // Return the value.
+        return return_value;
+    }
+
     void Geometry::setMetadata(const std::string& key, const QVariant& value)
     {
         // Set the meta-data.
@@ -186,6 +206,19 @@ namespace qmapcontrol
         emit requestRedraw();
     }
 
+    qreal Geometry::extentPx() const
+    {
+        // The meta-data value is drawn as a text of any length.
+        if(m_metadata_displayed_key.empty() == false)
+        {
+            return -1.0;
+        }
+
+        // Half the pen width (a cosmetic pen is 1 pixel wide), plus a pixel for antialiasing.
+        const qreal pen_width_px(m_pen == nullptr ? 1.0 : std::max<qreal>(1.0, m_pen->widthF()));
+        return pen_width_px / 2.0 + 1.0;
+    }
+
     PointWorldPx Geometry::calculateTopLeftPoint(const PointWorldPx& point_px, const AlignmentType& alignment_type, const QSizeF& geometry_size_px) const
     {
         // Default world point to return.
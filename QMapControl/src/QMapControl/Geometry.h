@@ -241,6 +241,12 @@ namespace qmapcontrol
          */
         virtual RectWorldCoord boundingBox(const int& controller_zoom) const = 0;
 
+        /*!
+         * Fetches how far the geometry is drawn outside of its coordinates, at any zoom (eg: half its pen width).
+         * @return the extent in pixels, or a negative value if it cannot be bounded (eg: a displayed meta-data value).
+         */
+        virtual qreal extentPx() const;
+
         /*!
          * Checks if the geometry touches (intersects) with another geometry.
          * @param geometry The geometry to check against.
@@ -284,6 +290,13 @@ namespace qmapcontrol
         void requestRedraw() const;
 
     protected:
+        /*!
+         * Fetches a meta-data value without inserting it if missing (safe to call concurrently while drawing).
+         * @param key The meta-data key.
+         * @return the meta-data value, or a null QVariant if the key is not set.
+         */
+        QVariant metadataValue(const std::string& key) const;
+
         /* Helper functions */
 
         qreal sqr(qreal x) const { return x * x; }
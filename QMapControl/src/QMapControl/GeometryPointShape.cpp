@@ -1,5 +1,8 @@
 #include "GeometryPointShape.h"
 
+// STL includes.
+#include <cmath>
+
 // Local includes.
 #include "Projection.h"
 
@@ -146,6 +149,13 @@ namespace qmapcontrol
         return RectWorldCoord(projection::get().toPointWorldCoord(top_left_point_px, controller_zoom), projection::get().toPointWorldCoord(bottom_right_point_px, controller_zoom));
     }
 
+    qreal GeometryPointShape::extentPx() const
+    {
+        // The aligned shape touches its coordinate, and is rotated about its center: it stays within its diagonal.
+        const qreal extent_px(GeometryPoint::extentPx());
+        return extent_px < 0.0 ? extent_px : extent_px + std::hypot(m_size_px.width(), m_size_px.height());
+    }
+
     void GeometryPointShape::updateShape()
     {
         // Emit that we need to redraw to display this change.
@@ -151,6 +151,12 @@ namespace qmapcontrol
          */
         virtual RectWorldCoord boundingBox(const int& controller_zoom) const override;
 
+        /*!
+         * Fetches how far the shape is drawn from its coordinate (by its alignment and rotation), plus the pen.
+         * @return the extent in pixels, or a negative value if it cannot be bounded.
+         */
+        virtual qreal extentPx() const override;
+
     protected:
         /*!
          * Updates the shape.
@@ -101,6 +101,12 @@ namespace qmapcontrol
         return RectWorldCoord(projection::get().toPointWorldCoord(top_left_point_px, controller_zoom), projection::get().toPointWorldCoord(bottom_right_point_px, controller_zoom));
     }
 
+    qreal GeometryPointShapeScaled::extentPx() const
+    {
+        // The size depends on the zoom.
+        return -1.0;
+    }
+
     void GeometryPointShapeScaled::draw(QPainter &painter, const RectWorldCoord &backbuffer_rect_coord, const int &controller_zoom)
     {
         // Check the geometry is visible.
@@ -129,12 +135,12 @@ namespace qmapcontrol
                 painter.translate(-pixmap_rect_px.centerPx().rawPoint());
 
                 // Do we have a meta-data value and should we display it at this zoom?
-                if(controller_zoom >= m_metadata_displayed_zoom_minimum && metadata(m_metadata_displayed_key).isNull() == false)
+                if(controller_zoom >= m_metadata_displayed_zoom_minimum && metadataValue(m_metadata_displayed_key).isNull() == false)
                 {
                     /// @todo calculate correct alignment for metadata displayed offset.
 
                     // Draw the text next to the point with an offset.
-                    painter.drawText(pixmap_rect_px.rawRect().topRight() + PointPx(m_metadata_displayed_alignment_offset_px, -m_metadata_displayed_alignment_offset_px).rawPoint(), metadata(m_metadata_displayed_key).toString());
+                    painter.drawText(pixmap_rect_px.rawRect().topRight() + PointPx(m_metadata_displayed_alignment_offset_px, -m_metadata_displayed_alignment_offset_px).rawPoint(), metadataValue(m_metadata_displayed_key).toString());
                 }
             }
         }
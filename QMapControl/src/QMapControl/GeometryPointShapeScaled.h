@@ -152,6 +152,12 @@ namespace qmapcontrol
          */
         RectWorldCoord boundingBox(const int& controller_zoom) const final;
 
+        /*!
+         * The shape is scaled by the zoom, so how far it is drawn from its coordinate cannot be bounded.
+         * @return -1.
+         */
+        qreal extentPx() const final;
+
         /*!
          * Draws the geometry to a pixmap using the provided painter.
          * @param painter The painter that will draw to the pixmap.
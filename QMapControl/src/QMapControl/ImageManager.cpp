@@ -26,12 +26,16 @@
  */
 
 #include "ImageManager.h"
+#include "MapAdapter.h"
 #include "Projection.h"
 
 #include <QDateTime>
-#include <QtCore/QCryptographicHash>
+#include <QtCore/QMetaObject>
 #include <QtGui/QPainter>
 
+#include <algorithm>
+#include <cmath>
+
 namespace qmapcontrol
 {
     namespace
@@ -62,14 +66,27 @@ namespace qmapcontrol
     ImageManager::ImageManager(const int& tile_size_px, QObject* parent)
         : QObject(parent),
           m_tile_size_px(tile_size_px),
-          m_pixmap_loading()
+          m_disk_cache_capacity(0),
+          m_pixmap_loading(),
+          m_pixmap_unavailable()
     {
-        // Setup a loading pixmap.
+        // Register meta types (tile keys are queued from the rendering thread to the network manager).
+        qRegisterMetaType<TileKey>("TileKey");
+        qRegisterMetaType<DownloadPriority>("DownloadPriority");
+
+        // Setup the loading and unavailable pixmaps.
         setupLoadingPixmap();
+        setupUnavailablePixmap();
 
         // Connect signal/slot for image downloads.
         QObject::connect(this, &ImageManager::downloadImage, &m_nm, &NetworkManager::downloadImage);
+        QObject::connect(this, &ImageManager::updateDownloadPriority, &m_nm, &NetworkManager::updateDownloadPriority);
+        QObject::connect(this, &ImageManager::cancelDownloadsOutside, &m_nm, &NetworkManager::cancelDownloadsOutside);
+        QObject::connect(this, &ImageManager::revalidateImage, &m_nm, &NetworkManager::revalidateImage);
+        QObject::connect(&m_nm, &NetworkManager::imageNotModified, this, &ImageManager::imageNotModified);
         QObject::connect(&m_nm, &NetworkManager::imageDownloaded, this, &ImageManager::imageDownloaded);
+        QObject::connect(&m_nm, &NetworkManager::imageFailed, this, &ImageManager::imageFailed);
+        QObject::connect(&m_nm, &NetworkManager::imageBatchFinished, this, &ImageManager::imageBatchFinished);
         QObject::connect(&m_nm, &NetworkManager::downloadingInProgress, this, &ImageManager::downloadingInProgress);
         QObject::connect(&m_nm, &NetworkManager::downloadingFinished, this, &ImageManager::downloadingFinished);
     }
@@ -85,8 +102,9 @@ namespace qmapcontrol
         // Set the new tile size.
         m_tile_size_px = tile_size_px;
 
-        // Create a new loading pixmap.
+        // Create new loading and unavailable pixmaps.
         setupLoadingPixmap();
+        setupUnavailablePixmap();
     }
 
     void ImageManager::setProxy(const QNetworkProxy& proxy)
@@ -97,7 +115,17 @@ namespace qmapcontrol
 
     bool ImageManager::enablePersistentCache(const std::chrono::minutes& expiry, const QDir& path)
     {
+        // Replace the cache (the previous one completes its pending lookups first).
+        m_disk_cache.reset();
         m_disk_cache = std::make_unique<PersistentCache>(path, expiry);
+        m_disk_cache->setTileReadyCallback([this](const TileKey& key, const PersistentCache::Tile& tile) { diskTileReady(key, tile); });
+        m_disk_cache->setCapacity(m_disk_cache_capacity);
+
+        // Forget the lookups of the previous cache, the tiles are requested again.
+        {
+            QMutexLocker locker(&m_mutex_disk_lookups);
+            m_disk_lookups.clear();
+        }
         return true;
     }
 
@@ -107,37 +135,72 @@ namespace qmapcontrol
         m_nm.abortDownloads();
     }
 
+    void ImageManager::resetLoadingFailures()
+    {
+        // Forget the network manager failures.
+        m_nm.resetDownloadFailures();
+    }
+
     int ImageManager::loadQueueSize() const
     {
         // Return the network manager downloading queue size.
         return m_nm.downloadQueueSize();
     }
 
-    QPixmap ImageManager::getImage(const QUrl& url)
+    QPixmap ImageManager::getImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority, const qreal& distance)
+    {
+        // Scope the locker to ensure the mutex is release as soon as possible.
+        {
+            QMutexLocker locker(&m_mutex_prefetch_keys);
+
+            // The tile is now wanted on screen: if it was being prefetched, the coalesced download must notify.
+            m_prefetch_keys.remove(key);
+        }
+
+        // Fetch the image.
+        return fetchImage(mapadapter, key, priority, distance);
+    }
+
+    QPixmap ImageManager::fetchImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority, const qreal& distance)
     {
         // Holding resource for image to be loaded into.
         QPixmap return_pixmap(m_pixmap_loading);
 
+        // Is the image in our volatile "in-memory" cache (possibly stale, being revalidated)?
+        if (m_tile_cache.find(key, return_pixmap)) {
+            // The return image has been set to the "in-memory" cached version.
+        }
+        // Is the image already queued for download by the network manager?
+        else if(m_nm.isQueued(key))
+        {
+            // The caches have already been checked, just update its download priority.
+            emit updateDownloadPriority(key, priority, distance);
+        }
         // Is the image already been downloaded by the network manager?
-        if(m_nm.isDownloading(url) == false)
+        else if(m_nm.isDownloading(key) == false)
         {
-            // Is the image in our volatile "in-memory" cache?
-            const auto find_itr = m_pixmap_cache.find(md5hex(url));
-            if (find_itr != m_pixmap_cache.end()) {
-                // Set the return image to the "in-memory" cached version.
-                return_pixmap = find_itr->second;
-            }
-                // Is the persistent cache enabled?
-            else if (m_disk_cache != nullptr) {
-                auto hash = m_disk_cache->findPixmap(url, return_pixmap);
-                if (!hash.isEmpty()) {
-                    m_pixmap_cache[hash] = return_pixmap;
-                } else {
-                    emit downloadImage(url);
+            // Is the tile in the persistent cache (answered by its in-memory index)?
+            if (m_disk_cache != nullptr && m_disk_cache->contains(key)) {
+                // Look the tile up in the persistent cache (on its I/O thread), it is downloaded if not found.
+                const DiskLookup lookup{mapadapter.tileQuery(key.x(), key.y(), key.zoom()), priority, distance, true};
+                bool lookup_pending;
+                {
+                    QMutexLocker locker(&m_mutex_disk_lookups);
+                    lookup_pending = m_disk_lookups.contains(key);
+
+                    // Keep the latest priority for the download.
+                    m_disk_lookups.insert(key, lookup);
                 }
+
+                if (lookup_pending == false) {
+                    m_disk_cache->findTile(key);
+                }
+            } else if (m_nm.isUnavailable(key)) {
+                // The download failed recently, it is not requested again until its backoff expires.
+                return_pixmap = m_pixmap_unavailable;
             } else {
-                // Emit that we need to download the image using the network manager.
-                emit downloadImage(url);
+                // Emit that we need to download the image using the network manager (only now the url is generated).
+                emit downloadImage(key, mapadapter.tileQuery(key.x(), key.y(), key.zoom()), priority, distance);
             }
         }
 
@@ -145,15 +208,66 @@ namespace qmapcontrol
         return return_pixmap;
     }
 
-    QPixmap ImageManager::prefetchImage(const QUrl& url)
+    QPixmap ImageManager::prefetchImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority, const qreal& distance)
     {
-        QMutexLocker locker(&mMutex);
+        // Scope the locker to ensure the mutex is release as soon as possible.
+        {
+            QMutexLocker locker(&m_mutex_prefetch_keys);
 
-        // Add the url to the prefetch list.
-        m_prefetch_urls.append(url);
+            // Add the tile to the prefetch list.
+            m_prefetch_keys.insert(key);
+        }
+
+        // Return the image for the tile.
+        return fetchImage(mapadapter, key, priority, distance);
+    }
 
-        // Return the image for the url.
-        return getImage(url);
+    bool ImageManager::isLoadingPixmap(const QPixmap& pixmap) const
+    {
+        // Copies of the placeholder share its cache key.
+        return pixmap.cacheKey() == m_pixmap_loading.cacheKey();
+    }
+
+    bool ImageManager::findCachedImage(const TileKey& key, QPixmap& pixmap)
+    {
+        return m_tile_cache.peek(key, pixmap);
+    }
+
+    bool ImageManager::loadPersistentImage(const TileKey& key)
+    {
+        // Is the tile in the persistent cache (answered by its in-memory index, without counting a miss)?
+        if (m_disk_cache == nullptr || m_disk_cache->peek(key) == false) {
+            return false;
+        }
+
+        // Look the tile up, unless already being looked up (reported when found, never downloaded).
+        bool lookup_pending;
+        {
+            QMutexLocker locker(&m_mutex_disk_lookups);
+            lookup_pending = m_disk_lookups.contains(key);
+            if (lookup_pending == false) {
+                m_disk_lookups.insert(key, DiskLookup{QUrl(), DownloadPriority::OtherZoom, 0.0, false});
+            }
+        }
+
+        if (lookup_pending == false) {
+            m_disk_cache->findTile(key);
+        }
+
+        // The lookup is started.
+        return true;
+    }
+
+    void ImageManager::cancelLoadingOutside(const MapAdapter& mapadapter, const int& zoom, const QRect& tile_rect)
+    {
+        // Ask the network manager (in its own thread) to cancel the downloads no longer needed.
+        emit cancelDownloadsOutside(mapadapter.sourceId(), zoom, tile_rect);
+    }
+
+    void ImageManager::setMaxDownloadsPerHost(const int& max_downloads)
+    {
+        // Set the network manager download limit.
+        m_nm.setMaxDownloadsPerHost(max_downloads);
     }
 
     void ImageManager::setLoadingPixmap(const QPixmap &pixmap)
@@ -161,25 +275,97 @@ namespace qmapcontrol
         m_pixmap_loading = pixmap;
     }
 
-    void ImageManager::imageDownloaded(const QUrl& url, const QPixmap& pixmap)
+    void ImageManager::setUnavailablePixmap(const QPixmap &pixmap)
+    {
+        m_pixmap_unavailable = pixmap;
+    }
+
+    void ImageManager::setMemoryCacheCapacity(std::size_t capacity_bytes)
+    {
+        m_tile_cache.setCapacity(capacity_bytes);
+    }
+
+    TileCache::Statistics ImageManager::memoryCacheStatistics() const
+    {
+        return m_tile_cache.statistics();
+    }
+
+    void ImageManager::setPersistentCacheCapacity(qint64 capacity_bytes)
+    {
+        m_disk_cache_capacity = capacity_bytes;
+        if (m_disk_cache != nullptr) {
+            m_disk_cache->setCapacity(capacity_bytes);
+        }
+    }
+
+    PersistentCache::Statistics ImageManager::persistentCacheStatistics() const
+    {
+        return m_disk_cache != nullptr ? m_disk_cache->statistics() : PersistentCache::Statistics();
+    }
+
+    void ImageManager::imageDownloaded(const TileKey& key, const QPixmap& pixmap, const TilePayload& payload)
     {
 #ifdef QMAP_DEBUG
-        qDebug() << "ImageManager::imageDownloaded '" << url << "'";
+        qDebug() << "ImageManager::imageDownloaded '" << key.toString() << "'";
 #endif
 
-        m_pixmap_cache[md5hex(url)] = pixmap;
+        m_tile_cache.insert(key, pixmap);
 
+        // Store the tile as served (no re-encoding), it is written with the batch.
         if (m_disk_cache) {
-            m_disk_cache->insertPixmap(url, pixmap);
+            m_disk_cache->insertTile(key, payload);
         }
 
         // Is this a prefetch request?
-        if (m_prefetch_urls.contains(url)) {
-            // Remove the url from the prefetch list.
-            m_prefetch_urls.removeAt(m_prefetch_urls.indexOf(url));
+        bool prefetched;
+        {
+            QMutexLocker locker(&m_mutex_prefetch_keys);
+            prefetched = m_prefetch_keys.remove(key);
+        }
+
+        if (prefetched) {
+            // The tile has been removed from the prefetch list.
         } else {
-            // Let the world know we have received an updated image.
-            emit imageUpdated(url);
+            // Report the updated image at the end of the batch.
+            m_updated_keys.append(key);
+        }
+    }
+
+    void ImageManager::imageNotModified(const TileKey& key)
+    {
+        // The stale tile is up to date: keep serving it until it expires again.
+        if (m_disk_cache) {
+            m_disk_cache->refreshTile(key);
+        }
+    }
+
+    void ImageManager::imageFailed(const TileKey& key)
+    {
+        // Is this a prefetch request?
+        bool prefetched;
+        {
+            QMutexLocker locker(&m_mutex_prefetch_keys);
+            prefetched = m_prefetch_keys.remove(key);
+        }
+
+        if (prefetched == false) {
+            // Report the tile at the end of the batch, to display it as unavailable.
+            m_updated_keys.append(key);
+        }
+    }
+
+    void ImageManager::imageBatchFinished()
+    {
+        // Write the batch to the persistent cache in a single transaction.
+        if (m_disk_cache) {
+            m_disk_cache->flush();
+        }
+
+        // Let the world know we have received updated images (once for the whole batch).
+        if (!m_updated_keys.isEmpty()) {
+            QList<TileKey> updated_keys;
+            updated_keys.swap(m_updated_keys);
+            emit imagesUpdated(updated_keys);
         }
     }
 
@@ -201,13 +387,23 @@ namespace qmapcontrol
         painter.drawText(m_pixmap_loading.rect(), Qt::AlignCenter, "LOADING...");
     }
 
-QString ImageManager::md5hex(const QUrl &url)
-{
-    // Return the md5 hex value of the given url at a specific projection and tile size.
-    return QString(QCryptographicHash::hash(
-            (url.toString() + QString::number(projection::get().epsg()) + QString::number(m_tile_size_px)).toUtf8(),
-            QCryptographicHash::Md5).toHex());
-}
+    void ImageManager::setupUnavailablePixmap()
+    {
+        // Create a new pixmap.
+        m_pixmap_unavailable = QPixmap(m_tile_size_px, m_tile_size_px);
+
+        // Make is transparent.
+        m_pixmap_unavailable.fill(Qt::transparent);
+
+        // Add a pattern (distinct from the loading one).
+        QPainter painter(&m_pixmap_unavailable);
+        QBrush brush(Qt::gray, Qt::DiagCrossPattern);
+        painter.fillRect(m_pixmap_unavailable.rect(), brush);
+
+        // Add "UNAVAILABLE" text.
+        painter.setPen(Qt::darkRed);
+        painter.drawText(m_pixmap_unavailable.rect(), Qt::AlignCenter, "UNAVAILABLE");
+    }
 
 void ImageManager::startPersistentCacheHousekeeping()
 {
@@ -223,4 +419,96 @@ void ImageManager::clearPersistentCache()
     }
 }
 
+void ImageManager::warmUpPersistentCache(const MapAdapter& mapadapter, const RectWorldCoord& bbox, const int& min_zoom, const int& max_zoom)
+{
+    if (m_disk_cache == nullptr) {
+        return;
+    }
+
+    for (int zoom = min_zoom; zoom <= max_zoom; ++zoom) {
+        // The tiles covering the area at this zoom.
+        const PointWorldPx top_left_px(projection::get().toPointWorldPx(bbox.topLeftCoord(), zoom));
+        const PointWorldPx bottom_right_px(projection::get().toPointWorldPx(bbox.bottomRightCoord(), zoom));
+        const QRect tile_rect(QPoint(std::floor(std::min(top_left_px.x(), bottom_right_px.x()) / m_tile_size_px),
+                                     std::floor(std::min(top_left_px.y(), bottom_right_px.y()) / m_tile_size_px)),
+                              QPoint(std::floor(std::max(top_left_px.x(), bottom_right_px.x()) / m_tile_size_px),
+                                     std::floor(std::max(top_left_px.y(), bottom_right_px.y()) / m_tile_size_px)));
+
+        m_disk_cache->readAhead(mapadapter.tileKey(tile_rect.left(), tile_rect.top(), zoom), tile_rect);
+    }
+}
+
+void ImageManager::diskTileReady(const TileKey& key, const PersistentCache::Tile& tile)
+{
+    bool schedule_flush;
+    {
+        QMutexLocker locker(&m_mutex_disk_tiles);
+
+        // The first tile of a batch schedules the delivery, the following ones join the batch.
+        schedule_flush = m_disk_tiles.isEmpty();
+        m_disk_tiles.append(std::make_pair(key, tile));
+    }
+
+    // Schedule the delivery in the image manager's thread.
+    if (schedule_flush) {
+        QMetaObject::invokeMethod(this, "flushDiskTiles", Qt::QueuedConnection);
+    }
+}
+
+void ImageManager::flushDiskTiles()
+{
+    // Take the tiles read so far.
+    QList<std::pair<TileKey, PersistentCache::Tile>> disk_tiles;
+    {
+        QMutexLocker locker(&m_mutex_disk_tiles);
+        disk_tiles.swap(m_disk_tiles);
+    }
+
+    for (const auto& disk_tile : disk_tiles) {
+        const auto& key = disk_tile.first;
+        const auto& tile = disk_tile.second;
+
+        // Was the tile requested (rather than read ahead)?
+        bool requested;
+        DiskLookup lookup;
+        {
+            QMutexLocker locker(&m_mutex_disk_lookups);
+            requested = m_disk_lookups.contains(key);
+            if (requested) {
+                lookup = m_disk_lookups.take(key);
+            }
+        }
+
+        if (tile.image.isNull()) {
+            // Not in the persistent cache: download it.
+            if (requested && lookup.download) {
+                emit downloadImage(key, lookup.url, lookup.priority, lookup.distance);
+            }
+            continue;
+        }
+
+        m_tile_cache.insert(key, QPixmap::fromImage(tile.image));
+
+        // An expired tile is displayed meanwhile, and revalidated in the background.
+        if (requested && lookup.download && tile.stale) {
+            emit revalidateImage(key, lookup.url, tile.etag, tile.last_modified, DownloadPriority::FarPrefetch, lookup.distance);
+        }
+
+        // Is this a prefetch request?
+        bool prefetched;
+        {
+            QMutexLocker locker(&m_mutex_prefetch_keys);
+            prefetched = m_prefetch_keys.remove(key);
+        }
+
+        if (requested && prefetched == false) {
+            // Report the updated image at the end of the batch.
+            m_updated_keys.append(key);
+        }
+    }
+
+    // Report the batch (and write the access times).
+    imageBatchFinished();
+}
+
 }
@@ -33,24 +33,38 @@
 #include "qmapcontrol_global.h"
 #include "NetworkManager.h"
 #include "PersistentCache.h"
+#include "Point.h"
+#include "TileCache.h"
+#include "TileKey.h"
 
 #include <QtCore/QDir>
-#include <QtCore/QObject>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QRect>
+#include <QtCore/QSet>
 #include <QtCore/QUrl>
+#include <QtGui/QImage>
 #include <QtGui/QPixmap>
 #include <QtNetwork/QNetworkProxy>
 
 #include <chrono>
-#include <map>
 #include <memory>
+#include <utility>
 
 /*!
+ * Threading contract: getImage() and prefetchImage() are called from the rendering thread, everything else (the
+ * configuration setters and the network slots) from the GUI thread. The tile cache is safe to share between them, the
+ * prefetch set has its own mutex, and tiles are never fetched from the network from the rendering thread directly:
+ * the download requests are queued to the network manager through signals.
+ *
  * @author Kai Winter <kaiwinter@gmx.de>
  * @author Chris Stylianou <chris5287@gmail.com>
  */
 namespace qmapcontrol
 {
+    class MapAdapter;
+
     class QMAPCONTROL_EXPORT ImageManager : public QObject
     {
         Q_OBJECT
@@ -101,19 +115,28 @@ namespace qmapcontrol
         bool enablePersistentCache(const std::chrono::minutes &expiry, const QDir &path);
 
         /**
-         * @brief Starts the Persistent cache housekeeping. Scan the current cache for expired enties, and remove them.
-         * This function should be called just after the enablePersistentCache(), preferably in a separate thread using
-         * QtConcurrent for example.
-         * Indeed the persistentCacheFind only removes the files that are searched for, this means that
-         * even if a file has expired, it will remain in cache forever if never accessed.
+         * @brief Starts the Persistent cache housekeeping. Remove the expired entries (on the cache I/O thread).
+         * This function should be called just after the enablePersistentCache().
+         * Indeed the persistent cache lookups only remove the tiles that are searched for, this means that
+         * even if a tile has expired, it will remain in cache forever if never accessed.
          */
         void startPersistentCacheHousekeeping();
 
         /**
-         * @brief Remove all the files in the persistent cache, regardless of the expiration.
+         * @brief Remove all the tiles in the persistent cache, regardless of the expiration.
          */
         void clearPersistentCache();
 
+        /*!
+         * Reads ahead the persistent cache tiles of an area, loading them into the in-memory cache (on the persistent
+         * cache I/O thread), so they are displayed without any disk access.
+         * @param mapadapter The map adapter of the tiles.
+         * @param bbox The area to read, in world coordinates.
+         * @param min_zoom The lowest zoom to read.
+         * @param max_zoom The highest zoom to read.
+         */
+        void warmUpPersistentCache(const MapAdapter& mapadapter, const RectWorldCoord& bbox, const int& min_zoom, const int& max_zoom);
+
 
         /*!
          * Aborts all current loading threads.
@@ -121,6 +144,12 @@ namespace qmapcontrol
          */
         void abortLoading();
 
+        /*!
+         * Forgets the failed downloads, so the unavailable tiles are requested again (eg: once the network connection
+         * is restored).
+         */
+        void resetLoadingFailures();
+
         /*!
          * Number of images pending in the load queue.
          * @return the number of images pending in the load queue.
@@ -133,11 +162,15 @@ namespace qmapcontrol
          * enabled).
          * If the image does not exist, then it is fetched using a network manager and a "loading"
          * placeholder pixmap is returned. Once the image has been downloaded, the image manager
-         * will emit "imageReceived" to inform that the image is now ready.
-         * @param url The image url to fetch.
+         * will emit "imageReceived" to inform that the image is now ready. If the download failed
+         * recently, an "unavailable" placeholder pixmap is returned instead (see NetworkManager::isUnavailable()).
+         * @param mapadapter The map adapter providing the tile (only used to build the url on a cache miss).
+         * @param key The key of the tile to fetch.
+         * @param priority The download priority, if the image must be downloaded.
+         * @param distance The distance of the tile from the viewport center (in tiles), orders same priority downloads.
          * @return the pixmap of the image.
          */
-        QPixmap getImage(const QUrl& url);
+        QPixmap getImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority = DownloadPriority::Visible, const qreal& distance = 0.0);
 
         /*!
          * Fetches the requested image using the getImage function, which has been deemed
@@ -145,10 +178,53 @@ namespace qmapcontrol
          * However, if the image need to be fetched from the network, the "imageReceived" will be
          * emitted on particular hardware platforms only (Eg: mobile platforms do not receive the
          * "imageReceived" emission.
-         * @param url The image url to fetch.
+         * @param mapadapter The map adapter providing the tile (only used to build the url on a cache miss).
+         * @param key The key of the tile to fetch.
+         * @param priority The download priority, if the image must be downloaded.
+         * @param distance The distance of the tile from the viewport center (in tiles), orders same priority downloads.
          * @return the pixmap of the image.
          */
-        QPixmap prefetchImage(const QUrl& url);
+        QPixmap prefetchImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority = DownloadPriority::FarPrefetch, const qreal& distance = 0.0);
+
+        /*!
+         * Checks whether a pixmap returned by getImage() is the "loading" placeholder.
+         * @param pixmap The pixmap returned by getImage().
+         * @return whether the image is still loading.
+         */
+        bool isLoadingPixmap(const QPixmap& pixmap) const;
+
+        /*!
+         * Fetches an image from the in-memory cache only, without counting the lookup or requesting anything (eg: to
+         * draw a cached tile of another zoom level while a tile is loading).
+         * @param key The key of the tile to fetch.
+         * @param pixmap Set to the cached pixmap if found, untouched otherwise.
+         * @return whether the image was found.
+         */
+        bool findCachedImage(const TileKey& key, QPixmap& pixmap);
+
+        /*!
+         * Loads an image from the persistent cache into the in-memory cache, in the background, without downloading it
+         * if not found. Once loaded, it is reported through imagesUpdated(). The lookup is not counted in the persistent
+         * cache statistics.
+         * @param key The key of the tile to load.
+         * @return whether the tile may be in the persistent cache (its lookup is started or already pending).
+         */
+        bool loadPersistentImage(const TileKey& key);
+
+        /*!
+         * Cancels the downloads of a map adapter's tiles that are no longer needed by the viewport.
+         * @param mapadapter The map adapter providing the tiles.
+         * @param zoom The zoom level displayed.
+         * @param tile_rect The tiles still needed (viewport and prefetch margins), in tile coordinates.
+         * @see NetworkManager::cancelDownloadsOutside()
+         */
+        void cancelLoadingOutside(const MapAdapter& mapadapter, const int& zoom, const QRect& tile_rect);
+
+        /*!
+         * Set the maximum number of concurrent tile downloads for each host (further downloads are queued).
+         * @param max_downloads The maximum number of concurrent downloads for each host.
+         */
+        void setMaxDownloadsPerHost(const int& max_downloads);
 
         /*!
          * \brief setLoadingPixmap sets the pixmap displayed when a tile is not yet loaded
@@ -156,12 +232,74 @@ namespace qmapcontrol
          */
         void setLoadingPixmap (const QPixmap &pixmap);
 
+        /*!
+         * \brief setUnavailablePixmap sets the pixmap displayed when a tile failed to download (it is not requested
+         * again until its backoff delay expires)
+         * \param pixmap the pixmap to display
+         */
+        void setUnavailablePixmap (const QPixmap &pixmap);
+
+        /*!
+         * Set the byte budget of the in-memory tile cache (least recently used tiles are evicted beyond it).
+         * @param capacity_bytes The maximum number of bytes the cached tiles can use.
+         */
+        void setMemoryCacheCapacity(std::size_t capacity_bytes);
+
+        /*!
+         * Fetches the in-memory tile cache usage counters.
+         * @return the in-memory tile cache statistics.
+         */
+        TileCache::Statistics memoryCacheStatistics() const;
+
+        /*!
+         * Set the byte quota of the persistent cache (least recently used tiles are evicted beyond it, overview tiles
+         * last). It is applied to the persistent cache when enabled.
+         * @param capacity_bytes The maximum number of bytes the stored tiles can use, 0 if unbounded.
+         */
+        void setPersistentCacheCapacity(qint64 capacity_bytes);
+
+        /*!
+         * Fetches the persistent cache usage counters.
+         * @return the persistent cache statistics (all zero if the persistent cache is not enabled).
+         */
+        PersistentCache::Statistics persistentCacheStatistics() const;
+
     signals:
         /*!
          * Signal emitted to schedule an image resource to be downloaded.
+         * @param key The key of the tile to download.
          * @param url The image url to download.
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles).
          */
-        void downloadImage(const QUrl& url);
+        void downloadImage(const TileKey& key, const QUrl& url, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Signal emitted to update the priority of a queued image download.
+         * @param key The key of the tile.
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles).
+         */
+        void updateDownloadPriority(const TileKey& key, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Signal emitted to cancel the downloads no longer needed by the viewport.
+         * @param source_id The tile source.
+         * @param zoom The zoom level displayed.
+         * @param tile_rect The tiles still needed, in tile coordinates.
+         */
+        void cancelDownloadsOutside(const quint32& source_id, const int& zoom, const QRect& tile_rect);
+
+        /*!
+         * Signal emitted to schedule the revalidation of an expired image (a conditional download).
+         * @param key The key of the tile to revalidate.
+         * @param url The image url to download.
+         * @param etag The ETag of the expired image.
+         * @param last_modified The Last-Modified date of the expired image.
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles).
+         */
+        void revalidateImage(const TileKey& key, const QUrl& url, const QByteArray& etag, const QDateTime& last_modified, const DownloadPriority& priority, const qreal& distance);
 
         /*!
          * Signal emitted when a new image has been queued for download.
@@ -175,18 +313,43 @@ namespace qmapcontrol
         void downloadingFinished();
 
         /*!
-         * Signal emitted when an image has been downloaded by the network manager.
-         * @param url The url that the image was downloaded from.
+         * Signal emitted when images have been downloaded by the network manager.
+         * Downloads are coalesced: the signal is emitted once for each batch of images delivered (prefetched images
+         * are not reported). Images that failed to download are reported too, to be displayed as unavailable.
+         * @param keys The keys of the tiles that were downloaded.
          */
-        void imageUpdated(const QUrl& url);
+        void imagesUpdated(const QList<TileKey>& keys);
 
     private slots:
         /*!
          * Slot to handle an image that has been downloaded.
-         * @param url The url that the image was downloaded from.
+         * @param key The key of the tile that was downloaded.
          * @param pixmap The image.
+         * @param payload The image as served, stored in the persistent cache.
+         */
+        void imageDownloaded(const TileKey& key, const QPixmap& pixmap, const TilePayload& payload);
+
+        /*!
+         * Slot to handle an expired image the server reported as not modified, refreshed in the persistent cache.
+         * @param key The key of the tile.
+         */
+        void imageNotModified(const TileKey& key);
+
+        /*!
+         * Slot to handle an image that failed to download, reported to be displayed as unavailable.
+         * @param key The key of the tile.
+         */
+        void imageFailed(const TileKey& key);
+
+        /*!
+         * Slot to handle the end of a batch of downloaded images.
          */
-        void imageDownloaded(const QUrl& url, const QPixmap& pixmap);
+        void imageBatchFinished();
+
+        /*!
+         * Slot to deliver the tiles read from the persistent cache so far.
+         */
+        void flushDiskTiles();
 
     private:
         //! Constructor.
@@ -209,18 +372,26 @@ namespace qmapcontrol
         void setupLoadingPixmap();
 
         /*!
-         * Generate a md5 hex for the given url.
-         * @param url The url to generate a md5 hex for.
-         * @return the md5 hex of the url.
+         * Create an unavailable pixmap for use.
          */
-        QString md5hex(const QUrl& url);
+        void setupUnavailablePixmap();
 
         /*!
-         * Generate the persistent file path for the given url.
-         * @param url The url to generate a file path for.
-         * @return the file path for the url.
+         * Fetch the requested image from the caches, or schedule its download (see getImage()).
+         * @param mapadapter The map adapter providing the tile.
+         * @param key The key of the tile to fetch.
+         * @param priority The download priority, if the image must be downloaded.
+         * @param distance The distance of the tile from the viewport center (in tiles).
+         * @return the pixmap of the image.
          */
-        QString persistentCacheFilename(const QUrl& url);
+        QPixmap fetchImage(const MapAdapter& mapadapter, const TileKey& key, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Collects a tile read from the persistent cache (called on its I/O thread), and schedules its delivery.
+         * @param key The key of the tile.
+         * @param tile The tile, with a null image if the tile was not found.
+         */
+        void diskTileReady(const TileKey& key, const PersistentCache::Tile& tile);
 
         /*!
          * Finds and loads the requested image if is exists in the persistent cache.
@@ -239,22 +410,57 @@ namespace qmapcontrol
 //        bool persistentCacheInsert(const QUrl &url, const QPixmap &pixmap);
 
     private:
-        QMutex mMutex;
-
     /// Network manager.
     NetworkManager m_nm;
 
     /// Cache of pixmaps already loaded.
-    std::map<QString, QPixmap> m_pixmap_cache;
+    TileCache m_tile_cache;
 
     /// The tile size in pixels.
     int m_tile_size_px;
 
+    /// The byte quota of the persistent cache (0 if unbounded).
+    qint64 m_disk_cache_capacity;
+
     /// Pixmap of an empty image with "LOADING..." text.
     QPixmap m_pixmap_loading;
 
-    /// A list of image urls being prefetched.
-    QList<QUrl> m_prefetch_urls;
+    /// Pixmap of an empty image with "UNAVAILABLE" text.
+    QPixmap m_pixmap_unavailable;
+
+    /// Mutex protecting the prefetch set.
+    QMutex m_mutex_prefetch_keys;
+
+    /// The tiles being prefetched.
+    QSet<TileKey> m_prefetch_keys;
+
+    /// The tiles downloaded in the current batch, to report.
+    QList<TileKey> m_updated_keys;
+
+    /// A tile being looked up in the persistent cache, downloaded if not found.
+    struct DiskLookup
+    {
+        /// The image url to download.
+        QUrl url;
+        /// The download priority.
+        DownloadPriority priority;
+        /// The distance from the viewport center (in tiles).
+        qreal distance;
+        /// Whether to download the tile if not found (or revalidate it if expired).
+        bool download;
+    };
+
+    /// Mutex protecting the persistent cache lookups.
+    QMutex m_mutex_disk_lookups;
+
+    /// The tiles being looked up in the persistent cache.
+    QHash<TileKey, DiskLookup> m_disk_lookups;
+
+    /// Mutex protecting the tiles read from the persistent cache.
+    QMutex m_mutex_disk_tiles;
+
+    /// The tiles read from the persistent cache, waiting to be delivered.
+    QList<std::pair<TileKey, PersistentCache::Tile>> m_disk_tiles;
 
     std::unique_ptr<PersistentCache> m_disk_cache;
 };
@@ -25,8 +25,54 @@
 
 #include "Layer.h"
 
+// Qt includes.
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QFuture>
+
+// STL includes.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
 namespace qmapcontrol
 {
+    namespace
+    {
+        /*!
+         * Scrolls the content of an image in place (the exposed pixels are left untouched).
+         * @param image The image to scroll.
+         * @param dx The horizontal offset, in pixels (positive to move the content right).
+         * @param dy The vertical offset, in pixels (positive to move the content down).
+         */
+        void scrollImage(QImage& image, const int& dx, const int& dy)
+        {
+            // Row geometry.
+            uchar* bits = image.bits();
+            const int bytes_per_line = image.bytesPerLine();
+            const int bytes_per_pixel = image.depth() / 8;
+            const int copy_bytes = (image.width() - std::abs(dx)) * bytes_per_pixel;
+            const int src_offset = std::max(0, -dx) * bytes_per_pixel;
+            const int dst_offset = std::max(0, dx) * bytes_per_pixel;
+
+            // Move the rows (bottom up when moving down, so the source rows are not overwritten before being read).
+            if(dy > 0)
+            {
+                for(int y = image.height() - 1; y >= dy; --y)
+                {
+                    std::memmove(bits + y * bytes_per_line + dst_offset, bits + (y - dy) * bytes_per_line + src_offset, copy_bytes);
+                }
+            }
+            else
+            {
+                for(int y = 0; y < image.height() + dy; ++y)
+                {
+                    std::memmove(bits + y * bytes_per_line + dst_offset, bits + (y - dy) * bytes_per_line + src_offset, copy_bytes);
+                }
+            }
+        }
+    }
+
     Layer::Layer(const LayerType& layer_type, const std::string& name, const int& zoom_minimum, const int& zoom_maximum, QObject* parent)
         : QObject(parent),
           m_layer_type(layer_type),
@@ -34,9 +80,12 @@ namespace qmapcontrol
           m_mouse_events_enabled(true),
           m_name(name),
           m_zoom_minimum(zoom_minimum),
-          m_zoom_maximum(zoom_maximum)
+          m_zoom_maximum(zoom_maximum),
+          m_surface_zoom(-1),
+          m_surface_dirty(true)
     {
-
+        // Any redraw request marks the cached surface as dirty (directly, as it may be emitted from any thread).
+        QObject::connect(this, &Layer::requestRedraw, this, &Layer::invalidateSurface, Qt::DirectConnection);
     }
 
     Layer::LayerType Layer::getLayerType() const
@@ -115,4 +164,181 @@ namespace qmapcontrol
         // Set whether to enable mouse events.
         m_mouse_events_enabled = enable;
     }
+
+    void Layer::drawCached(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, QThreadPool* render_pool)
+    {
+        // Nothing to draw if the layer is not visible.
+        if(isVisible(controller_zoom) == false)
+        {
+            return;
+        }
+
+        // The surface covers the whole backbuffer.
+        const QSize surface_size(backbuffer_rect_px.rawRect().size().toSize());
+
+        // How far has the backbuffer been panned since the surface was rendered?
+        const QPointF delta_px(backbuffer_rect_px.topLeftPx().rawPoint() - m_surface_rect_px.topLeftPx().rawPoint());
+        const QPoint delta(delta_px.toPoint());
+
+        // Can the features be drawn in parts? (otherwise a part would clip the features straddling its edge)
+        const bool bounded_extent = maxFeatureExtentPx() >= 0.0;
+
+        // Can the cached surface be kept? (the dirty flag is cleared first, so changes during the render are kept)
+        const bool dirty = m_surface_dirty.exchange(false);
+        const bool scrollable = bounded_extent && dirty == false && m_surface.size() == surface_size && m_surface_zoom == controller_zoom &&
+                delta_px == QPointF(delta) && std::abs(delta.x()) < surface_size.width() && std::abs(delta.y()) < surface_size.height();
+
+        // Has the backbuffer only been panned by whole pixels?
+        if(scrollable)
+        {
+            // Anything to do?
+            if(delta.isNull() == false)
+            {
+                // Scroll the surface content (it moves the opposite way of the backbuffer).
+                scrollImage(m_surface, -delta.x(), -delta.y());
+
+                // Render the exposed rows.
+                QRect exposed_columns(m_surface.rect());
+                if(delta.y() != 0)
+                {
+                    const QRect exposed_rows(0, delta.y() > 0 ? surface_size.height() - delta.y() : 0, surface_size.width(), std::abs(delta.y()));
+                    renderSurfaceRect(exposed_rows, backbuffer_rect_px, controller_zoom, painter.renderHints());
+
+                    // The exposed columns do not need to cover the exposed rows again.
+                    exposed_columns.setTop(delta.y() > 0 ? 0 : exposed_rows.bottom() + 1);
+                    exposed_columns.setHeight(surface_size.height() - exposed_rows.height());
+                }
+
+                // Render the exposed columns.
+                if(delta.x() != 0)
+                {
+                    exposed_columns.setLeft(delta.x() > 0 ? surface_size.width() - delta.x() : 0);
+                    exposed_columns.setWidth(std::abs(delta.x()));
+                    renderSurfaceRect(exposed_columns, backbuffer_rect_px, controller_zoom, painter.renderHints());
+                }
+            }
+        }
+        else
+        {
+            // Reuse the surface allocation if possible.
+            if(m_surface.size() != surface_size)
+            {
+                m_surface = QImage(surface_size, QImage::Format_ARGB32_Premultiplied);
+            }
+
+            // Render the whole surface (as concurrent bands if possible).
+            if(render_pool != nullptr && render_pool->maxThreadCount() > 1 && supportsConcurrentDraw() && bounded_extent)
+            {
+                renderSurfaceBands(backbuffer_rect_px, controller_zoom, painter.renderHints(), *render_pool);
+            }
+            else
+            {
+                renderSurfaceRect(m_surface.rect(), backbuffer_rect_px, controller_zoom, painter.renderHints());
+            }
+        }
+
+        // Remember what the surface was rendered for.
+        m_surface_rect_px = backbuffer_rect_px;
+        m_surface_zoom = controller_zoom;
+
+        // Compose the surface into the backbuffer.
+        painter.save();
+        painter.resetTransform();
+        painter.drawImage(0, 0, m_surface);
+        painter.restore();
+    }
+
+    void Layer::invalidateSurface()
+    {
+        // Mark the cached surface as dirty.
+        m_surface_dirty = true;
+    }
+
+    bool Layer::supportsConcurrentDraw() const
+    {
+        // Layers must opt-in.
+        return false;
+    }
+
+    qreal Layer::maxFeatureExtentPx() const
+    {
+        // Layers must bound it.
+        return -1.0;
+    }
+
+    void Layer::drawExposed(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const RectWorldPx& exposed_rect_px, const int& controller_zoom) const
+    {
+        // How far can a feature outside of the exposed rect be drawn into it?
+        const qreal margin_px = maxFeatureExtentPx();
+
+        // Draw the features around the exposed rect, or all of them if unbounded (the painter is clipped to it).
+        draw(painter, margin_px < 0.0 ? backbuffer_rect_px : RectWorldPx(exposed_rect_px.rawRect().adjusted(-margin_px, -margin_px, margin_px, margin_px)), controller_zoom);
+    }
+
+    void Layer::renderSurfaceRect(const QRect& surface_rect, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, const QPainter::RenderHints& render_hints)
+    {
+        // Create a painter for the surface.
+        QPainter surface_painter(&m_surface);
+        surface_painter.setRenderHints(render_hints);
+
+        // Clear the surface rect.
+        surface_painter.setCompositionMode(QPainter::CompositionMode_Source);
+        surface_painter.fillRect(surface_rect, Qt::transparent);
+        surface_painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+
+        // Is it the whole surface?
+        if(surface_rect == m_surface.rect())
+        {
+            // Render the layer, translated to the backbuffer top/left point.
+            surface_painter.translate(-backbuffer_rect_px.topLeftPx().rawPoint());
+            draw(surface_painter, backbuffer_rect_px, controller_zoom);
+        }
+        else
+        {
+            // Render the exposed part only, translated to the backbuffer top/left point.
+            surface_painter.setClipRect(surface_rect);
+            surface_painter.translate(-backbuffer_rect_px.topLeftPx().rawPoint());
+            drawExposed(surface_painter, backbuffer_rect_px, RectWorldPx(QRectF(surface_rect).translated(backbuffer_rect_px.topLeftPx().rawPoint())), controller_zoom);
+        }
+    }
+
+    void Layer::renderSurfaceBands(const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, const QPainter::RenderHints& render_hints, QThreadPool& render_pool)
+    {
+        // Access the surface pixels (detaching here, so the bands below share the same pixels).
+        uchar* bits = m_surface.bits();
+        const int bytes_per_line = m_surface.bytesPerLine();
+
+        const int width = m_surface.width();
+        const QImage::Format format = m_surface.format();
+
+        // Split the surface into one band per thread.
+        const int band_count = std::min(render_pool.maxThreadCount(), m_surface.height());
+        const int band_height = (m_surface.height() + band_count - 1) / band_count;
+
+        // Loop through each band to render it in the render pool.
+        std::vector<QFuture<void>> futures;
+        for(int band_top = 0; band_top < m_surface.height(); band_top += band_height)
+        {
+            const int height = std::min(band_height, m_surface.height() - band_top);
+            futures.push_back(QtConcurrent::run(&render_pool, [=]()
+            {
+                // An image over the band's rows of the surface (no copy, the bands are disjoint).
+                QImage band(bits + band_top * bytes_per_line, width, height, bytes_per_line, format);
+                band.fill(Qt::transparent);
+
+                // Render the band, translated to its backbuffer top/left point.
+                QPainter band_painter(&band);
+                band_painter.setRenderHints(render_hints);
+                const QPointF band_top_left_px(backbuffer_rect_px.topLeftPx().rawPoint() + QPointF(0.0, band_top));
+                band_painter.translate(-band_top_left_px);
+                drawExposed(band_painter, backbuffer_rect_px, RectWorldPx(QRectF(band_top_left_px, QSizeF(width, height))), controller_zoom);
+            }));
+        }
+
+        // Wait for all the bands to be rendered.
+        for(auto& future : futures)
+        {
+            future.waitForFinished();
+        }
+    }
 }
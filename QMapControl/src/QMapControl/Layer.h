@@ -27,11 +27,14 @@
 
 // Qt includes.
 #include <QtCore/QObject>
+#include <QtCore/QThreadPool>
 #include <QtCore/QVariant>
+#include <QtGui/QImage>
 #include <QtGui/QMouseEvent>
 #include <QtGui/QPainter>
 
 // STL includes.
+#include <atomic>
 #include <map>
 #include <string>
 
@@ -45,6 +48,8 @@ namespace qmapcontrol
     /*!
      * Layer can display "stuff".
      * See the specialised layer types to display each type of stuff (eg: MapAdapters, Geometries, etc...).
+     * Each layer caches its rendering in a surface, which is only re-rendered when the layer is dirty (see
+     * requestRedraw() and invalidateSurface()) or the backbuffer rect/zoom has changed.
      *
      * @author Kai Winter <kaiwinter@gmx.de>
      * @author Chris Stylianou <chris5287@gmail.com>
@@ -161,9 +166,58 @@ namespace qmapcontrol
          */
         virtual void draw(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom) const = 0;
 
+        /*!
+         * Whether drawExposed() can be called concurrently from several threads (for disjoint rects).
+         * Layers that support it have their cached surface rendered in parallel bands (see drawCached()).
+         * @return whether the layer supports concurrent drawing (false by default).
+         */
+        virtual bool supportsConcurrentDraw() const;
+
+        /*!
+         * Fetches how far the layer's features are drawn outside of their coordinates, so the exposed strips of a
+         * scrolled surface also draw the features that straddle their edge (see drawExposed()).
+         * @return the extent in pixels, or a negative value if it cannot be bounded, in which case the whole surface is
+         * rendered instead (the default).
+         */
+        virtual qreal maxFeatureExtentPx() const;
+
+        /*!
+         * Draws the part of the layer exposed when the backbuffer has been scrolled (the painter is clipped to it).
+         * The default implementation calls draw() with the exposed rect, inflated by maxFeatureExtentPx() so the
+         * features that straddle its edge are drawn too. Layers whose draw() relies on the whole backbuffer rect should
+         * override it.
+         * @param painter The painter that will draw to the pixmap.
+         * @param backbuffer_rect_px The whole backbuffer rect (pixels).
+         * @param exposed_rect_px The exposed part of the backbuffer rect (pixels).
+         * @param controller_zoom The current controller zoom.
+         */
+        virtual void drawExposed(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const RectWorldPx& exposed_rect_px, const int& controller_zoom) const;
+
+        /*!
+         * Draws the layer's cached surface using the provided painter, re-rendering it with draw() first if the layer
+         * is dirty or the zoom has changed since it was rendered. If the backbuffer has only been panned by whole
+         * pixels and the layer bounds its features' extent, the surface is scrolled and only the exposed strips are
+         * rendered (see drawExposed()). If a render pool is given and the layer supports concurrent drawing (and bounds
+         * its features' extent), the whole surface is rendered as one horizontal band per pool thread, drawn
+         * concurrently.
+         * This must only be called by the rendering thread.
+         * @param painter The painter that will draw to the backbuffer (the surface is drawn at the backbuffer origin).
+         * @param backbuffer_rect_px Only draw map tiles/geometries that are contained in the backbuffer rect (pixels).
+         * @param controller_zoom The current controller zoom.
+         * @param render_pool The thread pool to render the surface bands, or nullptr to render on the calling thread.
+         */
+        void drawCached(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, QThreadPool* render_pool = nullptr);
+
+        /*!
+         * Marks the layer's cached surface as dirty, so it is re-rendered at the next redraw.
+         * This is done automatically when requestRedraw() is emitted, and can be called from any thread.
+         */
+        void invalidateSurface();
+
     signals:
         /*!
-         * Signal emitted when a change has occurred that requires the layer to be redrawn.
+         * Signal emitted when a change has occurred that requires the layer to be redrawn (this also marks the layer's
+         * cached surface as dirty).
          */
         void requestRedraw() const;
 
@@ -174,6 +228,25 @@ namespace qmapcontrol
         //! Disable copy assignment.
         Layer& operator=(const Layer&); /// @todo remove once MSVC supports default/delete syntax.
 
+    private:
+        /*!
+         * Renders part of the cached surface.
+         * @param surface_rect The part of the surface to render (surface pixels).
+         * @param backbuffer_rect_px The backbuffer rect the surface covers (pixels).
+         * @param controller_zoom The current controller zoom.
+         * @param render_hints The render hints to use.
+         */
+        void renderSurfaceRect(const QRect& surface_rect, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, const QPainter::RenderHints& render_hints);
+
+        /*!
+         * Renders the whole cached surface as concurrent horizontal bands.
+         * @param backbuffer_rect_px The backbuffer rect the surface covers (pixels).
+         * @param controller_zoom The current controller zoom.
+         * @param render_hints The render hints to use.
+         * @param render_pool The thread pool to render the bands (one band per thread).
+         */
+        void renderSurfaceBands(const RectWorldPx& backbuffer_rect_px, const int& controller_zoom, const QPainter::RenderHints& render_hints, QThreadPool& render_pool);
+
     private:
         /// The layer type.
         LayerType m_layer_type;
@@ -195,5 +268,17 @@ namespace qmapcontrol
 
         /// Meta-data storage.
         std::map<std::string, QVariant> m_metadata;
+
+        /// The cached rendering of the layer.
+        QImage m_surface;
+
+        /// The backbuffer rect the cached surface was rendered for.
+        RectWorldPx m_surface_rect_px;
+
+        /// The controller zoom the cached surface was rendered for.
+        int m_surface_zoom;
+
+        /// Whether the cached surface must be re-rendered.
+        std::atomic<bool> m_surface_dirty;
     };
 }
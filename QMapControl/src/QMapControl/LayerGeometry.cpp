@@ -25,6 +25,17 @@
 
 #include "LayerGeometry.h"
 
+// Qt includes.
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QFuture>
+#include <QtCore/QThread>
+
+// STL includes.
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
 // Local includes.
 #include "GeometryPoint.h"
 #include "GeometryLineString.h"
@@ -33,9 +44,36 @@
 
 namespace qmapcontrol
 {
+    namespace
+    {
+        /// Minimum number of geometries per thread when calculating the envelopes in parallel.
+        const std::size_t MinEnvelopesPerThread = 4096;
+
+        /*!
+         * Calculates the envelope a geometry is indexed by: its extent in coordinates, regardless of the zoom (the
+         * pixel size of a point's shape is not included, as points are drawn around their coordinate: see
+         * Geometry::extentPx()).
+         * @param geometry The geometry (a point, line string or polygon).
+         * @return the envelope in coordinates.
+         */
+        RectWorldCoord indexEnvelope(const Geometry& geometry)
+        {
+            // Points are indexed by their coordinate.
+            if(geometry.geometryType() == Geometry::GeometryType::GeometryPoint)
+            {
+                const PointWorldCoord& coord = static_cast<const GeometryPoint&>(geometry).coord();
+                return RectWorldCoord(coord, coord);
+            }
+
+            // The bounding box of line strings and polygons does not depend on the zoom.
+            return geometry.boundingBox(0);
+        }
+    }
+
     LayerGeometry::LayerGeometry(const std::string& name, const int& zoom_minimum, const int& zoom_maximum, QObject* parent)
         : Layer(LayerType::LayerGeometry, name, zoom_minimum, zoom_maximum, parent),
-          m_geometries(50, RectWorldCoord(PointWorldCoord(-180.0, 90.0), PointWorldCoord(180.0, -90.0))),
+          m_geometries(16),
+          m_max_extent_px(0.0),
           mFuzzyFactorPx(5.0)
     {
 
@@ -56,6 +94,18 @@ namespace qmapcontrol
         return return_geometries;
     }
 
+    void LayerGeometry::getGeometries(std::vector<std::shared_ptr<Geometry>>& return_geometries, const RectWorldCoord& range_coord) const
+    {
+        // Reuse the buffer (keeping its capacity).
+        return_geometries.clear();
+
+        // Gain a read lock to protect the geometries container.
+        QReadLocker locker(&m_geometries_mutex);
+
+        // Populate the geometries buffer.
+        m_geometries.query(std::back_inserter(return_geometries), range_coord);
+    }
+
     const std::set< std::shared_ptr<GeometryWidget> > LayerGeometry::getGeometryWidgets() const
     {
         // Gain a read lock to protect the geometry widgets container.
@@ -85,11 +135,11 @@ namespace qmapcontrol
             // Else it must be a Geometry object.
             else
             {
-                // Fetch a copy of the current geometries.
-                const auto geometries = getGeometries(geometry->boundingBox(controller_zoom));
+                // Gain a read lock to protect the geometries container.
+                QReadLocker locker(&m_geometries_mutex);
 
-                // Does the list contain the geometry?
-                contains_geometry = (std::find(geometries.begin(), geometries.end(), geometry) != geometries.end());
+                // Does the container hold the geometry (walked in place, nothing is copied)?
+                m_geometries.visit(geometry->boundingBox(controller_zoom), [&](const std::shared_ptr<Geometry>& object) { contains_geometry |= (object == geometry); });
             }
         }
 
@@ -106,14 +156,21 @@ namespace qmapcontrol
             // Handle the different geometry types.
             switch(geometry->geometryType())
             {
-                // Is it a GeometryPoint.
+                // Is it a GeometryPoint, GeometryLineString or GeometryPolygon.
                 case Geometry::GeometryType::GeometryPoint:
+                case Geometry::GeometryType::GeometryLineString:
+                case Geometry::GeometryType::GeometryPolygon:
                 {
                     // Gain a write lock to protect the geometries container.
                     QWriteLocker locker(&m_geometries_mutex);
 
-                    // Add the geometry.
-                    m_geometries.insert(std::static_pointer_cast<GeometryPoint>(geometry)->coord(), geometry);
+                    // Add the geometry, once, by its envelope.
+                    m_geometries.insert(indexEnvelope(*geometry), geometry);
+
+                    // Include how far it is drawn outside of its envelope, now and whenever it changes (eg: its pen).
+                    growFeatureExtent(*geometry);
+                    const Geometry* geometry_ptr = geometry.get();
+                    QObject::connect(geometry_ptr, &Geometry::requestRedraw, this, [this, geometry_ptr]() { growFeatureExtent(*geometry_ptr); }, Qt::DirectConnection);
 
                     // Finished.
                     break;
@@ -131,41 +188,6 @@ namespace qmapcontrol
                     // Finished.
                     break;
                 }
-
-                /// @todo move linestring and polygon into different container type.
-                // Is it a GeometryLineString.
-                case Geometry::GeometryType::GeometryLineString:
-                {
-                    // Gain a write lock to protect the geometries container.
-                    QWriteLocker locker(&m_geometries_mutex);
-
-                    // Loop through each GeometryLineString point and add it to the container.
-                    for(const auto point : std::static_pointer_cast<GeometryLineString>(geometry)->quadtree_points())
-                    {
-                        // Add the geometry.
-                        m_geometries.insert(point, geometry);
-                    }
-
-                    // Finished.
-                    break;
-                }
-
-                // Is it a GeometryPolygon.
-                case Geometry::GeometryType::GeometryPolygon:
-                {
-                    // Gain a write lock to protect the geometries container.
-                    QWriteLocker locker(&m_geometries_mutex);
-
-                    // Loop through each GeometryPolygon point and add it to the container.
-                    for(const auto point : std::static_pointer_cast<GeometryPolygon>(geometry)->points())
-                    {
-                        // Add the geometry.
-                        m_geometries.insert(point, geometry);
-                    }
-
-                    // Finished.
-                    break;
-                }
             }
 
             geometry->onAddedToLayer(this);
@@ -183,6 +205,101 @@ namespace qmapcontrol
         }
     }
 
+    void LayerGeometry::addGeometries(const std::vector<std::shared_ptr<Geometry>>& geometries, const bool& disable_redraw)
+    {
+        // Split the geometries by container.
+        std::vector<std::pair<RectWorldCoord, std::shared_ptr<Geometry>>> indexed_geometries;
+        std::vector<std::shared_ptr<GeometryWidget>> geometry_widgets;
+        indexed_geometries.reserve(geometries.size());
+        for(const auto& geometry : geometries)
+        {
+            // Check the geometry is valid.
+            if(geometry != nullptr)
+            {
+                geometry->mLayer = this;
+
+                // Is it a GeometryPointWidget.
+                if(geometry->geometryType() == Geometry::GeometryType::GeometryWidget)
+                {
+                    geometry_widgets.push_back(std::static_pointer_cast<GeometryWidget>(geometry));
+                }
+                else
+                {
+                    // The envelope is calculated below.
+                    indexed_geometries.emplace_back(RectWorldCoord(PointWorldCoord(), PointWorldCoord()), geometry);
+                }
+            }
+        }
+
+        // Calculate the envelopes, in parallel chunks for large batches (line strings and polygons visit every point).
+        const auto calculateEnvelopes = [&indexed_geometries](std::size_t first, std::size_t last)
+        {
+            for(std::size_t i = first; i < last; ++i)
+            {
+                indexed_geometries[i].first = indexEnvelope(*indexed_geometries[i].second);
+            }
+        };
+        const std::size_t thread_count = std::max<std::size_t>(1, std::min<std::size_t>(QThread::idealThreadCount(), indexed_geometries.size() / MinEnvelopesPerThread));
+        const std::size_t chunk_size = (indexed_geometries.size() + thread_count - 1) / thread_count;
+        std::vector<QFuture<void>> envelope_futures;
+        for(std::size_t first = chunk_size; first < indexed_geometries.size(); first += chunk_size)
+        {
+            envelope_futures.push_back(QtConcurrent::run([&calculateEnvelopes, first, chunk_size, &indexed_geometries]() { calculateEnvelopes(first, std::min(first + chunk_size, indexed_geometries.size())); }));
+        }
+        calculateEnvelopes(0, std::min(chunk_size, indexed_geometries.size()));
+        for(auto& future : envelope_futures)
+        {
+            future.waitForFinished();
+        }
+
+        // Scope the locker to ensure the mutex is release as soon as possible.
+        if(indexed_geometries.empty() == false)
+        {
+            // Gain a write lock to protect the geometries container.
+            QWriteLocker locker(&m_geometries_mutex);
+
+            // Bulk-build the index.
+            m_geometries.bulkInsert(indexed_geometries);
+        }
+
+        // Scope the locker to ensure the mutex is release as soon as possible.
+        if(geometry_widgets.empty() == false)
+        {
+            // Gain a write lock to protect the geometry widget container.
+            QWriteLocker locker(&m_geometry_widgets_mutex);
+
+            // Add the geometry widgets.
+            m_geometry_widgets.insert(geometry_widgets.begin(), geometry_widgets.end());
+        }
+
+        // Notify the geometries and connect their redraw signal to promulgate up as required, in a single pass.
+        bool added(false);
+        for(const auto& geometry : geometries)
+        {
+            if(geometry != nullptr)
+            {
+                geometry->onAddedToLayer(this);
+                QObject::connect(geometry.get(), &Geometry::requestRedraw, this, &Layer::requestRedraw);
+                added = true;
+
+                // Include how far it is drawn outside of its envelope, now and whenever it changes (eg: its pen).
+                if(geometry->geometryType() != Geometry::GeometryType::GeometryWidget)
+                {
+                    growFeatureExtent(*geometry);
+                    const Geometry* geometry_ptr = geometry.get();
+                    QObject::connect(geometry_ptr, &Geometry::requestRedraw, this, [this, geometry_ptr]() { growFeatureExtent(*geometry_ptr); }, Qt::DirectConnection);
+                }
+            }
+        }
+
+        // Should we redraw?
+        if(added && disable_redraw == false)
+        {
+            // Emit to redraw layer, once.
+            emit requestRedraw();
+        }
+    }
+
     void LayerGeometry::removeGeometry(const std::shared_ptr<Geometry>& geometry, const bool& disable_redraw)
     {
         // Check the geometry is valid.
@@ -191,8 +308,10 @@ namespace qmapcontrol
             // Handle the different geometry types.
             switch(geometry->geometryType())
             {
-                // Is it a GeometryPoint.
+                // Is it a GeometryPoint, GeometryLineString or GeometryPolygon.
                 case Geometry::GeometryType::GeometryPoint:
+                case Geometry::GeometryType::GeometryLineString:
+                case Geometry::GeometryType::GeometryPolygon:
                 {
                     // Gain a write lock to protect the geometries container.
                     QWriteLocker locker(&m_geometries_mutex);
@@ -200,8 +319,11 @@ namespace qmapcontrol
                     // Disconnect any signals that were previously connected.
                     QObject::disconnect(geometry.get(), 0, this, 0);
 
-                    // Remove the geometry from the list.
-                    m_geometries.erase(std::static_pointer_cast<GeometryPoint>(geometry)->coord(), geometry);
+                    // Remove the geometry (searched by its current envelope first, in case it has not moved).
+                    m_geometries.erase(indexEnvelope(*geometry), geometry);
+
+                    // Finished.
+                    break;
                 }
 
                 // Is it a GeometryPointWidget.
@@ -224,47 +346,6 @@ namespace qmapcontrol
                     // Finished.
                     break;
                 }
-
-                /// @todo move linestring and polygon into different container type.
-                // Is it a GeometryLineString.
-                case Geometry::GeometryType::GeometryLineString:
-                {
-                    // Gain a write lock to protect the geometries container.
-                    QWriteLocker locker(&m_geometries_mutex);
-
-                    // Disconnect any signals that were previously connected.
-                    QObject::disconnect(geometry.get(), 0, this, 0);
-
-                    // Loop through each GeometryLineString point and remove it to the container.
-                    for(const auto point : std::static_pointer_cast<GeometryLineString>(geometry)->quadtree_points())
-                    {
-                        // Remove the geometry.
-                        m_geometries.erase(point, geometry);
-                    }
-
-                    // Finished.
-                    break;
-                }
-
-                // Is it a GeometryPolygon.
-                case Geometry::GeometryType::GeometryPolygon:
-                {
-                    // Gain a write lock to protect the geometries container.
-                    QWriteLocker locker(&m_geometries_mutex);
-
-                    // Disconnect any signals that were previously connected.
-                    QObject::disconnect(geometry.get(), 0, this, 0);
-
-                    // Loop through each GeometryPolygon point and remove it to the container.
-                    for(const auto point : std::static_pointer_cast<GeometryPolygon>(geometry)->points())
-                    {
-                        // Remove the geometry.
-                        m_geometries.erase(point, geometry);
-                    }
-
-                    // Finished.
-                    break;
-                }
             }
 
             geometry->onRemovedFromLayer();
@@ -287,6 +368,9 @@ namespace qmapcontrol
         // Remove all geometries from the list.
         m_geometries.clear();
         m_geometry_widgets.clear();
+
+        // No geometry is drawn outside of its envelope anymore.
+        m_max_extent_px = 0.0;
     }
 
     bool LayerGeometry::mousePressEvent(const QMouseEvent* mouse_event, const PointWorldCoord& mouse_point_coord, const int& controller_zoom) const
@@ -314,8 +398,12 @@ namespace qmapcontrol
                 // Create a QGraphicsRectItem to perform touches check, as required.
 //                const GeometryPolygon touches_rect_coord({ mouse_rect_coord.topLeftCoord(), mouse_rect_coord.bottomRightCoord() });
 
+                // Fetch the geometries in our touch area (the click handlers may modify the layer, so the lock is not held).
+                std::vector<std::shared_ptr<Geometry>> geometries;
+                getGeometries(geometries, mouse_rect_coord);
+
                 // Check each geometry to see it is contained in our touch area.
-                for(const auto& geometry : getGeometries(mouse_rect_coord))
+                for(const auto& geometry : geometries)
                 {
                     // Does it touch? (Will emit if it does).
                     //if(geometry->touches(&touches_rect_coord, controller_zoom))
@@ -343,18 +431,51 @@ namespace qmapcontrol
             // Save the current painter's state.
             painter.save();
 
+            // Fetch the geometries to draw into the rendering thread's buffer (reused across draws, so no allocation).
+            thread_local std::vector<std::shared_ptr<Geometry>> geometries;
+            getGeometries(geometries, backbuffer_rect_coord);
+
             // Loop through each geometry and draw it.
-            for(const auto& geometry : getGeometries(backbuffer_rect_coord))
+            for(const auto& geometry : geometries)
             {
                 // Draw the geometry (this will not move widgets).
                 geometry->draw(painter, backbuffer_rect_coord, controller_zoom);
             }
 
+            // Release the geometries (the buffer keeps its capacity).
+            geometries.clear();
+
             // Restore the painter's state.
             painter.restore();
         }
     }
 
+    bool LayerGeometry::supportsConcurrentDraw() const
+    {
+        // Geometries are only read while drawing (under a read lock).
+        return true;
+    }
+
+    qreal LayerGeometry::maxFeatureExtentPx() const
+    {
+        // Report an unbounded extent as negative.
+        const qreal max_extent_px = m_max_extent_px.load();
+        return std::isinf(max_extent_px) ? -1.0 : max_extent_px;
+    }
+
+    void LayerGeometry::growFeatureExtent(const Geometry& geometry)
+    {
+        // An unbounded extent is kept as infinity, so it is never lowered.
+        const qreal geometry_extent_px = geometry.extentPx();
+        const qreal extent_px = geometry_extent_px < 0.0 ? std::numeric_limits<qreal>::infinity() : geometry_extent_px;
+
+        // Raise the largest extent (the geometries may change from any thread).
+        qreal max_extent_px = m_max_extent_px.load();
+        while(extent_px > max_extent_px && m_max_extent_px.compare_exchange_weak(max_extent_px, extent_px) == false)
+        {
+        }
+    }
+
     void LayerGeometry::moveGeometryWidgets(const PointPx& offset_px, const int& controller_zoom) const
     {
         // Check the layer is visible.
@@ -30,15 +30,17 @@
 #include <QtCore/QReadWriteLock>
 
 // STL includes.
+#include <atomic>
 #include <memory>
 #include <set>
+#include <vector>
 
 // Local includes.
 #include "qmapcontrol_global.h"
 #include "Geometry.h"
 #include "GeometryWidget.h"
 #include "Layer.h"
-#include "QuadTreeContainer.h"
+#include "RTreeContainer.h"
 
 namespace qmapcontrol
 {
@@ -79,6 +81,15 @@ namespace qmapcontrol
          */
         const std::set<std::shared_ptr<Geometry>> getGeometries(const RectWorldCoord& range_coord) const;
 
+        /*!
+         * Fetches the Geometry objects from this Layer within a bounding box range into a reusable buffer (Use this
+         * instead of the member variable for thread-safety). Reusing the buffer across calls avoids any allocation once
+         * it has grown.
+         * @param return_geometries Cleared, then filled with the geometries within the bounding box range.
+         * @param range_coord The bounding box range to limit the geometries that are fetched in coordinates.
+         */
+        void getGeometries(std::vector<std::shared_ptr<Geometry>>& return_geometries, const RectWorldCoord& range_coord) const;
+
         /*!
          * Returns the Geometry QWidgets from this Layer (Use this instead of the member variable for thread-safety).
          * @return a list of geometry widgets that are on this Layer.
@@ -100,6 +111,15 @@ namespace qmapcontrol
          */
         void addGeometry(const std::shared_ptr<Geometry>& geometry, const bool& disable_redraw = false);
 
+        /*!
+         * Adds many Geometry objects to this Layer at once (eg: loading a whole fleet).
+         * Each container lock is taken once, the envelopes are calculated in parallel and the index is bulk-built,
+         * the signals are connected in a single pass and at most one redraw is requested.
+         * @param geometries The new geometries to add (nullptr entries are ignored).
+         * @param disable_redraw Whether to disable the redraw call after the geometries are added.
+         */
+        void addGeometries(const std::vector<std::shared_ptr<Geometry>>& geometries, const bool& disable_redraw = false);
+
         /*!
          * Removes a Geometry object from this Layer.
          * @param geometry The geometry to remove.
@@ -128,6 +148,19 @@ namespace qmapcontrol
          */
         void draw(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom) const final;
 
+        /*!
+         * Geometries are only read while drawing, so the layer supports concurrent drawing.
+         * @return true.
+         */
+        bool supportsConcurrentDraw() const final;
+
+        /*!
+         * Fetches how far the geometries are drawn outside of their coordinates: the largest extent of the geometries
+         * added since the layer was last cleared (see Geometry::extentPx()).
+         * @return the extent in pixels, or a negative value if a geometry cannot bound it.
+         */
+        qreal maxFeatureExtentPx() const final;
+
         /*!
          * Moves any geometries that represent a widget, as these are not drawn to the actually pixmap.
          * @param offset_px The offset in pixels to remove from the coordinate pixel point.
@@ -146,12 +179,22 @@ namespace qmapcontrol
         void geometryClicked(const Geometry* geometry) const;
 
     private:
-        /// List of geometries drawn by this layer.
-        QuadTreeContainer<std::shared_ptr<Geometry>> m_geometries;
+        /*!
+         * Raises the largest extent of the geometries to include a geometry's (safe to call from any thread).
+         * @param geometry The geometry added or changed.
+         */
+        void growFeatureExtent(const Geometry& geometry);
+
+    private:
+        /// List of geometries drawn by this layer, indexed by their envelope.
+        RTreeContainer<std::shared_ptr<Geometry>> m_geometries;
 
         /// Mutex to protect geometries.
         mutable QReadWriteLock m_geometries_mutex;
 
+        /// The largest extent of the geometries in pixels (infinity if a geometry cannot bound it).
+        std::atomic<qreal> m_max_extent_px;
+
         /// List of geometry widgets drawn by this layer.
         std::set<std::shared_ptr<GeometryWidget>> m_geometry_widgets;
 
@@ -25,6 +25,9 @@
 
 #include "LayerMapAdapter.h"
 
+// Qt includes.
+#include <QtCore/QRect>
+
 // STL includes.
 #include <cmath>
 
@@ -33,11 +36,32 @@
 
 namespace qmapcontrol
 {
+    namespace
+    {
+        /// Number of zoom levels up to look for a cached ancestor tile.
+        const int MaxParentFallbackLevels = 6;
+
+        /*!
+         * Calculates the distance between a tile center and a point, in tiles.
+         * @param x The tile x index.
+         * @param y The tile y index.
+         * @param point The point (in tiles).
+         * @return the distance in tiles.
+         */
+        qreal tileDistance(const int& x, const int& y, const QPointF& point)
+        {
+            return std::hypot(x + 0.5 - point.x(), y + 0.5 - point.y());
+        }
+    }
+
     LayerMapAdapter::LayerMapAdapter(const std::string& name, const std::shared_ptr<MapAdapter>& mapadapter, const int& zoom_minimum, const int& zoom_maximum, QObject* parent)
         : Layer(LayerType::LayerMapAdapter, name, zoom_minimum, zoom_maximum, parent),
-          m_mapadapter(mapadapter)
+          m_mapadapter(mapadapter),
+          m_parent_fallback(true),
+          m_child_fallback(false)
     {
-
+        // Downloaded tiles make the layer dirty.
+        QObject::connect(&ImageManager::get(), &ImageManager::imagesUpdated, this, &LayerMapAdapter::imagesUpdated);
     }
 
     const std::shared_ptr<MapAdapter> LayerMapAdapter::getMapAdapter() const
@@ -64,6 +88,45 @@ namespace qmapcontrol
         emit requestRedraw();
     }
 
+    bool LayerMapAdapter::isParentFallbackEnabled() const
+    {
+        // Return the enabled value.
+        return m_parent_fallback;
+    }
+
+    void LayerMapAdapter::setParentFallbackEnabled(const bool& enable)
+    {
+        // Set the enabled value.
+        m_parent_fallback = enable;
+
+        // Emit to redraw layer.
+        emit requestRedraw();
+    }
+
+    bool LayerMapAdapter::isChildFallbackEnabled() const
+    {
+        // Return the enabled value.
+        return m_child_fallback;
+    }
+
+    void LayerMapAdapter::setChildFallbackEnabled(const bool& enable)
+    {
+        // Set the enabled value.
+        m_child_fallback = enable;
+
+        // Emit to redraw layer.
+        emit requestRedraw();
+    }
+
+    void LayerMapAdapter::setPrefetchPlanner(const std::shared_ptr<PrefetchPlanner>& planner)
+    {
+        // Gain a write lock to protect the prefetch planner.
+        QWriteLocker locker(&m_mapadapter_mutex);
+
+        // Set the prefetch planner.
+        m_prefetch_planner = planner;
+    }
+
     bool LayerMapAdapter::mousePressEvent(const QMouseEvent* /*mouse_event*/, const PointWorldCoord& /*mouse_point_coord*/, const int& /*controller_zoom*/) const
     {
         // Do nothing.
@@ -95,6 +158,14 @@ namespace qmapcontrol
                 const int furthest_tile_right = std::floor(backbuffer_rect_px.rightPx() / tile_size_px.width());
                 const int furthest_tile_bottom = std::floor(backbuffer_rect_px.bottomPx() / tile_size_px.height());
 
+                // The viewport is the central half of the backbuffer (which is twice its size to allow for panning).
+                QRectF viewport_rect_px(backbuffer_rect_px.rawRect());
+                viewport_rect_px.setSize(viewport_rect_px.size() / 2.0);
+                viewport_rect_px.moveCenter(backbuffer_rect_px.rawRect().center());
+
+                // The viewport center, in tiles.
+                const QPointF center_tile(backbuffer_rect_px.rawRect().center().x() / tile_size_px.width(), backbuffer_rect_px.rawRect().center().y() / tile_size_px.height());
+
                 // Loop through the tiles to draw (left to right).
                 for(int i = furthest_tile_left; i <= furthest_tile_right; ++i)
                 {
@@ -107,8 +178,31 @@ namespace qmapcontrol
                             // Calculate the top left point.
                             const PointWorldPx top_left_px(i * tile_size_px.width(), j * tile_size_px.height());
 
-                            // Draw the tile.
-                            painter.drawPixmap(top_left_px.rawPoint(), ImageManager::get().getImage(m_mapadapter->tileQuery(i, j, controller_zoom)));
+                            // Tiles in the viewport are downloaded first, then the ones in the backbuffer margin.
+                            const DownloadPriority priority = viewport_rect_px.intersects(QRectF(top_left_px.rawPoint(), tile_size_px)) ? DownloadPriority::Visible : DownloadPriority::NearPrefetch;
+
+                            // Fetch the tile.
+                            const QPixmap tile_pixmap(ImageManager::get().getImage(*m_mapadapter, m_mapadapter->tileKey(i, j, controller_zoom), priority, tileDistance(i, j, center_tile)));
+
+                            // Is the tile still loading?
+                            if(ImageManager::get().isLoadingPixmap(tile_pixmap))
+                            {
+                                // Draw a cached tile of another zoom level meanwhile, if any.
+                                const QRectF tile_rect_px(top_left_px.rawPoint(), tile_size_px);
+                                if(m_parent_fallback == false || drawParentFallback(painter, i, j, controller_zoom, tile_rect_px) == false)
+                                {
+                                    painter.drawPixmap(top_left_px.rawPoint(), tile_pixmap);
+                                    if(m_child_fallback)
+                                    {
+                                        drawChildFallback(painter, i, j, controller_zoom, tile_rect_px);
+                                    }
+                                }
+                            }
+                            else
+                            {
+                                // Draw the tile.
+                                painter.drawPixmap(top_left_px.rawPoint(), tile_pixmap);
+                            }
                         }
                     }
                 }
@@ -126,14 +220,14 @@ namespace qmapcontrol
                     if(m_mapadapter->isTileValid(i, prefetch_tile_top, controller_zoom))
                     {
                         // Prefetch the tile.
-                        ImageManager::get().prefetchImage(m_mapadapter->tileQuery(i, prefetch_tile_top, controller_zoom));
+                        ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(i, prefetch_tile_top, controller_zoom), DownloadPriority::FarPrefetch, tileDistance(i, prefetch_tile_top, center_tile));
                     }
 
                     // Bottom row - check the tile is valid.
                     if(m_mapadapter->isTileValid(i, prefetch_tile_bottom, controller_zoom))
                     {
                         // Prefetch the tile.
-                        ImageManager::get().prefetchImage(m_mapadapter->tileQuery(i, prefetch_tile_bottom, controller_zoom));
+                        ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(i, prefetch_tile_bottom, controller_zoom), DownloadPriority::FarPrefetch, tileDistance(i, prefetch_tile_bottom, center_tile));
                     }
                 }
 
@@ -144,15 +238,145 @@ namespace qmapcontrol
                     if(m_mapadapter->isTileValid(prefetch_tile_left, j, controller_zoom))
                     {
                         // Prefetch the tile.
-                        ImageManager::get().prefetchImage(m_mapadapter->tileQuery(prefetch_tile_left, j, controller_zoom));
+                        ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(prefetch_tile_left, j, controller_zoom), DownloadPriority::FarPrefetch, tileDistance(prefetch_tile_left, j, center_tile));
                     }
 
                     // Right column - check the tile is valid.
                     if(m_mapadapter->isTileValid(prefetch_tile_right, j, controller_zoom))
                     {
                         // Prefetch the tile.
-                        ImageManager::get().prefetchImage(m_mapadapter->tileQuery(prefetch_tile_right, j, controller_zoom));
+                        ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(prefetch_tile_right, j, controller_zoom), DownloadPriority::FarPrefetch, tileDistance(prefetch_tile_right, j, center_tile));
+                    }
+                }
+
+                // The tiles still needed.
+                QRect needed_tile_rect(QPoint(prefetch_tile_left, prefetch_tile_top), QPoint(prefetch_tile_right, prefetch_tile_bottom));
+
+                // Prefetch the look-ahead tiles, if planned.
+                if(m_prefetch_planner != nullptr)
+                {
+                    // While zooming, the tiles of the next zoom level covering the viewport.
+                    int next_zoom;
+                    for(const QPoint& tile : m_prefetch_planner->zoomTiles(viewport_rect_px, controller_zoom, tile_size_px.width(), next_zoom))
+                    {
+                        // Check the tile is valid.
+                        if(m_mapadapter->isTileValid(tile.x(), tile.y(), next_zoom))
+                        {
+                            // Prefetch the tile (kept while it overlaps the needed tiles, see cancelLoadingOutside()).
+                            ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(tile.x(), tile.y(), next_zoom), DownloadPriority::OtherZoom);
+                        }
                     }
+
+                    // While moving, the tiles of the corridor the viewport is heading to.
+                    for(const QPoint& tile : m_prefetch_planner->corridorTiles(needed_tile_rect, controller_zoom, tile_size_px.width()))
+                    {
+                        // Check the tile is valid.
+                        if(m_mapadapter->isTileValid(tile.x(), tile.y(), controller_zoom))
+                        {
+                            // Prefetch the tile.
+                            ImageManager::get().prefetchImage(*m_mapadapter, m_mapadapter->tileKey(tile.x(), tile.y(), controller_zoom), DownloadPriority::FarPrefetch, tileDistance(tile.x(), tile.y(), center_tile));
+
+                            // Keep it needed.
+                            needed_tile_rect |= QRect(tile, QSize(1, 1));
+                        }
+                    }
+                }
+
+                // Cancel the downloads of tiles that have left the viewport/prefetch area (or the zoom level).
+                ImageManager::get().cancelLoadingOutside(*m_mapadapter, controller_zoom, needed_tile_rect);
+            }
+        }
+    }
+
+    bool LayerMapAdapter::drawParentFallback(QPainter& painter, const int& x, const int& y, const int& controller_zoom, const QRectF& tile_rect_px) const
+    {
+        // Look for the nearest cached ancestor.
+        for(int levels = 1; levels <= MaxParentFallbackLevels && levels <= controller_zoom; ++levels)
+        {
+            // The ancestor tile (the tile is one of its 2^levels x 2^levels descendants).
+            const int parent_x = x >> levels;
+            const int parent_y = y >> levels;
+            const int parent_zoom = controller_zoom - levels;
+            if(m_mapadapter->isTileValid(parent_x, parent_y, parent_zoom) == false)
+            {
+                break;
+            }
+            const TileKey parent_key(m_mapadapter->tileKey(parent_x, parent_y, parent_zoom));
+
+            // Is it in memory?
+            QPixmap parent_pixmap;
+            if(ImageManager::get().findCachedImage(parent_key, parent_pixmap))
+            {
+                // Draw the part of the ancestor covering the tile, scaled up.
+                const qreal part_width = parent_pixmap.width() / qreal(1 << levels);
+                const qreal part_height = parent_pixmap.height() / qreal(1 << levels);
+                const QRectF source_rect((x - (parent_x << levels)) * part_width, (y - (parent_y << levels)) * part_height, part_width, part_height);
+                painter.drawPixmap(tile_rect_px, parent_pixmap, source_rect);
+                return true;
+            }
+
+            // Load it from the persistent cache for the next draw (the nearest stored ancestor only).
+            if(ImageManager::get().loadPersistentImage(parent_key))
+            {
+                break;
+            }
+        }
+
+        // No ancestor in memory.
+        return false;
+    }
+
+    void LayerMapAdapter::drawChildFallback(QPainter& painter, const int& x, const int& y, const int& controller_zoom, const QRectF& tile_rect_px) const
+    {
+        // Draw the cached children in their quadrant.
+        const QSizeF child_size_px(tile_rect_px.size() / 2.0);
+        for(int dx = 0; dx < 2; ++dx)
+        {
+            for(int dy = 0; dy < 2; ++dy)
+            {
+                const int child_x = x * 2 + dx;
+                const int child_y = y * 2 + dy;
+                if(m_mapadapter->isTileValid(child_x, child_y, controller_zoom + 1))
+                {
+                    QPixmap child_pixmap;
+                    if(ImageManager::get().findCachedImage(m_mapadapter->tileKey(child_x, child_y, controller_zoom + 1), child_pixmap))
+                    {
+                        painter.drawPixmap(QRectF(tile_rect_px.topLeft() + QPointF(dx * child_size_px.width(), dy * child_size_px.height()), child_size_px), child_pixmap, QRectF(child_pixmap.rect()));
+                    }
+                }
+            }
+        }
+    }
+
+    qreal LayerMapAdapter::maxFeatureExtentPx() const
+    {
+        // Tiles are not drawn outside of their rect.
+        return 0.0;
+    }
+
+    void LayerMapAdapter::drawExposed(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const RectWorldPx& /*exposed_rect_px*/, const int& controller_zoom) const
+    {
+        // Draw the whole backbuffer (clipped to the exposed rect by the painter).
+        draw(painter, backbuffer_rect_px, controller_zoom);
+    }
+
+    void LayerMapAdapter::imagesUpdated(const QList<TileKey>& keys)
+    {
+        // Gain a read lock to protect the map adapter.
+        QReadLocker locker(&m_mapadapter_mutex);
+
+        // Check a map adapter is set.
+        if(m_mapadapter != nullptr)
+        {
+            // Are any of the tiles from our map adapter?
+            const quint32 source_id = m_mapadapter->sourceId();
+            for(const auto& key : keys)
+            {
+                if(key.sourceId() == source_id)
+                {
+                    // Our cached surface needs to be re-rendered.
+                    invalidateSurface();
+                    break;
                 }
             }
         }
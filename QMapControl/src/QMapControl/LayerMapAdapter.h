@@ -26,6 +26,7 @@
 #pragma once
 
 // Qt includes.
+#include <QtCore/QList>
 #include <QtCore/QObject>
 #include <QtCore/QReadWriteLock>
 
@@ -36,6 +37,8 @@
 #include "qmapcontrol_global.h"
 #include "Layer.h"
 #include "MapAdapter.h"
+#include "PrefetchPlanner.h"
+#include "TileKey.h"
 
 namespace qmapcontrol
 {
@@ -82,6 +85,39 @@ namespace qmapcontrol
          */
         void setMapAdapter(const std::shared_ptr<MapAdapter>& mapadapter);
 
+        /*!
+         * Fetches whether loading tiles are drawn from a cached ancestor tile (cropped and scaled up).
+         * @return whether the ancestor fallback is enabled.
+         */
+        bool isParentFallbackEnabled() const;
+
+        /*!
+         * Set whether loading tiles are drawn from the nearest cached ancestor tile (cropped and scaled up), from memory
+         * or from the persistent cache, so the map stays continuous while zooming in (enabled by default).
+         * @param enable Whether to enable the ancestor fallback.
+         */
+        void setParentFallbackEnabled(const bool& enable);
+
+        /*!
+         * Fetches whether loading tiles are composited from their cached child tiles (scaled down).
+         * @return whether the children fallback is enabled.
+         */
+        bool isChildFallbackEnabled() const;
+
+        /*!
+         * Set whether loading tiles with no cached ancestor are composited from their cached child tiles (scaled down,
+         * from memory only), so the map stays continuous while zooming out (disabled by default).
+         * @param enable Whether to enable the children fallback.
+         */
+        void setChildFallbackEnabled(const bool& enable);
+
+        /*!
+         * Set the planner of the look-ahead tiles: the tiles ahead of the map motion (and of the next zoom level while
+         * zooming) are prefetched, on top of the prefetch ring.
+         * @param planner The prefetch planner (nullptr to only prefetch the ring).
+         */
+        void setPrefetchPlanner(const std::shared_ptr<PrefetchPlanner>& planner);
+
         /*!
          * Handles mouse press events (such as left-clicking an item on the layer).
          * @param mouse_event The mouse event.
@@ -98,11 +134,66 @@ namespace qmapcontrol
          */
         void draw(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const int& controller_zoom) const final;
 
+        /*!
+         * Draws the part of the layer exposed when the backbuffer has been scrolled.
+         * Tiles are drawn for the whole backbuffer rect (the painter is clipped to the exposed rect), so the download
+         * priorities and cancellation still cover the whole viewport.
+         * @param painter The painter that will draw to the pixmap.
+         * @param backbuffer_rect_px The whole backbuffer rect (pixels).
+         * @param exposed_rect_px The exposed part of the backbuffer rect (pixels).
+         * @param controller_zoom The current controller zoom.
+         */
+        void drawExposed(QPainter& painter, const RectWorldPx& backbuffer_rect_px, const RectWorldPx& exposed_rect_px, const int& controller_zoom) const final;
+
+        /*!
+         * Tiles are drawn within their rect.
+         * @return 0.
+         */
+        qreal maxFeatureExtentPx() const final;
+
+    private slots:
+        /*!
+         * Slot to handle downloaded tiles, marking the layer as dirty if they belong to its map adapter.
+         * @param keys The keys of the tiles that were downloaded.
+         */
+        void imagesUpdated(const QList<TileKey>& keys);
+
     private:
+        /*!
+         * Draws a loading tile from its nearest cached ancestor tile (cropped and scaled up).
+         * If no ancestor is in memory, the nearest one in the persistent cache is loaded, to be used by the next draw.
+         * @param painter The painter that will draw to the pixmap.
+         * @param x The tile x index.
+         * @param y The tile y index.
+         * @param controller_zoom The current controller zoom.
+         * @param tile_rect_px The tile rect (pixels).
+         * @return whether an ancestor tile was drawn.
+         */
+        bool drawParentFallback(QPainter& painter, const int& x, const int& y, const int& controller_zoom, const QRectF& tile_rect_px) const;
+
+        /*!
+         * Draws the cached child tiles of a loading tile (scaled down), over the loading pixmap.
+         * @param painter The painter that will draw to the pixmap.
+         * @param x The tile x index.
+         * @param y The tile y index.
+         * @param controller_zoom The current controller zoom.
+         * @param tile_rect_px The tile rect (pixels).
+         */
+        void drawChildFallback(QPainter& painter, const int& x, const int& y, const int& controller_zoom, const QRectF& tile_rect_px) const;
+
         /// The map adapter drawn by this layer.
         std::shared_ptr<MapAdapter> m_mapadapter;
 
         /// Mutex to protect map adapter.
         mutable QReadWriteLock m_mapadapter_mutex;
+
+        /// Whether loading tiles are drawn from a cached ancestor tile.
+        bool m_parent_fallback;
+
+        /// Whether loading tiles are composited from their cached child tiles.
+        bool m_child_fallback;
+
+        /// The planner of the look-ahead tiles.
+        std::shared_ptr<PrefetchPlanner> m_prefetch_planner;
     };
 }
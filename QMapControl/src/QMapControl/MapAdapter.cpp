@@ -28,8 +28,31 @@
 // STL includes.
 #include <cmath>
 
+// Local includes.
+#include "ImageManager.h"
+
 namespace qmapcontrol
 {
+    namespace
+    {
+        /*!
+         * Calculates the tile source id of a base url (32 bit FNV-1a of the url).
+         * @param base_url The base url.
+         * @return the tile source id.
+         */
+        quint32 calculateSourceId(const QUrl& base_url)
+        {
+            quint32 hash = 2166136261U;
+            for(const QChar& c : base_url.toString())
+            {
+                hash = (hash ^ c.unicode()) * 16777619U;
+            }
+
+            // Zero is reserved for invalid tile keys.
+            return hash == 0 ? 1 : hash;
+        }
+    }
+
     MapAdapter::MapAdapter(const QUrl& base_url,
                            const std::set<projection::EPSG>& epsg_projections,
                            const int& adapter_zoom_minimum,
@@ -38,6 +61,7 @@ namespace qmapcontrol
                            QObject* parent)
         : QObject(parent),
           m_base_url(base_url),
+          m_source_id(calculateSourceId(base_url)),
           m_epsg_projections(epsg_projections),
           m_adapter_zoom_minimum(adapter_zoom_minimum),
           m_adapter_zoom_maximum(adapter_zoom_maximum),
@@ -56,6 +80,21 @@ namespace qmapcontrol
     {
         // Set the base url.
         m_base_url = base_url;
+
+        // The tiles now come from a different source.
+        m_source_id = calculateSourceId(base_url);
+    }
+
+    quint32 MapAdapter::sourceId() const
+    {
+        // Return the tile source id.
+        return m_source_id;
+    }
+
+    TileKey MapAdapter::tileKey(const int& x, const int& y, const int& controller_zoom) const
+    {
+        // Return the key of the tile at the current projection and tile size.
+        return TileKey(m_source_id, controller_zoom, x, y, projection::get().epsg(), ImageManager::get().tileSizePx());
     }
 
     bool MapAdapter::isTileValid(const int& x, const int& y, const int& controller_zoom) const
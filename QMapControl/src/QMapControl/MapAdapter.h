@@ -35,6 +35,7 @@
 // Local includes.
 #include "qmapcontrol_global.h"
 #include "Projection.h"
+#include "TileKey.h"
 
 namespace qmapcontrol
 {
@@ -77,6 +78,12 @@ namespace qmapcontrol
          */
         virtual void setBaseUrl(const QUrl& base_url);
 
+        /*!
+         * Get the id of the tile source, derived from the base url (stable across application runs).
+         * @return the tile source id.
+         */
+        quint32 sourceId() const;
+
         /*!
          * Indicates whether a given x, y and controller zoom would provide a valid image tile.
          * @param x The x coordinate required.
@@ -95,6 +102,17 @@ namespace qmapcontrol
          */
         virtual QUrl tileQuery(const int& x, const int& y, const int& controller_zoom) const = 0;
 
+        /*!
+         * Generates the key identifying the image tile for the specified x, y and zoom (at the current projection and
+         * tile size), without generating its url.
+         * @param x The x coordinate required.
+         * @param y The y coordinate required.
+         * @param controller_zoom The current controller zoom.
+         * @return the tile key.
+         * @throws std::out_of_range if the projection's EPSG number does not fit in a tile key (see TileKey::MaxEpsg).
+         */
+        TileKey tileKey(const int& x, const int& y, const int& controller_zoom) const;
+
     protected:
         //! Constructor.
         /*!
@@ -131,6 +149,9 @@ namespace qmapcontrol
         /// The base url path of the map server.
         QUrl m_base_url;
 
+        /// The tile source id (hash of the base url).
+        quint32 m_source_id;
+
         /// The supported EPSG projections.
         const std::set<projection::EPSG> m_epsg_projections;
 
@@ -26,7 +26,13 @@
 #include "NetworkManager.h"
 
 // Qt includes.
+#include <QtCore/QBuffer>
+#include <QtCore/QList>
+#include <QtCore/QLocale>
+#include <QtCore/QMetaObject>
 #include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+#include <QtCore/QTimer>
 #include <QtGui/QImageReader>
 #include <QtWidgets/QDialog>
 #include <QtWidgets/QGridLayout>
@@ -34,10 +40,110 @@
 #include <QtWidgets/QLineEdit>
 #include <QtWidgets/QPushButton>
 
+// STL includes.
+#include <algorithm>
+#include <functional>
+
 namespace qmapcontrol
 {
-    NetworkManager::NetworkManager(QObject* parent) : QObject(parent)
+    namespace
     {
+        /// Initial backoff of a tile that failed to download (doubled with each consecutive failure).
+        const qint64 FailureBackoffMs = 5 * 1000;
+
+        /// Initial backoff of a tile the server reported missing (doubled with each consecutive failure).
+        const qint64 MissingBackoffMs = 5 * 60 * 1000;
+
+        /// Maximum backoff of a tile.
+        const qint64 MaxBackoffMs = 60 * 60 * 1000;
+
+        /// Number of failed tiles remembered before the expired backoffs are pruned.
+        const int MaxFailedDownloads = 4096;
+
+        /// Number of consecutive failures opening the circuit breaker of a host.
+        const int BreakerThreshold = 5;
+
+        /// Initial time the circuit breaker of a host stays open (doubled each time the probe request fails).
+        const qint64 BreakerOpenMs = 10 * 1000;
+
+        /// Maximum time the circuit breaker of a host stays open.
+        const qint64 MaxBreakerOpenMs = 5 * 60 * 1000;
+
+        /*!
+         * Computes an exponential backoff.
+         * @param initial_ms The first delay.
+         * @param count The number of consecutive failures (at least 1).
+         * @param max_ms The maximum delay.
+         * @return the delay.
+         */
+        qint64 backoff(const qint64& initial_ms, const int& count, const qint64& max_ms)
+        {
+            return std::min(max_ms, initial_ms << std::min(count - 1, 20));
+        }
+
+        /*!
+         * Checks whether a tile covers part of a tile rect, once projected to the zoom level of the rect.
+         * @param key The tile.
+         * @param zoom The zoom level of the tile rect.
+         * @param tile_rect The tile rect.
+         * @return whether the tile overlaps the tile rect.
+         */
+        bool overlapsTileRect(const TileKey& key, const int& zoom, const QRect& tile_rect)
+        {
+            // The tile footprint at the zoom level of the tile rect.
+            QRect footprint(key.x(), key.y(), 1, 1);
+            if(key.zoom() < zoom)
+            {
+                // A parent tile covers 2^dz x 2^dz tiles.
+                const int scale = 1 << (zoom - key.zoom());
+                footprint = QRect(key.x() * scale, key.y() * scale, scale, scale);
+            }
+            else if(key.zoom() > zoom)
+            {
+                // A child tile is covered by a single tile.
+                const int shift = key.zoom() - zoom;
+                footprint = QRect(key.x() >> shift, key.y() >> shift, 1, 1);
+            }
+
+            // Does the footprint overlap the tile rect?
+            return footprint.intersects(tile_rect);
+        }
+
+        /// Runs a function in a thread pool.
+        class FunctionRunnable : public QRunnable
+        {
+        public:
+            /*!
+             * Constructs the runnable (deleted by the thread pool once run).
+             * @param function The function to run.
+             */
+            explicit FunctionRunnable(const std::function<void()>& function)
+                : m_function(function)
+            {
+
+            }
+
+            //! Runs the function.
+            void run() override
+            {
+                m_function();
+            }
+
+        private:
+            /// The function to run.
+            std::function<void()> m_function;
+        };
+    }
+
+    NetworkManager::NetworkManager(QObject* parent)
+        : QObject(parent),
+          m_max_downloads_per_host(6),
+          m_queue_sequence(0),
+          m_decodes_pending(0)
+    {
+        // Start the backoff clock.
+        m_clock.start();
+
         // Connect signal/slot to handle proxy authentication.
         QObject::connect(&m_nam, &QNetworkAccessManager::proxyAuthenticationRequired, this, &NetworkManager::proxyAuthenticationRequired);
 
@@ -49,6 +155,9 @@ namespace qmapcontrol
     {
         // Ensure all download queues are aborted.
         abortDownloads();
+
+        // Wait for the images being decoded (their delivery is dropped with this object).
+        m_decode_pool.waitForDone();
     }
 
     void NetworkManager::setProxy(const QNetworkProxy& proxy)
@@ -57,79 +166,420 @@ namespace qmapcontrol
         m_nam.setProxy(proxy);
     }
 
-    void NetworkManager::abortDownloads()
+    int NetworkManager::maxDownloadsPerHost() const
     {
-        // Loop through each reply to abort and then remove it from the downloading image queue.
+        // Return the maximum number of concurrent downloads for each host.
         QMutexLocker lock(&m_mutex_downloading_image);
-        QMutableMapIterator<QNetworkReply*, QUrl> itr(m_downloading_image);
-        while(itr.hasNext())
+        return m_max_downloads_per_host;
+    }
+
+    void NetworkManager::setMaxDownloadsPerHost(const int& max_downloads)
+    {
+        // Gain a lock to protect the queued requests.
+        QMutexLocker lock(&m_mutex_downloading_image);
+
+        // Set the new limit (at least one download must be allowed).
+        m_max_downloads_per_host = std::max(1, max_downloads);
+
+        // Make use of any new download slot.
+        dispatchDownloads();
+    }
+
+    void NetworkManager::abortDownloads()
+    {
+        // Take the replies out of the in-flight index first, as aborting a reply may synchronously emit finished.
+        QHash<QNetworkReply*, TileKey> aborted_replies;
         {
-            // Tell the reply to abort.
-            itr.next().key()->abort();
+            // Gain a lock to protect the queued requests and the in-flight index.
+            QMutexLocker lock(&m_mutex_downloading_image);
+
+            // Drop the queued requests.
+            m_queued_downloads.clear();
+            m_hosts.clear();
 
-            // Remove it from the queue.
-            itr.remove();
+            // Clear the in-flight index.
+            aborted_replies.swap(m_downloading_replies);
+            m_downloading_keys.clear();
+        }
+
+        // Loop through each reply and tell it to abort.
+        for(auto itr = aborted_replies.constBegin(); itr != aborted_replies.constEnd(); ++itr)
+        {
+            itr.key()->abort();
         }
     }
 
     int NetworkManager::downloadQueueSize() const
     {
-        // Default return value.
-        int return_size(0);
+        // Return the size of the queued requests and the in-flight index.
+        QMutexLocker lock(&m_mutex_downloading_image);
+        return m_queued_downloads.size() + m_downloading_replies.size();
+    }
+
+    bool NetworkManager::isDownloading(const TileKey& key) const
+    {
+        // Return whether we requested tile is in the in-flight index.
+        QMutexLocker lock(&m_mutex_downloading_image);
+        return m_downloading_keys.contains(key);
+    }
+
+    bool NetworkManager::isUnavailable(const TileKey& key) const
+    {
+        // Gain a lock to protect the failures.
+        QMutexLocker lock(&m_mutex_downloading_image);
 
-        // Return the size of the downloading image queue.
+        // Is the tile still backed off?
+        const auto itr_failure = m_failed_downloads.find(key);
+        return itr_failure != m_failed_downloads.end() && m_clock.elapsed() < itr_failure->retry_at_ms;
+    }
+
+    void NetworkManager::resetDownloadFailures()
+    {
+        // Gain a lock to protect the failures.
         QMutexLocker lock(&m_mutex_downloading_image);
-        return_size += m_downloading_image.size();
 
-        // Return the size.
-        return return_size;
+        // Forget the failures.
+        m_failed_downloads.clear();
+        m_host_health.clear();
+
+        // Send the requests held back by the circuit breakers.
+        dispatchDownloads();
     }
 
-    bool NetworkManager::isDownloading(const QUrl& url) const
+    bool NetworkManager::isQueued(const TileKey& key) const
     {
-        // Return whether we requested url is downloading image queue.
+        // Return whether we requested tile is waiting for a download slot.
         QMutexLocker lock(&m_mutex_downloading_image);
-        return m_downloading_image.values().contains(url);
+        return m_queued_downloads.contains(key);
     }
 
-    void NetworkManager::downloadImage(const QUrl& url)
+    void NetworkManager::downloadImage(const TileKey& key, const QUrl& url, const DownloadPriority& priority, const qreal& distance)
+    {
+        // Queue an unconditional request.
+        QueuedDownload download;
+        download.url = url;
+
+        // Was we successful?
+        if(queueDownload(key, download, priority, distance))
+        {
+            // Emit that we are downloading a new image (with details of the current queue size).
+            emit downloadingInProgress(downloadQueueSize());
+        }
+    }
+
+    void NetworkManager::revalidateImage(const TileKey& key, const QUrl& url, const QByteArray& etag, const QDateTime& last_modified, const DownloadPriority& priority, const qreal& distance)
+    {
+        // Queue a conditional request.
+        QueuedDownload download;
+        download.url = url;
+        download.etag = etag;
+        download.last_modified = last_modified;
+
+        // Was we successful?
+        if(queueDownload(key, download, priority, distance))
+        {
+            // Emit that we are downloading a new image (with details of the current queue size).
+            emit downloadingInProgress(downloadQueueSize());
+        }
+    }
+
+    bool NetworkManager::queueDownload(const TileKey& key, QueuedDownload download, const DownloadPriority& priority, const qreal& distance)
     {
         // Keep track of our success.
         bool success(false);
 
-        // Scope this as we later call "downloadQueueSize()" which also locks all download queue mutexes.
+        // Gain a lock to protect the downloading image container.
+        QMutexLocker lock(&m_mutex_downloading_image);
+
+        // Is the tile backed off after a failure?
+        const auto itr_failure = m_failed_downloads.find(key);
+        if(itr_failure != m_failed_downloads.end() && m_clock.elapsed() < itr_failure->retry_at_ms)
+        {
+            // Ignore the request, it is unavailable for now.
+        }
+        // Check this is not in-flight (otherwise it is coalesced with the one in-flight, whoever asked for it).
+        else if(m_downloading_keys.contains(key) == false)
+        {
+            // The position of the request in its host queue.
+            download.order = QueueOrder(static_cast<int>(priority), distance, m_queue_sequence++);
+
+            // Is the request already queued?
+            auto itr_queued = m_queued_downloads.find(key);
+            if(itr_queued != m_queued_downloads.end())
+            {
+                // An unconditional request wins over a conditional one (the caller no longer has the image).
+                if(download.etag.isEmpty() && download.last_modified.isValid() == false)
+                {
+                    itr_queued->etag.clear();
+                    itr_queued->last_modified = QDateTime();
+                }
+
+                // Move it to its new position (the latest priority/distance reflect the current viewport).
+                requeueDownload(itr_queued.value(), key, download.order);
+            }
+            else
+            {
+                // Queue the new request.
+                m_hosts[download.url.host()].queue.emplace(download.order, key);
+                m_queued_downloads.insert(key, download);
+
+                // Mark our success.
+                success = true;
+            }
+
+            // Send the most urgent requests.
+            dispatchDownloads();
+        }
+
+        // Return our success.
+        return success;
+    }
+
+    void NetworkManager::updateDownloadPriority(const TileKey& key, const DownloadPriority& priority, const qreal& distance)
+    {
+        // Gain a lock to protect the queued requests.
+        QMutexLocker lock(&m_mutex_downloading_image);
+
+        // Is the request still queued?
+        auto itr_queued = m_queued_downloads.find(key);
+        if(itr_queued != m_queued_downloads.end())
+        {
+            // Move it to its new position.
+            requeueDownload(itr_queued.value(), key, QueueOrder(static_cast<int>(priority), distance, m_queue_sequence++));
+        }
+    }
+
+    void NetworkManager::cancelDownloadsOutside(const quint32& source_id, const int& zoom, const QRect& tile_rect)
+    {
+        // Replies to abort, outside of the lock as aborting a reply synchronously emits finished.
+        QList<QNetworkReply*> aborted_replies;
         {
-            // Gain a lock to protect the downloading image container.
+            // Gain a lock to protect the queued requests and the in-flight index.
             QMutexLocker lock(&m_mutex_downloading_image);
 
-            // Check this is a new request.
-            if(m_downloading_image.values().contains(url) == false)
+            // Drop the queued requests that are no longer needed.
+            QMutableHashIterator<TileKey, QueuedDownload> itr_queued(m_queued_downloads);
+            while(itr_queued.hasNext())
+            {
+                itr_queued.next();
+                const TileKey& key = itr_queued.key();
+                if(key.sourceId() == source_id)
+                {
+                    // Other zoom levels are only kept when explicitly requested as such.
+                    const bool other_zoom_request = std::get<0>(itr_queued.value().order) == static_cast<int>(DownloadPriority::OtherZoom);
+                    if((key.zoom() != zoom && other_zoom_request == false) || overlapsTileRect(key, zoom, tile_rect) == false)
+                    {
+                        // Remove it from its host queue.
+                        const QString host = itr_queued.value().url.host();
+                        auto itr_host = m_hosts.find(host);
+                        itr_host.value().queue.erase(itr_queued.value().order);
+                        if(itr_host.value().queue.empty() && itr_host.value().in_flight == 0)
+                        {
+                            m_hosts.erase(itr_host);
+                        }
+
+                        // Remove it from the queued requests.
+                        itr_queued.remove();
+                    }
+                }
+            }
+
+            // Abort the in-flight requests that no longer overlap the viewport.
+            for(auto itr = m_downloading_replies.constBegin(); itr != m_downloading_replies.constEnd(); ++itr)
+            {
+                if(itr.value().sourceId() == source_id && overlapsTileRect(itr.value(), zoom, tile_rect) == false)
+                {
+                    aborted_replies.append(itr.key());
+                }
+            }
+            for(QNetworkReply* reply : aborted_replies)
+            {
+                releaseDownload(reply);
+            }
+
+            // Use the released download slots.
+            dispatchDownloads();
+        }
+
+        // Loop through each reply and tell it to abort.
+        for(QNetworkReply* reply : aborted_replies)
+        {
+            reply->abort();
+        }
+    }
+
+    void NetworkManager::requeueDownload(QueuedDownload& queued, const TileKey& key, const QueueOrder& order)
+    {
+        // Move the request within its host queue.
+        auto& host_queue = m_hosts[queued.url.host()].queue;
+        host_queue.erase(queued.order);
+        host_queue.emplace(order, key);
+        queued.order = order;
+    }
+
+    void NetworkManager::dispatchDownloads()
+    {
+        // Loop through each host.
+        for(auto itr_host = m_hosts.begin(); itr_host != m_hosts.end(); )
+        {
+            HostDownloads& host = itr_host.value();
+
+            // The number of download slots of the host.
+            int max_downloads = m_max_downloads_per_host;
+
+            // Is the circuit breaker of the host open?
+            const auto itr_health = m_host_health.find(itr_host.key());
+            if(itr_health != m_host_health.end() && itr_health->failures >= BreakerThreshold)
             {
+                const qint64 now = m_clock.elapsed();
+                if(now < itr_health->open_until_ms)
+                {
+                    // Hold the requests back, and try again once the breaker lets a probe through.
+                    if(itr_health->resume_scheduled == false && host.queue.empty() == false)
+                    {
+                        itr_health->resume_scheduled = true;
+                        QTimer::singleShot(static_cast<int>(itr_health->open_until_ms - now), this, &NetworkManager::resumeDownloads);
+                    }
+                    max_downloads = 0;
+                }
+                else
+                {
+                    // Probe the host with a single request.
+                    max_downloads = 1;
+                }
+            }
+
+            // Send the most urgent requests while the host has free download slots.
+            while(host.in_flight < max_downloads && host.queue.empty() == false)
+            {
+                // Take the most urgent request from the queues.
+                const TileKey key = host.queue.begin()->second;
+                host.queue.erase(host.queue.begin());
+                const QueuedDownload download = m_queued_downloads.take(key);
+                const QUrl& url = download.url;
+
                 // Generate a new request.
                 QNetworkRequest request(url);
                 request.setRawHeader("User-Agent", "QMapControl");
 
+                // Make it conditional if the caller already has the image.
+                if(download.etag.isEmpty() == false)
+                {
+                    request.setRawHeader("If-None-Match", download.etag);
+                }
+                if(download.last_modified.isValid())
+                {
+                    request.setRawHeader("If-Modified-Since", QLocale::c().toString(download.last_modified.toUTC(), QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'")).toLatin1());
+                }
+
                 // Send the request.
                 QNetworkReply* reply = m_nam.get(request);
 
-                // Store the request into the downloading image queue.
-                m_downloading_image[reply] = url;
-
-                // Mark our success.
-                success = true;
+                // Store the request into the in-flight index (both ways).
+                m_downloading_replies.insert(reply, key);
+                m_downloading_keys.insert(key, reply);
+                ++host.in_flight;
 
                 // Log success.
 #ifdef QMAP_DEBUG
                 qDebug() << "Downloading image '" << url << "'";
 #endif
             }
+
+            // Forget idle hosts.
+            if(host.in_flight == 0 && host.queue.empty())
+            {
+                itr_host = m_hosts.erase(itr_host);
+            }
+            else
+            {
+                ++itr_host;
+            }
         }
+    }
 
-        // Was we successful?
-        if(success)
+    void NetworkManager::resumeDownloads()
+    {
+        // Gain a lock to protect the queued requests.
+        QMutexLocker lock(&m_mutex_downloading_image);
+
+        // The breakers are checked again by the dispatch.
+        for(auto& health : m_host_health)
         {
-            // Emit that we are downloading a new image (with details of the current queue size).
-            emit downloadingInProgress(downloadQueueSize());
+            health.resume_scheduled = false;
+        }
+
+        // Send the requests of the hosts whose breaker let a probe through.
+        dispatchDownloads();
+    }
+
+    void NetworkManager::recordFailure(const TileKey& key, const QString& host, const bool& missing)
+    {
+        const qint64 now = m_clock.elapsed();
+
+        // Keep the failed tiles bounded, forgetting the failures long expired.
+        if(m_failed_downloads.size() >= MaxFailedDownloads)
+        {
+            for(auto itr = m_failed_downloads.begin(); itr != m_failed_downloads.end(); )
+            {
+                if(itr->retry_at_ms + MaxBackoffMs < now)
+                {
+                    itr = m_failed_downloads.erase(itr);
+                }
+                else
+                {
+                    ++itr;
+                }
+            }
+        }
+
+        // Back the tile off.
+        DownloadFailure& failure = m_failed_downloads[key];
+        ++failure.failures;
+        failure.retry_at_ms = now + backoff(missing ? MissingBackoffMs : FailureBackoffMs, failure.failures, MaxBackoffMs);
+
+        // Count the failure against the host (a missing tile is not its fault).
+        if(missing == false && host.isEmpty() == false)
+        {
+            HostHealth& health = m_host_health[host];
+            ++health.failures;
+
+            // Open the breaker (unless already open, the in-flight requests fail together).
+            if(health.failures >= BreakerThreshold && now >= health.open_until_ms)
+            {
+                ++health.trips;
+                health.open_until_ms = now + backoff(BreakerOpenMs, health.trips, MaxBreakerOpenMs);
+
+#ifdef QMAP_DEBUG
+                qDebug() << "Host '" << host << "' is failing, holding its requests back for" << (health.open_until_ms - now) << "ms";
+#endif
+            }
+        }
+    }
+
+    void NetworkManager::recordSuccess(const TileKey& key, const QString& host)
+    {
+        // Forget the failures of the tile and of the host.
+        m_failed_downloads.remove(key);
+        m_host_health.remove(host);
+    }
+
+    void NetworkManager::releaseDownload(QNetworkReply* reply)
+    {
+        // Is the reply in the in-flight index?
+        const auto itr_find = m_downloading_replies.find(reply);
+        if(itr_find != m_downloading_replies.end())
+        {
+            // Remove it from both sides of the index.
+            m_downloading_keys.remove(itr_find.value());
+            m_downloading_replies.erase(itr_find);
+
+            // Release its host download slot.
+            auto itr_host = m_hosts.find(reply->request().url().host());
+            if(itr_host != m_hosts.end())
+            {
+                --itr_host.value().in_flight;
+            }
         }
     }
 
@@ -179,6 +629,30 @@ namespace qmapcontrol
 
     void NetworkManager::downloadFinished(QNetworkReply* reply)
     {
+        // The reply is ours to dispose of.
+        reply->deleteLater();
+
+        // Remove the reply from the in-flight index (aborted replies have already been removed).
+        bool in_flight(false);
+        TileKey key;
+        {
+            // Gain a lock to protect the in-flight index.
+            QMutexLocker lock(&m_mutex_downloading_image);
+
+            // Is the reply in the in-flight index?
+            in_flight = m_downloading_replies.contains(reply);
+            if(in_flight)
+            {
+                // Remove it, releasing its download slot to the next queued request.
+                key = m_downloading_replies.value(reply);
+                releaseDownload(reply);
+                dispatchDownloads();
+            }
+        }
+
+        // The host the request was sent to (the reply url may have been redirected).
+        const QString host = reply->request().url().host();
+
         // Did the reply return no errors...
         if(reply->error() != QNetworkReply::NoError)
         {
@@ -186,45 +660,152 @@ namespace qmapcontrol
             // Log error.
             qDebug() << "Failed to download '" << reply->url() << "' with error '" << reply->errorString() << "'";
 #endif
+
+            // Was the request still wanted (aborted requests are not failures)?
+            if(in_flight)
+            {
+                // Back the tile off (and its host, unless the tile does not exist).
+                const bool missing = reply->error() == QNetworkReply::ContentNotFoundError || reply->error() == QNetworkReply::ContentGoneError;
+                {
+                    QMutexLocker lock(&m_mutex_downloading_image);
+                    recordFailure(key, host, missing);
+                }
+
+                // Report the failure with the next batch.
+                ++m_decodes_pending;
+                deliverImage(key, QImage(), TilePayload());
+            }
         }
-        else
+        // Has the image not been modified since the caller got it?
+        else if(in_flight && reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 304)
         {
-            // Check whether the url has already been processed...
-            bool continue_processing_image(false);
+#ifdef QMAP_DEBUG
+            // Log success.
+            qDebug() << "Image not modified '" << reply->url() << "'";
+#endif
+
+            // The host is healthy.
             {
-                // Is the reply in the downloading image queue?
                 QMutexLocker lock(&m_mutex_downloading_image);
-                continue_processing_image = m_downloading_image.contains(reply);
-                if(continue_processing_image)
-                {
+                recordSuccess(key, host);
+            }
+
+            // Emit that the caller's image is still up to date.
+            emit imageNotModified(key);
+        }
+        // Should we process this as an image download.
+        else if(in_flight)
+        {
 #ifdef QMAP_DEBUG
-                    // Log success.
-                    qDebug() << "Downloaded image '" << m_downloading_image[reply] << "'";
+            // Log success.
+            qDebug() << "Downloaded image '" << reply->url() << "'";
 #endif
 
-                    // Remove it from the downloading image queue.
-                    m_downloading_image.remove(reply);
-                }
+            // The host is healthy (the tile is backed off again if it fails to decode).
+            {
+                QMutexLocker lock(&m_mutex_downloading_image);
+                recordSuccess(key, host);
             }
 
-            // Should we process this as an image download.
-            if(continue_processing_image)
+            // Keep the encoded image as served, with the metadata needed to revalidate it.
+            TilePayload payload;
+            payload.data = reply->readAll();
+            payload.content_type = reply->header(QNetworkRequest::ContentTypeHeader).toString();
+            payload.etag = reply->rawHeader("ETag");
+            payload.last_modified = reply->header(QNetworkRequest::LastModifiedHeader).toDateTime();
+
+            // Hand the encoded image to the decode pool (decoding stalls the thread for large batches).
+            ++m_decodes_pending;
+            m_decode_pool.start(new FunctionRunnable([this, key, payload]() { decodeImage(key, payload); }));
+        }
+
+        // If the reply was still in-flight (ie: not cancelled), check if the current download queue is empty.
+        if(in_flight && m_decodes_pending == 0 && downloadQueueSize() == 0)
+        {
+            // Emit that all queued downloads have finished.
+            emit downloadingFinished();
+        }
+    }
+
+    void NetworkManager::decodeImage(const TileKey& key, const TilePayload& payload)
+    {
+        // Decode the image.
+        QBuffer buffer;
+        buffer.setData(payload.data);
+        QImageReader image_reader(&buffer);
+        const QImage image = image_reader.read();
+
+        // Did decoding fail?
+        if(image.isNull())
+        {
+#ifdef QMAP_DEBUG
+            // Log decoding failures.
+            qDebug() << "Failed to decode image '" << key.toString() << "' with error '" << image_reader.errorString() << "'";
+#endif
+
+            // Back the tile off (the server answered, whatever it answered).
+            QMutexLocker lock(&m_mutex_downloading_image);
+            recordFailure(key, QString(), false);
+        }
+
+        // Add it to the images to deliver.
+        deliverImage(key, image, payload);
+    }
+
+    void NetworkManager::deliverImage(const TileKey& key, const QImage& image, const TilePayload& payload)
+    {
+        bool schedule_flush(false);
+        {
+            QMutexLocker lock(&m_mutex_decoded_images);
+
+            // The first image of a batch schedules the delivery, the following ones join the batch.
+            schedule_flush = m_decoded_images.isEmpty();
+            m_decoded_images.append(DecodedImage{key, image, payload});
+        }
+
+        // Schedule the delivery in the network manager's thread.
+        if(schedule_flush)
+        {
+            QMetaObject::invokeMethod(this, "flushDecodedImages", Qt::QueuedConnection);
+        }
+    }
+
+    void NetworkManager::flushDecodedImages()
+    {
+        // Take the images decoded so far.
+        QList<DecodedImage> decoded_images;
+        {
+            QMutexLocker lock(&m_mutex_decoded_images);
+            decoded_images.swap(m_decoded_images);
+        }
+
+        // They are no longer pending.
+        m_decodes_pending -= decoded_images.size();
+
+        // Deliver the batch.
+        for(const auto& decoded_image : decoded_images)
+        {
+            // Images that failed to download or decode are reported as such (they are backed off).
+            if(decoded_image.image.isNull())
+            {
+                // Emit that the image is unavailable.
+                emit imageFailed(decoded_image.key);
+            }
+            else
             {
                 // Emit that we have downloaded an image.
-                QImageReader image_reader(reply);
-                emit imageDownloaded(reply->url(), QPixmap::fromImageReader(&image_reader));
+                emit imageDownloaded(decoded_image.key, QPixmap::fromImage(decoded_image.image), decoded_image.payload);
             }
         }
 
-        // If the reply did not fail due to cancellation... (as cancellation locks our mutexes!)
-        if(reply->error() != QNetworkReply::OperationCanceledError)
+        // Emit that the batch has been delivered.
+        emit imageBatchFinished();
+
+        // Check if the current download queue is empty.
+        if(m_decodes_pending == 0 && downloadQueueSize() == 0)
         {
-            // Check if the current download queue is empty.
-            if(downloadQueueSize() == 0)
-            {
-                // Emit that all queued downloads have finished.
-                emit downloadingFinished();
-            }
+            // Emit that all queued downloads have finished.
+            emit downloadingFinished();
         }
     }
 }
@@ -26,9 +26,17 @@
 #pragma once
 
 // Qt includes.
+#include <QtCore/QByteArray>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QList>
 #include <QtCore/QObject>
 #include <QtCore/QMutex>
+#include <QtCore/QRect>
+#include <QtCore/QThreadPool>
 #include <QtCore/QUrl>
+#include <QtGui/QImage>
 #include <QtGui/QPixmap>
 #include <QtNetwork/QAuthenticator>
 #include <QtNetwork/QNetworkAccessManager>
@@ -37,6 +45,13 @@
 
 // Local includes.
 #include "qmapcontrol_global.h"
+#include "TileKey.h"
+#include "TilePayload.h"
+
+// STL includes.
+#include <map>
+#include <tuple>
+#include <utility>
 
 /*!
  * @author Kai Winter <kaiwinter@gmx.de>
@@ -44,6 +59,28 @@
  */
 namespace qmapcontrol
 {
+    //! Tile download priorities, most urgent first.
+    enum class DownloadPriority {
+        /// Tile visible in the viewport.
+        Visible,
+        /// Tile in the backbuffer margin around the viewport.
+        NearPrefetch,
+        /// Tile in the prefetch ring around the backbuffer.
+        FarPrefetch,
+        /// Tile from another zoom level than the displayed one.
+        OtherZoom
+    };
+
+    /*!
+     * Downloads map tiles.
+     * Requests are queued by priority, then by distance from the viewport center, and only a bounded number of
+     * downloads run concurrently for each host, so the tiles being looked at are downloaded first.
+     * Downloaded images are decoded by a worker pool, and handed back to the network manager's thread in batches.
+     *
+     * Failed downloads are not retried straight away: a failed tile is refused (see isUnavailable()) for a backoff
+     * delay doubling with each consecutive failure, and a host failing repeatedly (timeouts, server errors) has its
+     * queued requests held back for a while (circuit breaker), then probed with a single request.
+     */
     class QMAPCONTROL_EXPORT NetworkManager : public QObject
     {
         Q_OBJECT
@@ -71,30 +108,99 @@ namespace qmapcontrol
         void setProxy(const QNetworkProxy& proxy);
 
         /*!
-         * Aborts all current downloading threads.
+         * Fetch the maximum number of concurrent downloads for each host.
+         * @return the maximum number of concurrent downloads for each host.
+         */
+        int maxDownloadsPerHost() const;
+
+        /*!
+         * Set the maximum number of concurrent downloads for each host (further requests are queued).
+         * @param max_downloads The maximum number of concurrent downloads for each host (at least 1).
+         */
+        void setMaxDownloadsPerHost(const int& max_downloads);
+
+        /*!
+         * Aborts all current downloading threads, and drops the queued requests.
          * This is useful when changing the zoom-factor, though newly needed images loads faster
          */
         void abortDownloads();
 
         /*!
         * Get the number of current downloads.
-        * @return size of the downloading queues.
+        * @return size of the downloading queues (queued and in-flight requests).
         */
         int downloadQueueSize() const;
 
         /*!
-         * Checks if the given url resource is currently being downloaded.
-         * @param url The url of the resource.
-         * @return boolean, if the url resource is already downloading.
+         * Checks if the given tile is currently being downloaded.
+         * @param key The key of the tile.
+         * @return boolean, if the tile is already downloading.
+         */
+        bool isDownloading(const TileKey& key) const;
+
+        /*!
+         * Checks if the given tile is queued, waiting for a free download slot.
+         * @param key The key of the tile.
+         * @return boolean, if the tile is queued.
+         */
+        bool isQueued(const TileKey& key) const;
+
+        /*!
+         * Checks if the given tile failed to download, and its backoff delay has not expired yet (download requests
+         * are ignored meanwhile).
+         * @param key The key of the tile.
+         * @return boolean, if the tile is unavailable.
          */
-        bool isDownloading(const QUrl& url) const;
+        bool isUnavailable(const TileKey& key) const;
+
+        /*!
+         * Forgets the failed downloads and the failing hosts, so everything is requested again (eg: once the
+         * network connection is restored).
+         */
+        void resetDownloadFailures();
 
     public slots:
         /*!
-         * Downloads an image resource for the given url.
+         * Queues the download of a tile image resource from the given url.
+         * If the tile is already queued, its priority and distance are updated (see updateDownloadPriority()).
+         * @param key The key of the tile.
+         * @param url The image url to download.
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles), orders same priority requests.
+         */
+        void downloadImage(const TileKey& key, const QUrl& url, const DownloadPriority& priority = DownloadPriority::Visible, const qreal& distance = 0.0);
+
+        /*!
+         * Queues a conditional download of a tile image the caller already has (but has expired), using its
+         * validators (If-None-Match/If-Modified-Since). If the server answers the image has not been modified,
+         * imageNotModified() is emitted instead of imageDownloaded().
+         * @param key The key of the tile.
          * @param url The image url to download.
+         * @param etag The ETag of the image the caller has (may be empty).
+         * @param last_modified The Last-Modified date of the image the caller has (may be invalid).
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles), orders same priority requests.
          */
-        void downloadImage(const QUrl& url);
+        void revalidateImage(const TileKey& key, const QUrl& url, const QByteArray& etag, const QDateTime& last_modified, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Updates the priority of a queued download (does nothing if the tile is no longer queued).
+         * @param key The key of the tile.
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles).
+         */
+        void updateDownloadPriority(const TileKey& key, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Cancels the requests of a tile source that are no longer needed by the viewport.
+         * Queued requests at the given zoom level outside of the tile rect are dropped, as well as queued requests
+         * from other zoom levels (unless requested with DownloadPriority::OtherZoom and still overlapping the tile
+         * rect). In-flight requests are aborted when they no longer overlap the tile rect.
+         * @param source_id The tile source (see MapAdapter::sourceId()).
+         * @param zoom The zoom level displayed.
+         * @param tile_rect The tiles still needed (viewport and prefetch margins), in tile coordinates.
+         */
+        void cancelDownloadsOutside(const quint32& source_id, const int& zoom, const QRect& tile_rect);
 
     signals:
         /*!
@@ -109,11 +215,31 @@ namespace qmapcontrol
         void downloadingFinished();
 
         /*!
-         * Signal emitted when an image has been downloaded.
-         * @param url The url that the image was downloaded from.
+         * Signal emitted when an image has been downloaded (and decoded).
+         * Images are delivered in batches, each batch being followed by imageBatchFinished().
+         * @param key The key of the tile that was downloaded.
          * @param pixmap The image.
+         * @param payload The image as served (encoded bytes and HTTP metadata).
          */
-        void imageDownloaded(const QUrl& url, const QPixmap& pixmap);
+        void imageDownloaded(const TileKey& key, const QPixmap& pixmap, const TilePayload& payload);
+
+        /*!
+         * Signal emitted once a batch of images has been delivered through imageDownloaded().
+         */
+        void imageBatchFinished();
+
+        /*!
+         * Signal emitted when the server answered a revalidation (see revalidateImage()) with "304 Not Modified".
+         * @param key The key of the tile that is still up to date.
+         */
+        void imageNotModified(const TileKey& key);
+
+        /*!
+         * Signal emitted when an image failed to download (or to decode), delivered in the batches of
+         * imageDownloaded(). The tile is unavailable until its backoff delay expires.
+         * @param key The key of the tile that failed.
+         */
+        void imageFailed(const TileKey& key);
 
     private slots:
         /*!
@@ -129,6 +255,16 @@ namespace qmapcontrol
          */
         void downloadFinished(QNetworkReply* reply);
 
+        /*!
+         * Slot to deliver the images decoded so far (in the network manager's thread).
+         */
+        void flushDecodedImages();
+
+        /*!
+         * Slot to send the queued requests of the hosts whose circuit breaker has closed.
+         */
+        void resumeDownloads();
+
     private:
         //! Disable copy constructor.
         NetworkManager(const NetworkManager&); /// @todo remove once MSVC supports default/delete syntax.
@@ -136,13 +272,171 @@ namespace qmapcontrol
         //! Disable copy assignment.
         NetworkManager& operator=(const NetworkManager&); /// @todo remove once MSVC supports default/delete syntax.
 
+        /// Ordering of the queued requests: priority, distance from the viewport center, then request sequence.
+        using QueueOrder = std::tuple<int, qreal, quint64>;
+
+        /// A request waiting for a free download slot.
+        struct QueuedDownload
+        {
+            /// The image url to download.
+            QUrl url;
+            /// The position in its host queue.
+            QueueOrder order;
+            /// The ETag of the image the caller has, for a conditional download.
+            QByteArray etag;
+            /// The Last-Modified date of the image the caller has, for a conditional download.
+            QDateTime last_modified;
+        };
+
+        /// The download state of a host.
+        struct HostDownloads
+        {
+            /// Number of in-flight requests.
+            int in_flight = 0;
+            /// Queued requests, most urgent first.
+            std::map<QueueOrder, TileKey> queue;
+        };
+
+        /// The failures of a tile.
+        struct DownloadFailure
+        {
+            /// Number of consecutive failures.
+            int failures = 0;
+            /// When the tile may be requested again (see m_clock).
+            qint64 retry_at_ms = 0;
+        };
+
+        /// The health of a host (circuit breaker).
+        struct HostHealth
+        {
+            /// Number of consecutive failures (not counting missing tiles).
+            int failures = 0;
+            /// Number of times the breaker opened since the last success.
+            int trips = 0;
+            /// When the breaker lets a probe request through (see m_clock).
+            qint64 open_until_ms = 0;
+            /// Whether resumeDownloads() is scheduled for this host.
+            bool resume_scheduled = false;
+        };
+
+        /*!
+         * Records a failed download: backs the tile off, and counts the failure against its host.
+         * The downloading image mutex must be held.
+         * @param key The key of the tile.
+         * @param host The host of the request (empty if the failure is not the host's).
+         * @param missing Whether the server reported the tile does not exist (a longer backoff, not the host's fault).
+         */
+        void recordFailure(const TileKey& key, const QString& host, const bool& missing);
+
+        /*!
+         * Records a successful download, clearing the tile backoff and closing the host circuit breaker.
+         * The downloading image mutex must be held.
+         * @param key The key of the tile.
+         * @param host The host of the request.
+         */
+        void recordSuccess(const TileKey& key, const QString& host);
+
+        /*!
+         * Queues a download request, or updates it if already queued.
+         * @param key The key of the tile.
+         * @param download The request (its order is computed from the priority and distance).
+         * @param priority The download priority.
+         * @param distance The distance of the tile from the viewport center (in tiles).
+         * @return whether a new request was queued (false if already queued, in-flight or unavailable).
+         */
+        bool queueDownload(const TileKey& key, QueuedDownload download, const DownloadPriority& priority, const qreal& distance);
+
+        /*!
+         * Moves a queued request to its new position in its host queue.
+         * The downloading image mutex must be held.
+         * @param queued The queued request.
+         * @param key The key of the tile.
+         * @param order The new position.
+         */
+        void requeueDownload(QueuedDownload& queued, const TileKey& key, const QueueOrder& order);
+
+        /*!
+         * Sends queued requests while the hosts have free download slots.
+         * The downloading image mutex must be held.
+         */
+        void dispatchDownloads();
+
+        /*!
+         * Decodes a downloaded image (runs in the decode pool), and schedules its delivery.
+         * @param key The key of the tile.
+         * @param payload The image as served.
+         */
+        void decodeImage(const TileKey& key, const TilePayload& payload);
+
+        /*!
+         * Schedules the delivery of an image in the next batch.
+         * @param key The key of the tile.
+         * @param image The decoded image, null if the download failed.
+         * @param payload The image as served.
+         */
+        void deliverImage(const TileKey& key, const QImage& image, const TilePayload& payload);
+
+        /*!
+         * Removes an in-flight request from the in-flight index, releasing its host download slot.
+         * The downloading image mutex must be held.
+         * @param reply The reply to remove.
+         */
+        void releaseDownload(QNetworkReply* reply);
+
         /// Network access manager.
         QNetworkAccessManager m_nam;
 
-        /// Downloading image queue.
-        QMap<QNetworkReply*, QUrl> m_downloading_image;
+        /// Maximum number of concurrent downloads for each host.
+        int m_max_downloads_per_host;
+
+        /// Queued requests, by tile.
+        QHash<TileKey, QueuedDownload> m_queued_downloads;
+
+        /// Download state of each host.
+        QHash<QString, HostDownloads> m_hosts;
+
+        /// Sequence number of the next queued request (keeps same priority/distance requests in order).
+        quint64 m_queue_sequence;
 
-        /// Mutex protecting downloading image queue.
+        /// In-flight index: the tile each reply is downloading.
+        QHash<QNetworkReply*, TileKey> m_downloading_replies;
+
+        /// In-flight index: the reply downloading each tile.
+        QHash<TileKey, QNetworkReply*> m_downloading_keys;
+
+        /// Failed tiles, backed off.
+        QHash<TileKey, DownloadFailure> m_failed_downloads;
+
+        /// Health of the failing hosts.
+        QHash<QString, HostHealth> m_host_health;
+
+        /// Monotonic clock timing the backoffs.
+        QElapsedTimer m_clock;
+
+        /// Mutex protecting the queued requests, the in-flight index and the failures.
         mutable QMutex m_mutex_downloading_image;
+
+        /// Worker pool decoding the downloaded images.
+        QThreadPool m_decode_pool;
+
+        /// Number of images handed to the decode pool (or failures) and not yet delivered (only used in the network manager's thread).
+        int m_decodes_pending;
+
+        /// A decoded image waiting to be delivered.
+        struct DecodedImage
+        {
+            /// The key of the tile.
+            TileKey key;
+            /// The decoded image (null if decoding failed).
+            QImage image;
+            /// The image as served.
+            TilePayload payload;
+        };
+
+        /// Decoded images waiting to be delivered.
+        QList<DecodedImage> m_decoded_images;
+
+        /// Mutex protecting the decoded images.
+        QMutex m_mutex_decoded_images;
     };
 }
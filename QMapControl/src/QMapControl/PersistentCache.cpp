@@ -4,68 +4,680 @@
 
 #include "PersistentCache.h"
 
-#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDebug>
+#include <QDirIterator>
+#include <QFile>
+#include <QFutureInterface>
+#include <QHash>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QRegularExpression>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThreadPool>
+#include <QVariant>
+#include <QtConcurrent/QtConcurrentRun>
 
-#if defined(_WIN32)
-#include <cstdlib>
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <stdexcept>
-
 #include <system_error>
-#endif
+#include <vector>
+
+namespace {
+/// Number of queued insertions that schedules a flush.
+const int MaxPendingInsertions = 64;
+
+/// Number of tiles evicted or expired per I/O task (the lookups queued meanwhile run in between).
+const std::size_t EvictionChunk = 256;
+
+/// Name of the database file in the cache directory.
+const char *DatabaseFileName = "tiles.sqlite";
+
+/// Zoom below which the tiles get a retention bonus, for each level below it.
+const int OverviewZoom = 10;
+
+/// Retention bonus of the overview tiles for each zoom level below OverviewZoom (as if accessed a day later).
+const qint64 OverviewBonusMs = 24 * 60 * 60 * 1000;
+
+/// Version of the database schema (PRAGMA user_version), the cache is dropped when it changes.
+const int SchemaVersion = 2;
+
+/// The migration removing the tile files of the previous versions, pending until the cache directory has been walked.
+const char *LegacyFilesMigration = "legacy_files";
+
+void bindKey(QSqlQuery &query, qmapcontrol::TileKey const &key)
+{
+    query.addBindValue(static_cast<qint64>(key.high()));
+    query.addBindValue(static_cast<qint64>(key.low()));
+}
+
+bool execQuery(QSqlQuery &query)
+{
+    if (!query.exec()) {
+        qWarning() << "PersistentCache:" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+}
 
 struct PersistentCache::Impl
 {
-    QMutex m_mutex;
+    /// A tile waiting to be written.
+    struct PendingTile {
+        qmapcontrol::TilePayload payload;
+        qint64 created;
+    };
+
+    /// The in-memory index entry of a stored (or pending) tile.
+    struct IndexEntry {
+        qint64 created;
+        qint64 accessed;
+        qint32 bytes;
+    };
+
+    /// Mutex protecting the index, the pending writes, the size counters and the callback.
+    mutable QMutex m_mutex;
     QDir m_persistent_cache_directory;
+    QString m_database_path;
+    QString m_connection_name;
     std::chrono::minutes m_persistent_cache_expiry;
-    long expirationTimeMs;
+    qint64 expirationTimeMs;
+
+    QHash<qmapcontrol::TileKey, PendingTile> m_pending;
+    QHash<qmapcontrol::TileKey, qint64> m_touched;
+    QHash<qmapcontrol::TileKey, qint64> m_refreshed;
+    bool m_flush_scheduled = false;
+
+    /// Index of the stored tiles, loaded once on the I/O thread and kept in sync by every write.
+    QHash<qmapcontrol::TileKey, IndexEntry> m_index;
+    bool m_index_loaded = false;
+
+    qint64 m_total_bytes = 0;
+    qint64 m_capacity_bytes = 0;
+
+    /// The usage counters (tiles, bytes and capacity_bytes are filled in by statistics()).
+    PersistentCache::Statistics m_statistics;
 
-    QCryptographicHash hashFunction;
+    /// Whether an eviction is in progress (I/O thread only).
+    bool m_evicting = false;
+
+    /// Whether the cache is being destroyed: the chunked removals are not requeued (I/O thread only).
+    bool m_closing = false;
+
+    /// The walk of the cache directory removing the files left by the previous versions (I/O thread only).
+    std::unique_ptr<QDirIterator> m_legacy_files;
+
+    PersistentCache::TileReadyCallback m_tile_ready;
+
+    /// The I/O thread, every database access runs on it (declared last: it is joined first on destruction).
+    QThreadPool m_io_pool;
 
     explicit Impl(std::chrono::minutes expiry)
-        : m_persistent_cache_expiry(expiry), hashFunction(QCryptographicHash::Algorithm::Md5)
+        : m_persistent_cache_expiry(expiry)
     {
         expirationTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
                 m_persistent_cache_expiry).count();
+
+        // A single thread that never expires, so the connection always belongs to it.
+        m_io_pool.setMaxThreadCount(1);
+        m_io_pool.setExpiryTimeout(-1);
+    }
+
+    bool hasExpired(qint64 created, qint64 now) const
+    {
+        return (m_persistent_cache_expiry.count() > 0 && now - created > expirationTimeMs);
+    }
+
+    /// The connection (I/O thread only).
+    QSqlDatabase database()
+    {
+        return QSqlDatabase::database(m_connection_name, false);
     }
 
-    QString hash(QUrl const &url)
+    /// Opens the connection and creates the schema (I/O thread only).
+    bool open()
     {
-        hashFunction.reset();
-        hashFunction.addData(url.toEncoded());
+        auto db = QSqlDatabase::addDatabase("QSQLITE", m_connection_name);
+        db.setDatabaseName(m_database_path);
+        db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+        if (!db.open()) {
+            qWarning() << "PersistentCache: cannot open" << m_database_path << db.lastError().text();
+            db = QSqlDatabase();
+            QSqlDatabase::removeDatabase(m_connection_name);
+            return false;
+        }
+
+        QSqlQuery query(db);
+        query.exec("PRAGMA journal_mode=WAL");
+        query.exec("PRAGMA synchronous=NORMAL");
+
+        // A new database, or one of a previous version (the tile files of the versions before the database are
+        // only looked for then, once).
+        const bool created =
+                query.exec("PRAGMA user_version") && query.next() && query.value(0).toInt() != SchemaVersion;
+        if (created) {
+            query.exec("DROP TABLE IF EXISTS tiles");
+            query.exec(QString("PRAGMA user_version = %1").arg(SchemaVersion));
+        }
 
-        auto hash = QString(hashFunction.result().toHex());
-        return m_persistent_cache_directory.absolutePath() + QDir::separator() + hash;
+        query.exec("CREATE TABLE IF NOT EXISTS tiles ("
+                   "key_hi INTEGER NOT NULL, key_lo INTEGER NOT NULL, zoom INTEGER NOT NULL, "
+                   "data BLOB NOT NULL, bytes INTEGER NOT NULL, content_type TEXT, etag BLOB, last_modified INTEGER, "
+                   "created INTEGER NOT NULL, accessed INTEGER NOT NULL, "
+                   "PRIMARY KEY (key_hi, key_lo))");
+        query.exec("CREATE INDEX IF NOT EXISTS tiles_accessed ON tiles (accessed, bytes)");
+        query.exec("CREATE INDEX IF NOT EXISTS tiles_created ON tiles (created)");
+
+        query.exec("CREATE TABLE IF NOT EXISTS pending_migrations (name TEXT PRIMARY KEY)");
+        if (created) {
+            query.prepare("INSERT OR IGNORE INTO pending_migrations (name) VALUES (?)");
+            query.addBindValue(QString(LegacyFilesMigration));
+            execQuery(query);
+        }
+        return true;
     }
 
-    bool fileHasExpired(QFile const &file)
+    /// Whether a migration is pending (I/O thread only).
+    bool isMigrationPending(const char *name)
     {
-        return fileHasExpired(QFileInfo(file), QDateTime::currentDateTime());
+        QSqlQuery query(database());
+        query.prepare("SELECT 1 FROM pending_migrations WHERE name = ?");
+        query.addBindValue(QString(name));
+        return execQuery(query) && query.next();
     }
 
-    bool fileHasExpired(QFileInfo file, QDateTime datetime)
+    /// Records that a migration is done, so it never runs again (I/O thread only).
+    void completeMigration(const char *name)
     {
-        auto timeToExpiry = file.lastModified().msecsTo(datetime);
-        return (m_persistent_cache_expiry.count() > 0 && timeToExpiry > expirationTimeMs);
+        QSqlQuery query(database());
+        query.prepare("DELETE FROM pending_migrations WHERE name = ?");
+        query.addBindValue(QString(name));
+        execQuery(query);
     }
 
-    void removeFile(QFile const &file)
+    /// Loads the index of the stored tiles (I/O thread only, queued before any other operation).
+    void loadIndex()
     {
-        removeFile(file.fileName());
+        QHash<qmapcontrol::TileKey, IndexEntry> index;
+        qint64 total_bytes = 0;
+
+        auto db = database();
+        QSqlQuery query(db);
+        query.setForwardOnly(true);
+        if (query.exec("SELECT key_hi, key_lo, bytes, created, accessed FROM tiles")) {
+            while (query.next()) {
+                const auto key = qmapcontrol::TileKey::fromPacked(static_cast<quint64>(query.value(0).toLongLong()),
+                                                                  static_cast<quint64>(query.value(1).toLongLong()));
+                const auto bytes = query.value(2).toInt();
+                index.insert(key, IndexEntry{query.value(3).toLongLong(), query.value(4).toLongLong(), bytes});
+                total_bytes += bytes;
+            }
+        }
+
+        QMutexLocker locker(&m_mutex);
+
+        // The tiles inserted while loading are more recent than the stored ones.
+        for (auto itr = m_index.constBegin(); itr != m_index.constEnd(); ++itr) {
+            index.insert(itr.key(), itr.value());
+        }
+        m_index.swap(index);
+        m_index_loaded = true;
+        m_total_bytes = total_bytes;
     }
 
-    void removeFile(QFileInfo const &file)
+    /// Whether the connection has been closed (I/O thread only).
+    bool closed()
     {
-        removeFile(file.absoluteFilePath());
+        return !database().isOpen();
     }
 
-    void removeFile(QString filename)
+    /// Closes the connection (I/O thread only).
+    void close()
     {
-        m_persistent_cache_directory.remove(filename);
+        database().close();
+        QSqlDatabase::removeDatabase(m_connection_name);
+    }
+
+    /// Reports a tile through the callback.
+    void notify(qmapcontrol::TileKey const &key, PersistentCache::Tile const &tile)
+    {
+        PersistentCache::TileReadyCallback callback;
+        {
+            QMutexLocker locker(&m_mutex);
+            callback = m_tile_ready;
+        }
+        if (callback) {
+            callback(key, tile);
+        }
+    }
+
+    /// The size of a stored tile, 0 if not found.
+    qint64 storedBytes(QSqlQuery &query, qmapcontrol::TileKey const &key)
+    {
+        bindKey(query, key);
+        if (execQuery(query) && query.next()) {
+            return query.value(0).toLongLong();
+        }
+        return 0;
+    }
+
+    /// Whether the index knows the tile is not stored (expired tiles are still served). The mutex must be held.
+    bool indexedMiss(qmapcontrol::TileKey const &key) const
+    {
+        return m_index_loaded && !m_pending.contains(key) && !m_index.contains(key);
+    }
+
+    /// Looks for a tile (I/O thread only).
+    PersistentCache::Tile find(qmapcontrol::TileKey const &key)
+    {
+        PersistentCache::Tile tile;
+        QImage &image = tile.image;
+
+        // The tile may still be waiting to be written.
+        QByteArray pending_data;
+        bool miss;
+        {
+            QMutexLocker locker(&m_mutex);
+
+            auto pending = m_pending.constFind(key);
+            if (pending != m_pending.constEnd()) {
+                pending_data = pending->payload.data;
+            }
+            miss = indexedMiss(key);
+        }
+
+        if (!pending_data.isEmpty()) {
+            image.loadFromData(pending_data);
+        } else if (!miss) {
+            auto db = database();
+            QSqlQuery query(db);
+            query.prepare("SELECT data, created, etag, last_modified FROM tiles WHERE key_hi = ? AND key_lo = ?");
+            bindKey(query, key);
+            if (execQuery(query) && query.next()) {
+                const auto now = QDateTime::currentMSecsSinceEpoch();
+
+                // An expired tile is still served, with the validators to revalidate it.
+                if (hasExpired(query.value(1).toLongLong(), now)) {
+                    tile.stale = true;
+                    tile.etag = query.value(2).toByteArray();
+                    if (!query.value(3).isNull()) {
+                        tile.last_modified = QDateTime::fromMSecsSinceEpoch(query.value(3).toLongLong());
+                    }
+                }
+
+                if (image.loadFromData(query.value(0).toByteArray())) {
+                    // The access time is written by the next flush.
+                    QMutexLocker locker(&m_mutex);
+                    m_touched.insert(key, now);
+
+                    auto entry = m_index.find(key);
+                    if (entry != m_index.end()) {
+                        entry->accessed = now;
+                    }
+                }
+            }
+        }
+
+        {
+            QMutexLocker locker(&m_mutex);
+            if (image.isNull()) {
+                ++m_statistics.misses;
+            } else {
+                ++m_statistics.hits;
+                if (tile.stale) {
+                    ++m_statistics.stale_hits;
+                }
+            }
+        }
+
+        notify(key, tile);
+        return tile;
+    }
+
+    /// Reads all the tiles of a range (I/O thread only).
+    int readAhead(qmapcontrol::TileKey const &key, QRect const &tile_rect)
+    {
+        const QRect rect = tile_rect.normalized().intersected(QRect(0, 0, std::numeric_limits<int>::max(),
+                                                                    std::numeric_limits<int>::max()));
+        if (rect.isEmpty()) {
+            return 0;
+        }
+
+        // The y index is packed below x, so each column of the range is a contiguous key interval (a single interval
+        // from the first to the last tile would span every row of the columns in between).
+        auto db = database();
+        QSqlQuery query(db);
+        query.setForwardOnly(true);
+        query.prepare("SELECT key_lo, data, created FROM tiles WHERE key_hi = ? AND key_lo BETWEEN ? AND ?");
+
+        const auto now = QDateTime::currentMSecsSinceEpoch();
+        int count = 0;
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            const qmapcontrol::TileKey first(key.sourceId(), key.zoom(), x, rect.top(), key.epsg(), key.tileSizePx());
+            const qmapcontrol::TileKey last(key.sourceId(), key.zoom(), x, rect.bottom(), key.epsg(),
+                                            key.tileSizePx());
+            query.bindValue(0, static_cast<qint64>(first.high()));
+            query.bindValue(1, static_cast<qint64>(first.low()));
+            query.bindValue(2, static_cast<qint64>(last.low()));
+            if (!execQuery(query)) {
+                return count;
+            }
+
+            while (query.next()) {
+                if (hasExpired(query.value(2).toLongLong(), now)) {
+                    continue;
+                }
+
+                QImage image;
+                if (image.loadFromData(query.value(1).toByteArray())) {
+                    PersistentCache::Tile tile;
+                    tile.image = image;
+                    notify(qmapcontrol::TileKey::fromPacked(first.high(),
+                                                            static_cast<quint64>(query.value(0).toLongLong())),
+                           tile);
+                    ++count;
+                }
+            }
+        }
+
+        return count;
+    }
+
+    /// Writes the pending changes in a single transaction (I/O thread only).
+    void flush()
+    {
+        QHash<qmapcontrol::TileKey, PendingTile> pending;
+        QHash<qmapcontrol::TileKey, qint64> touched;
+        QHash<qmapcontrol::TileKey, qint64> refreshed;
+        {
+            QMutexLocker locker(&m_mutex);
+            m_flush_scheduled = false;
+            pending = m_pending;
+            touched.swap(m_touched);
+            refreshed.swap(m_refreshed);
+        }
+
+        if (pending.isEmpty() && touched.isEmpty() && refreshed.isEmpty()) {
+            return;
+        }
+
+        auto db = database();
+        QSqlQuery select_bytes(db);
+        select_bytes.prepare("SELECT bytes FROM tiles WHERE key_hi = ? AND key_lo = ?");
+        QSqlQuery insert(db);
+        insert.prepare("INSERT OR REPLACE INTO tiles "
+                       "(key_hi, key_lo, zoom, data, bytes, content_type, etag, last_modified, created, accessed) "
+                       "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        QSqlQuery touch(db);
+        touch.prepare("UPDATE tiles SET accessed = ? WHERE key_hi = ? AND key_lo = ?");
+        QSqlQuery refresh(db);
+        refresh.prepare("UPDATE tiles SET created = ?, accessed = ? WHERE key_hi = ? AND key_lo = ?");
+
+        qint64 delta_bytes = 0;
+        db.transaction();
+
+        for (auto itr = pending.constBegin(); itr != pending.constEnd(); ++itr) {
+            const auto &payload = itr->payload;
+            delta_bytes -= storedBytes(select_bytes, itr.key());
+            bindKey(insert, itr.key());
+            insert.addBindValue(itr.key().zoom());
+            insert.addBindValue(payload.data);
+            insert.addBindValue(payload.data.size());
+            insert.addBindValue(payload.content_type);
+            insert.addBindValue(payload.etag);
+            insert.addBindValue(payload.last_modified.isValid() ? QVariant(payload.last_modified.toMSecsSinceEpoch())
+                                                                : QVariant(QMetaType::LongLong, nullptr));
+            insert.addBindValue(itr->created);
+            insert.addBindValue(itr->created);
+            if (execQuery(insert)) {
+                delta_bytes += payload.data.size();
+            }
+        }
+
+        for (auto itr = touched.constBegin(); itr != touched.constEnd(); ++itr) {
+            touch.addBindValue(itr.value());
+            bindKey(touch, itr.key());
+            execQuery(touch);
+        }
+
+        for (auto itr = refreshed.constBegin(); itr != refreshed.constEnd(); ++itr) {
+            refresh.addBindValue(itr.value());
+            refresh.addBindValue(itr.value());
+            bindKey(refresh, itr.key());
+            execQuery(refresh);
+        }
+
+        if (!db.commit()) {
+            qWarning() << "PersistentCache:" << db.lastError().text();
+            db.rollback();
+            delta_bytes = 0;
+        }
+
+        {
+            QMutexLocker locker(&m_mutex);
+            m_total_bytes += delta_bytes;
+
+            // The written tiles are now found in the database (unless queued again meanwhile).
+            for (auto itr = pending.constBegin(); itr != pending.constEnd(); ++itr) {
+                auto queued = m_pending.find(itr.key());
+                if (queued != m_pending.end() && queued->created == itr->created) {
+                    m_pending.erase(queued);
+                }
+            }
+        }
+
+        evict();
+    }
+
+    /// Retention score of a tile, the lowest scores are evicted first: the access time, plus a bonus for the overview
+    /// tiles (a low zoom tile covers a large area, is cheap to store and expensive to lose).
+    static qint64 retentionScore(qmapcontrol::TileKey const &key, IndexEntry const &entry)
+    {
+        return entry.accessed + std::max(0, OverviewZoom - key.zoom()) * OverviewBonusMs;
+    }
+
+    /// Selects the tiles to evict to bring the size down to 90% of the capacity, and queues their removal in chunks
+    /// (I/O thread only).
+    void evict()
+    {
+        // An eviction is already in progress (or the connection is closed).
+        if (m_evicting || closed()) {
+            return;
+        }
+
+        struct Candidate {
+            qint64 score;
+            qmapcontrol::TileKey key;
+            qint32 bytes;
+        };
+
+        // Take a snapshot of the index (sorted outside the lock, so the lookups are not stalled).
+        std::vector<Candidate> candidates;
+        qint64 excess_bytes;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_capacity_bytes <= 0 || m_total_bytes <= m_capacity_bytes) {
+                return;
+            }
+            excess_bytes = m_total_bytes - m_capacity_bytes / 10 * 9;
+
+            candidates.reserve(static_cast<std::size_t>(m_index.size()));
+            for (auto itr = m_index.constBegin(); itr != m_index.constEnd(); ++itr) {
+                if (!m_pending.contains(itr.key())) {
+                    candidates.push_back(Candidate{retentionScore(itr.key(), itr.value()), itr.key(), itr->bytes});
+                }
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const Candidate &lhs, const Candidate &rhs) { return lhs.score < rhs.score; });
+
+        auto evicted = std::make_shared<std::vector<std::pair<qmapcontrol::TileKey, qint32>>>();
+        {
+            QMutexLocker locker(&m_mutex);
+            for (const auto &candidate : candidates) {
+                if (excess_bytes <= 0) {
+                    break;
+                }
+
+                // Skip the tiles used or stored again since the snapshot.
+                auto entry = m_index.find(candidate.key);
+                if (entry == m_index.end() || retentionScore(candidate.key, *entry) != candidate.score ||
+                    m_pending.contains(candidate.key)) {
+                    continue;
+                }
+
+                // Removed from the index immediately, so the lookups already miss them.
+                m_index.erase(entry);
+                evicted->emplace_back(candidate.key, candidate.bytes);
+                excess_bytes -= candidate.bytes;
+            }
+            m_statistics.evictions += evicted->size();
+        }
+
+        if (!evicted->empty()) {
+            m_evicting = true;
+            removeTiles(evicted, true);
+        }
+    }
+
+    /// Removes a chunk of the tiles dropped from the index by the eviction or the housekeeping, queueing the next
+    /// chunk (I/O thread only).
+    void removeTiles(std::shared_ptr<std::vector<std::pair<qmapcontrol::TileKey, qint32>>> tiles, bool eviction)
+    {
+        // A chunk queued before the cache was closed: the tiles are still stored, they are indexed again when opened.
+        if (closed()) {
+            return;
+        }
+
+        const auto first = tiles->size() > EvictionChunk ? tiles->end() - EvictionChunk : tiles->begin();
+
+        auto db = database();
+        QSqlQuery remove(db);
+        remove.prepare("DELETE FROM tiles WHERE key_hi = ? AND key_lo = ?");
+
+        // Skip the tiles stored again since they were dropped from the index.
+        std::vector<std::pair<qmapcontrol::TileKey, qint32>> chunk;
+        {
+            QMutexLocker locker(&m_mutex);
+            std::copy_if(first, tiles->end(), std::back_inserter(chunk),
+                         [this](const std::pair<qmapcontrol::TileKey, qint32> &tile) {
+                             return !m_index.contains(tile.first);
+                         });
+        }
+        tiles->erase(first, tiles->end());
+
+        qint64 removed_bytes = 0;
+        db.transaction();
+        for (const auto &tile : chunk) {
+            bindKey(remove, tile.first);
+            if (execQuery(remove) && remove.numRowsAffected() > 0) {
+                removed_bytes += tile.second;
+            }
+        }
+        db.commit();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            m_total_bytes -= removed_bytes;
+        }
+
+        // Let the queued lookups run before the next chunk (unless closing, the connection is closed next).
+        if (!tiles->empty() && !m_closing) {
+            QtConcurrent::run(&m_io_pool, [this, tiles, eviction]() { removeTiles(tiles, eviction); });
+        } else if (eviction) {
+            m_evicting = false;
+
+            // The cache may have grown meanwhile.
+            if (!m_closing) {
+                evict();
+            }
+        }
+    }
+
+    /// Removes a chunk of the tile files left by the previous versions (one file per tile, named by the MD5 of its
+    /// url), queueing the next chunk (I/O thread only). The directory is only walked while the migration is pending:
+    /// once completed, it is never walked again.
+    void removeLegacyFiles()
+    {
+        if (m_legacy_files == nullptr) {
+            if (closed() || !isMigrationPending(LegacyFilesMigration)) {
+                return;
+            }
+            m_legacy_files.reset(new QDirIterator(m_persistent_cache_directory.absolutePath(), QDir::Files));
+        }
+
+        static const QRegularExpression legacy_name("^[0-9a-f]{32}$");
+        for (std::size_t scanned = 0; scanned < EvictionChunk && m_legacy_files->hasNext(); ++scanned) {
+            m_legacy_files->next();
+            if (legacy_name.match(m_legacy_files->fileName()).hasMatch()) {
+                QFile::remove(m_legacy_files->filePath());
+            }
+        }
+
+        // Let the queued lookups run before the next chunk (if closing, the walk resumes when the cache is reopened).
+        if (m_legacy_files->hasNext()) {
+            if (!m_closing) {
+                QtConcurrent::run(&m_io_pool, [this]() { removeLegacyFiles(); });
+                return;
+            }
+        } else {
+            completeMigration(LegacyFilesMigration);
+        }
+        m_legacy_files.reset();
+    }
+
+    /// Finds the expired tiles in the index, and queues their removal (I/O thread only).
+    void housekeeping()
+    {
+        auto expired = std::make_shared<std::vector<std::pair<qmapcontrol::TileKey, qint32>>>();
+        {
+            QMutexLocker locker(&m_mutex);
+
+            const auto now = QDateTime::currentMSecsSinceEpoch();
+            for (auto itr = m_index.begin(); itr != m_index.end();) {
+                if (hasExpired(itr->created, now) && !m_pending.contains(itr.key())) {
+                    // Removed from the index immediately, so the lookups already miss them.
+                    expired->emplace_back(itr.key(), itr->bytes);
+                    itr = m_index.erase(itr);
+                    ++m_statistics.expirations;
+                } else {
+                    ++itr;
+                }
+            }
+        }
+
+        if (!expired->empty()) {
+            removeTiles(expired, false);
+        }
+    }
+
+    /// Removes all the tiles (I/O thread only).
+    void clear()
+    {
+        auto db = database();
+        QSqlQuery query(db);
+        query.prepare("DELETE FROM tiles");
+        execQuery(query);
+
+        QMutexLocker locker(&m_mutex);
+        m_total_bytes = 0;
+
+        // Keep the tiles queued since the clear was requested.
+        for (auto itr = m_index.begin(); itr != m_index.end();) {
+            if (m_pending.contains(itr.key())) {
+                ++itr;
+            } else {
+                itr = m_index.erase(itr);
+            }
+        }
     }
 };
 
@@ -76,64 +688,215 @@ PersistentCache::PersistentCache(QDir cachePath, std::chrono::minutes expiration
     if (!cachePath.mkpath(cachePath.absolutePath())) {
         throw std::system_error(errno, std::system_category());
     }
+
+    p->m_database_path = cachePath.absoluteFilePath(DatabaseFileName);
+    p->m_connection_name = QString("qmapcontrol-cache-%1").arg(reinterpret_cast<quintptr>(p.get()));
+
+    auto impl = p.get();
+    if (!QtConcurrent::run(&p->m_io_pool, [impl]() { return impl->open(); }).result()) {
+        throw std::runtime_error(("Cannot open the persistent cache " + p->m_database_path).toStdString());
+    }
+
+    // Load the index in the background, the lookups go to the database until it is loaded.
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->loadIndex(); });
+
+    // Remove the tile files of the previous versions, once, when the database is created or upgraded (in chunks,
+    // interleaved with the lookups).
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->removeLegacyFiles(); });
+}
+
+PersistentCache::~PersistentCache()
+{
+    auto impl = p.get();
+    QtConcurrent::run(&p->m_io_pool, [impl]() {
+        impl->m_closing = true;
+        impl->flush();
+        impl->close();
+    }).waitForFinished();
+}
+
+void PersistentCache::setTileReadyCallback(TileReadyCallback callback)
+{
+    QMutexLocker locker(&p->m_mutex);
+    p->m_tile_ready = std::move(callback);
+}
+
+bool PersistentCache::contains(qmapcontrol::TileKey const &key)
+{
+    QMutexLocker locker(&p->m_mutex);
+    if (p->indexedMiss(key)) {
+        ++p->m_statistics.misses;
+        return false;
+    }
+    return true;
+}
+
+bool PersistentCache::peek(qmapcontrol::TileKey const &key) const
+{
+    QMutexLocker locker(&p->m_mutex);
+    return !p->indexedMiss(key);
+}
+
+bool PersistentCache::isFresh(qmapcontrol::TileKey const &key) const
+{
+    QMutexLocker locker(&p->m_mutex);
+    if (p->m_pending.contains(key)) {
+        return true;
+    }
+
+    auto entry = p->m_index.constFind(key);
+    return entry != p->m_index.constEnd() && !p->hasExpired(entry->created, QDateTime::currentMSecsSinceEpoch());
+}
+
+void PersistentCache::waitForIndex()
+{
+    // The index is loaded by the first task queued on the I/O thread.
+    QtConcurrent::run(&p->m_io_pool, []() {}).waitForFinished();
 }
 
-QString PersistentCache::findPixmap(QUrl const &path, QPixmap &resource)
+QFuture<PersistentCache::Tile> PersistentCache::findTile(qmapcontrol::TileKey const &key)
 {
-    auto hash = p->hash(path);
-    QFile file(hash);
-    if (!file.exists()) {
-        return QString();
+    // Answer the misses from the index, without queueing any I/O.
+    bool miss;
+    {
+        QMutexLocker locker(&p->m_mutex);
+        miss = p->indexedMiss(key);
+        if (miss) {
+            ++p->m_statistics.misses;
+        }
     }
 
-    if (p->fileHasExpired(file)) {
-        p->removeFile(file);
-        return QString();
+    if (miss) {
+        p->notify(key, Tile());
+
+        QFutureInterface<Tile> result;
+        result.reportStarted();
+        result.reportFinished(new Tile());
+        return result.future();
     }
 
-    resource.load(hash);
-    return hash;
+    auto impl = p.get();
+    return QtConcurrent::run(&p->m_io_pool, [impl, key]() { return impl->find(key); });
 }
 
-QString PersistentCache::insertPixmap(const QUrl &url, const QPixmap &resource)
+QFuture<int> PersistentCache::readAhead(qmapcontrol::TileKey const &key, QRect const &tile_rect)
 {
-    auto hash = p->hash(url);
+    auto impl = p.get();
+    return QtConcurrent::run(&p->m_io_pool, [impl, key, tile_rect]() { return impl->readAhead(key, tile_rect); });
+}
 
-    if (!resource.save(p->m_persistent_cache_directory.absoluteFilePath(hash), "PNG")) {
-        qDebug() << "ohoh " << p->m_persistent_cache_directory.absoluteFilePath(hash);
-        throw std::system_error(errno, std::system_category());
+void PersistentCache::insertTile(const qmapcontrol::TileKey &key, const qmapcontrol::TilePayload &payload)
+{
+    bool full;
+    {
+        QMutexLocker locker(&p->m_mutex);
+        const auto now = QDateTime::currentMSecsSinceEpoch();
+        p->m_index.insert(key, Impl::IndexEntry{now, now, payload.data.size()});
+        p->m_pending.insert(key, Impl::PendingTile{payload, now});
+        ++p->m_statistics.insertions;
+        p->m_refreshed.remove(key);
+        full = p->m_pending.size() >= MaxPendingInsertions;
     }
 
-    return hash;
+    if (full) {
+        flush();
+    }
 }
 
-void PersistentCache::startPersistentCacheHousekeeping()
+void PersistentCache::refreshTile(const qmapcontrol::TileKey &key)
 {
-    QMutexLocker locker(&p->m_mutex);
+    {
+        QMutexLocker locker(&p->m_mutex);
 
-    auto allentries = p->m_persistent_cache_directory.entryInfoList();
+        // Nothing to refresh if it was evicted (or replaced) meanwhile.
+        auto entry = p->m_index.find(key);
+        if (entry == p->m_index.end() || p->m_pending.contains(key)) {
+            return;
+        }
 
-    QStringList expiredFiles;
-    auto currentTimeMs = QDateTime::currentDateTime();
+        const auto now = QDateTime::currentMSecsSinceEpoch();
+        entry->created = now;
+        entry->accessed = now;
+        p->m_refreshed.insert(key, now);
+        ++p->m_statistics.refreshes;
+    }
 
-    for (const auto &entry : allentries) {
-        if (p->fileHasExpired(entry, currentTimeMs)) {
-            expiredFiles.push_back(entry.fileName());
+    flush();
+}
+
+void PersistentCache::flush()
+{
+    {
+        QMutexLocker locker(&p->m_mutex);
+        if (p->m_flush_scheduled) {
+            return;
         }
+        p->m_flush_scheduled = true;
     }
 
-    for (const auto &fileToDelete : expiredFiles) {
-        p->removeFile(fileToDelete);
+    auto impl = p.get();
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->flush(); });
+}
+
+qint64 PersistentCache::capacity() const
+{
+    QMutexLocker locker(&p->m_mutex);
+    return p->m_capacity_bytes;
+}
+
+void PersistentCache::setCapacity(qint64 bytes)
+{
+    {
+        QMutexLocker locker(&p->m_mutex);
+        p->m_capacity_bytes = bytes;
     }
+
+    auto impl = p.get();
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->evict(); });
 }
 
-void PersistentCache::clearPersistentCache()
+qint64 PersistentCache::size() const
+{
+    QMutexLocker locker(&p->m_mutex);
+    return p->m_total_bytes;
+}
+
+PersistentCache::Statistics PersistentCache::statistics() const
 {
     QMutexLocker locker(&p->m_mutex);
+    auto statistics = p->m_statistics;
+    statistics.tiles = p->m_index.size();
+    statistics.bytes = p->m_total_bytes;
+    statistics.capacity_bytes = p->m_capacity_bytes;
+    return statistics;
+}
+
+void PersistentCache::resetStatistics()
+{
+    QMutexLocker locker(&p->m_mutex);
+    p->m_statistics = Statistics();
+}
+
+void PersistentCache::startPersistentCacheHousekeeping()
+{
+    if (p->m_persistent_cache_expiry.count() <= 0) {
+        return;
+    }
 
-    auto allentries = p->m_persistent_cache_directory.entryInfoList();
+    auto impl = p.get();
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->housekeeping(); });
+}
 
-    for (auto entry : allentries) {
-        p->removeFile(entry);
+void PersistentCache::clearPersistentCache()
+{
+    {
+        QMutexLocker locker(&p->m_mutex);
+        p->m_pending.clear();
+        p->m_touched.clear();
+        p->m_refreshed.clear();
+        p->m_index.clear();
     }
+
+    auto impl = p.get();
+    QtConcurrent::run(&p->m_io_pool, [impl]() { impl->clear(); });
 }
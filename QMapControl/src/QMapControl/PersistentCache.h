@@ -5,22 +5,90 @@
 #ifndef QMAPCONTROL_PERSISTENTCACHE_H
 #define QMAPCONTROL_PERSISTENTCACHE_H
 
+#include "qmapcontrol_global.h"
+#include "TileKey.h"
+#include "TilePayload.h"
 #include "utils/spimpl.h"
 
+#include <QByteArray>
+#include <QDateTime>
 #include <QDir>
-#include <QPixmap>
-#include <QUrl>
+#include <QFuture>
+#include <QImage>
+#include <QRect>
 
 #include <chrono>
+#include <functional>
 #include <tuple>
 
 /**
  * @brief A cache to persistently store the downloaded pixmaps.
+ * The tiles are stored as served (encoded bytes and HTTP metadata, see TilePayload), so storing a tile never
+ * re-encodes it. They are packed in a single SQLite database (tiles.sqlite in the cache directory), keyed by the
+ * packed tile key, so lookups are a primary key search and no directory is ever scanned. An in-memory index of the
+ * stored tiles (size, creation and access times), loaded once when the cache is opened, answers the misses and finds
+ * the expired tiles without any disk access.
+ *
+ * All the disk accesses run on the cache's own I/O thread, none of the methods blocks the caller: lookups return a
+ * future and report the tile through the tile ready callback, insertions are queued and written in batches (a single
+ * transaction per flush()). All the methods are thread safe.
  */
-class PersistentCache {
+class QMAPCONTROL_EXPORT PersistentCache {
     struct Impl;
     spimpl::unique_impl_ptr<Impl> p;
 public:
+    /**
+     * @brief A tile read from the cache.
+     */
+    struct Tile {
+        /// The decoded tile, null if not found.
+        QImage image;
+        /// Whether the tile has expired: it is still served, and should be revalidated with the server.
+        bool stale = false;
+        /// The ETag of a stale tile.
+        QByteArray etag;
+        /// The Last-Modified date of a stale tile.
+        QDateTime last_modified;
+    };
+
+    /**
+     * @brief Callback reporting a tile read from the cache, called on the I/O thread (or on the calling thread when
+     * the index answers a miss). The image is null if the tile was looked up by findTile() and not found.
+     */
+    using TileReadyCallback = std::function<void(qmapcontrol::TileKey const &, Tile const &)>;
+
+    /**
+     * @brief Counters describing the cache usage since creation (or the last resetStatistics()).
+     */
+    struct Statistics {
+        /// Number of lookups that found the tile.
+        quint64 hits = 0;
+        /// Number of hits on expired tiles (served while revalidated).
+        quint64 stale_hits = 0;
+        /// Number of lookups that did not find the tile.
+        quint64 misses = 0;
+        /// Number of tiles inserted.
+        quint64 insertions = 0;
+        /// Number of tiles evicted to honour the capacity.
+        quint64 evictions = 0;
+        /// Number of expired tiles removed by the housekeeping.
+        quint64 expirations = 0;
+        /// Number of expired tiles refreshed (revalidated by the server).
+        quint64 refreshes = 0;
+        /// Number of tiles currently stored (or queued).
+        qint64 tiles = 0;
+        /// Number of bytes currently stored (as of the last write).
+        qint64 bytes = 0;
+        /// The capacity in bytes, 0 if unbounded.
+        qint64 capacity_bytes = 0;
+
+        /// The ratio of lookups that found the tile.
+        double hitRate() const
+        {
+            return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0;
+        }
+    };
+
     /**
      * @brief Create the cache in the proper directory and with the proper expiration timeout
      * @param cachePath
@@ -29,32 +97,125 @@ public:
     PersistentCache(QDir cachePath, std::chrono::minutes expiration);
 
     /**
-     * @brief Look for the resource in the cache, returning it if found.
-     * @param path
-     * @return The ash of the resource found in the cache. In that case, the pixmap argument will contain the
-     * resource. If the resource was not found, returns an empty string, and the pixmap argument is untouched.
+     * @brief Writes the queued insertions, waits for the pending operations and closes the database.
+     */
+    ~PersistentCache();
+
+    /**
+     * @brief Set the callback reporting the tiles read by findTile() and readAhead().
+     * @param callback The callback.
+     */
+    void setTileReadyCallback(TileReadyCallback callback);
+
+    /**
+     * @brief Whether the tile may be in the cache, answered by the index without any disk access.
+     * @param key The key of the tile
+     * @return False if the tile is known not to be stored, true otherwise (including while the index is loading).
+     */
+    bool contains(qmapcontrol::TileKey const &key);
+
+    /**
+     * @brief Whether the tile may be in the cache, as contains() but without counting a miss (eg: to probe the tiles
+     * of other zoom levels, that are not requested).
+     * @param key The key of the tile
+     * @return False if the tile is known not to be stored, true otherwise (including while the index is loading).
+     */
+    bool peek(qmapcontrol::TileKey const &key) const;
+
+    /**
+     * @brief Whether the tile is stored (or queued) and has not expired, answered by the index without any disk
+     * access and without counting a lookup.
+     * @param key The key of the tile
+     * @return True if the tile is fresh, false otherwise (including while the index is loading, see waitForIndex()).
+     */
+    bool isFresh(qmapcontrol::TileKey const &key) const;
+
+    /**
+     * @brief Block until the index of the stored tiles is loaded.
+     */
+    void waitForIndex();
+
+    /**
+     * @brief Look for the tile in the cache, on the I/O thread.
+     * An expired tile is still returned (stale), so it can be displayed while it is revalidated.
+     * The result is also reported through the tile ready callback.
+     * @param key The key of the tile
+     * @return The tile, with a null image if not found.
+     */
+    QFuture<Tile> findTile(qmapcontrol::TileKey const &key);
+
+    /**
+     * @brief Read all the stored tiles of a tile range, on the I/O thread.
+     * The tiles found are reported through the tile ready callback.
+     * @param key The key of any tile of the range (identifies the tile source, projection, tile size and zoom)
+     * @param tile_rect The x/y tile indexes of the range.
+     * @return The number of tiles read.
+     */
+    QFuture<int> readAhead(qmapcontrol::TileKey const &key, QRect const &tile_rect);
+
+    /**
+     * @brief Queue the tile to be stored in the cache, it is written by the next flush().
+     * @param key The key of the tile
+     * @param payload The tile as served
+     */
+    void insertTile(qmapcontrol::TileKey const &key, qmapcontrol::TilePayload const &payload);
+
+    /**
+     * @brief Mark a stale tile as fresh again (the server answered it has not been modified), written by the next
+     * flush().
+     * @param key The key of the tile
+     */
+    void refreshTile(qmapcontrol::TileKey const &key);
+
+    /**
+     * @brief Schedule the write of the queued insertions (and the access times of the tiles found) in a single
+     * transaction, followed by the eviction of the least recently used tiles if the cache exceeds its capacity.
+     */
+    void flush();
+
+    /**
+     * @brief The maximum size of the stored tiles.
+     * @return The capacity in bytes, 0 if unbounded.
+     */
+    qint64 capacity() const;
+
+    /**
+     * @brief Set the maximum size of the stored tiles.
+     * When exceeded, the least recently used tiles are evicted in the background (in chunks interleaved with the
+     * lookups) down to 90% of the capacity. The overview tiles are kept longer: each zoom level below 10 counts as one
+     * more day since the last access.
+     * @param bytes The capacity in bytes, 0 if unbounded.
+     */
+    void setCapacity(qint64 bytes);
+
+    /**
+     * @brief The size of the stored tiles (as of the last write).
+     * @return The size in bytes.
+     */
+    qint64 size() const;
+
+    /**
+     * @brief Fetch the usage counters.
+     * @return The cache statistics.
      */
-    QString findPixmap(QUrl const &path, QPixmap &resource);
+    Statistics statistics() const;
 
     /**
-     * @brief
-     * @param url
-     * @param resource
-     * @return
+     * @brief Reset the usage counters (all but the tiles, bytes and capacity).
      */
-    QString insertPixmap(QUrl const &url, QPixmap const &resource);
+    void resetStatistics();
 
     /**
-     * @brief Starts the Persistent cache housekeeping. Scan the current cache for expired enties, and remove them.
-     * This function should be called just after the enablePersistentCache(), preferably in a separate thread using
-     * QtConcurrent for example.
-     * Indeed the persistentCacheFind only removes the files that are searched for, this means that
-     * even if a file has expired, it will remain in cache forever if never accessed.
+     * @brief Starts the Persistent cache housekeeping. Schedule the removal of all the expired entries.
+     * The expired tiles are found in the index and removed in small chunks, interleaved with the lookups.
+     * This function should be called just after the enablePersistentCache().
+     * Indeed the lookups never remove the expired tiles (they are served while revalidated), this means that
+     * even if a tile has expired, it will remain in cache until evicted.
      */
     void startPersistentCacheHousekeeping();
 
     /**
-     * @brief Remove all the files in the persistent cache, regardless of the expiration.
+     * @brief Remove all the tiles in the persistent cache, regardless of the expiration.
      */
     void clearPersistentCache();
 
@@ -0,0 +1,249 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#include "PrefetchPlanner.h"
+
+#include <QtCore/QMutexLocker>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace qmapcontrol {
+
+namespace {
+/// Time after which the motion has faded out, once the reports stop.
+const qint64 StaleMs = 2500;
+
+/// Weight of the latest focus report in the smoothed velocity.
+const qreal Smoothing = 0.5;
+
+/// Minimum look-ahead distance worth a corridor, in tiles.
+const qreal MinLookAheadTiles = 0.5;
+
+/// Maximum look-ahead distance, in tiles (bounds the jumps of the map focus).
+const qreal MaxLookAheadTiles = 16.0;
+}
+
+const int PrefetchPlanner::DefaultBudget;
+
+const int PrefetchPlanner::DefaultLookAheadMs;
+
+PrefetchPlanner::PrefetchPlanner()
+        : m_budget(DefaultBudget),
+          m_look_ahead_ms(DefaultLookAheadMs),
+          m_zoom(-1),
+          m_focus_ms(-1),
+          m_zoom_trend(0),
+          m_zoom_ms(-1)
+{
+    m_clock.start();
+}
+
+int PrefetchPlanner::budget() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_budget;
+}
+
+void PrefetchPlanner::setBudget(int tiles)
+{
+    QMutexLocker locker(&m_mutex);
+    m_budget = std::max(0, tiles);
+}
+
+void PrefetchPlanner::setLookAheadMs(int milliseconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_look_ahead_ms = std::max(0, milliseconds);
+}
+
+void PrefetchPlanner::focusChanged(const QPointF &focus_px, int zoom)
+{
+    QMutexLocker locker(&m_mutex);
+    const qint64 now = m_clock.elapsed();
+
+    if (m_focus_ms >= 0 && zoom == m_zoom && now - m_focus_ms <= StaleMs) {
+        // Several reports within the same millisecond are measured from the first one.
+        const qint64 elapsed_ms = now - m_focus_ms;
+        if (elapsed_ms <= 0) {
+            return;
+        }
+
+        const QPointF velocity = (focus_px - m_focus_px) * 1000.0 / elapsed_ms;
+        m_velocity_px_per_s = m_velocity_px_per_s * (1.0 - Smoothing) + velocity * Smoothing;
+    } else {
+        // The map was still (or the pixels changed scale): start over.
+        m_velocity_px_per_s = QPointF();
+    }
+
+    m_focus_px = focus_px;
+    m_zoom = zoom;
+    m_focus_ms = now;
+}
+
+void PrefetchPlanner::zoomChanged(int zoom)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_zoom >= 0 && zoom != m_zoom) {
+        m_zoom_trend = zoom > m_zoom ? 1 : -1;
+        m_zoom_ms = m_clock.elapsed();
+    }
+
+    m_zoom = zoom;
+    m_focus_ms = -1;
+    m_velocity_px_per_s = QPointF();
+}
+
+PrefetchPlanner::Motion PrefetchPlanner::motion() const
+{
+    QMutexLocker locker(&m_mutex);
+    return currentMotion(m_zoom);
+}
+
+std::vector<QPoint> PrefetchPlanner::corridorTiles(const QRect &fetched_tiles, int zoom, int tile_size_px) const
+{
+    Motion motion;
+    int budget;
+    int look_ahead_ms;
+    {
+        QMutexLocker locker(&m_mutex);
+        motion = currentMotion(zoom);
+        budget = m_budget;
+        look_ahead_ms = m_look_ahead_ms;
+    }
+
+    // How far the viewport goes, in tiles.
+    QPointF distance = motion.velocity_px_per_s * (look_ahead_ms / 1000.0) / tile_size_px;
+    qreal length = std::hypot(distance.x(), distance.y());
+    if (budget <= 0 || fetched_tiles.isEmpty() || length < MinLookAheadTiles) {
+        return {};
+    }
+    if (length > MaxLookAheadTiles) {
+        distance *= MaxLookAheadTiles / length;
+        length = MaxLookAheadTiles;
+    }
+
+    // The band swept by the fetched tiles along the motion.
+    const QPointF direction = distance / length;
+    const QPointF normal(-direction.y(), direction.x());
+    const QRectF fetched_rect(fetched_tiles.x(), fetched_tiles.y(), fetched_tiles.width(), fetched_tiles.height());
+    const QPointF center = fetched_rect.center();
+    const qreal half_along = fetched_rect.width() / 2.0 * std::abs(direction.x()) + fetched_rect.height() / 2.0 * std::abs(direction.y());
+    const qreal half_across = fetched_rect.width() / 2.0 * std::abs(normal.x()) + fetched_rect.height() / 2.0 * std::abs(normal.y());
+
+    // The tiles of the band, ordered by when the viewport reaches them.
+    const QRectF swept_rect = fetched_rect.united(fetched_rect.translated(distance));
+    std::vector<std::pair<qreal, QPoint>> candidates;
+    for (int x = static_cast<int>(std::floor(swept_rect.left())); x < std::ceil(swept_rect.right()); ++x) {
+        for (int y = static_cast<int>(std::floor(swept_rect.top())); y < std::ceil(swept_rect.bottom()); ++y) {
+            if (fetched_tiles.contains(x, y)) {
+                continue;
+            }
+
+            const QPointF offset = QPointF(x + 0.5, y + 0.5) - center;
+            const qreal along = QPointF::dotProduct(offset, direction);
+            const qreal across = QPointF::dotProduct(offset, normal);
+            if (along > 0.0 && along <= half_along + length + 0.5 && std::abs(across) <= half_across + 0.5) {
+                candidates.emplace_back(along + std::abs(across) / 1024.0, QPoint(x, y));
+            }
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const std::pair<qreal, QPoint> &a, const std::pair<qreal, QPoint> &b) {
+        return a.first < b.first;
+    });
+
+    std::vector<QPoint> tiles;
+    for (std::size_t i = 0; i < candidates.size() && static_cast<int>(i) < budget; ++i) {
+        tiles.push_back(candidates[i].second);
+    }
+    return tiles;
+}
+
+std::vector<QPoint> PrefetchPlanner::zoomTiles(const QRectF &viewport_rect_px, int zoom, int tile_size_px, int &next_zoom) const
+{
+    Motion motion;
+    int budget;
+    {
+        QMutexLocker locker(&m_mutex);
+        motion = currentMotion(zoom);
+        budget = m_budget;
+    }
+
+    next_zoom = zoom + motion.zoom_trend;
+    if (budget <= 0 || motion.zoom_trend == 0 || next_zoom < 0) {
+        return {};
+    }
+
+    // The viewport at the next zoom level, around the same center.
+    const qreal scale = motion.zoom_trend > 0 ? 2.0 : 0.5;
+    QRectF next_rect_px(QPointF(0.0, 0.0), viewport_rect_px.size());
+    next_rect_px.moveCenter(viewport_rect_px.center() * scale);
+    const QPointF center_tile = next_rect_px.center() / tile_size_px;
+
+    // Its tiles, nearest to the center first.
+    std::vector<std::pair<qreal, QPoint>> candidates;
+    const int right = static_cast<int>(std::ceil(next_rect_px.right() / tile_size_px));
+    const int bottom = static_cast<int>(std::ceil(next_rect_px.bottom() / tile_size_px));
+    for (int x = static_cast<int>(std::floor(next_rect_px.left() / tile_size_px)); x < right; ++x) {
+        for (int y = static_cast<int>(std::floor(next_rect_px.top() / tile_size_px)); y < bottom; ++y) {
+            candidates.emplace_back(std::hypot(x + 0.5 - center_tile.x(), y + 0.5 - center_tile.y()), QPoint(x, y));
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const std::pair<qreal, QPoint> &a, const std::pair<qreal, QPoint> &b) {
+        return a.first < b.first;
+    });
+
+    std::vector<QPoint> tiles;
+    for (std::size_t i = 0; i < candidates.size() && static_cast<int>(i) < budget; ++i) {
+        tiles.push_back(candidates[i].second);
+    }
+    return tiles;
+}
+
+PrefetchPlanner::Motion PrefetchPlanner::currentMotion(int zoom) const
+{
+    Motion motion;
+    if (zoom != m_zoom) {
+        return motion;
+    }
+
+    const qint64 now = m_clock.elapsed();
+
+    // The velocity fades out once the focus reports stop.
+    if (m_focus_ms >= 0 && now - m_focus_ms < StaleMs) {
+        motion.velocity_px_per_s = m_velocity_px_per_s * (1.0 - static_cast<qreal>(now - m_focus_ms) / StaleMs);
+    }
+
+    if (m_zoom_ms >= 0 && now - m_zoom_ms < StaleMs) {
+        motion.zoom_trend = m_zoom_trend;
+    }
+    return motion;
+}
+
+}
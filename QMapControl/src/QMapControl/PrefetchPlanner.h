@@ -0,0 +1,171 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_PREFETCHPLANNER_H
+#define QMAPCONTROL_PREFETCHPLANNER_H
+
+#include "qmapcontrol_global.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QPoint>
+#include <QtCore/QPointF>
+#include <QtCore/QRect>
+#include <QtCore/QRectF>
+
+#include <vector>
+
+namespace qmapcontrol {
+
+/*!
+ * Plans the tiles to prefetch ahead of the map motion.
+ * The map control reports every map focus change (panning, flinging, following a geometry) and zoom change; the planner
+ * estimates the focus velocity from them, and the map adapter layers ask it for the tiles of the corridor the viewport
+ * will sweep in the next few seconds, and for the tiles of the next zoom level while zooming. Each plan is bounded by a
+ * budget, so at most that many look-ahead tile downloads are outstanding (the tiles left out of the latest plan are
+ * cancelled by the layer).
+ *
+ * Threading contract: every method can be called concurrently from any thread (the motion is reported from the GUI
+ * thread, the plans are made by the rendering threads).
+ */
+class QMAPCONTROL_EXPORT PrefetchPlanner {
+public:
+    /// The estimated motion of the map.
+    struct Motion {
+        /// The velocity of the map focus, in world pixels per second (at the zoom of the last report).
+        QPointF velocity_px_per_s;
+        /// The zoom direction: 1 when zooming in, -1 when zooming out, 0 otherwise.
+        int zoom_trend = 0;
+    };
+
+    /// Default maximum number of look-ahead tiles.
+    static const int DefaultBudget = 32;
+
+    /// Default time to look ahead, in milliseconds.
+    static const int DefaultLookAheadMs = 3000;
+
+    /*!
+     * Constructs a planner, with no motion.
+     */
+    PrefetchPlanner();
+
+    /*!
+     * Fetches the maximum number of look-ahead tiles.
+     * @return the budget.
+     */
+    int budget() const;
+
+    /*!
+     * Set the maximum number of look-ahead tiles of a plan (bounds the bandwidth spent ahead of the viewport).
+     * @param tiles The budget (0 disables the look-ahead).
+     */
+    void setBudget(int tiles);
+
+    /*!
+     * Set how far ahead the corridor reaches.
+     * @param milliseconds The time to look ahead.
+     */
+    void setLookAheadMs(int milliseconds);
+
+    /*!
+     * Reports a map focus change.
+     * @param focus_px The map focus point, in world pixels.
+     * @param zoom The current zoom.
+     */
+    void focusChanged(const QPointF &focus_px, int zoom);
+
+    /*!
+     * Reports a zoom change (the velocity is reset, the pixels have changed scale).
+     * @param zoom The new zoom.
+     */
+    void zoomChanged(int zoom);
+
+    /*!
+     * Fetches the estimated motion, which fades out once the reports stop.
+     * @return the motion.
+     */
+    Motion motion() const;
+
+    /*!
+     * Plans the tiles the viewport will sweep, in the direction of the motion.
+     * @param fetched_tiles The tiles already drawn or prefetched (excluded from the corridor).
+     * @param zoom The zoom of the tiles.
+     * @param tile_size_px The tile size, in pixels.
+     * @return the tiles, in the order the viewport reaches them (at most budget() of them).
+     */
+    std::vector<QPoint> corridorTiles(const QRect &fetched_tiles, int zoom, int tile_size_px) const;
+
+    /*!
+     * Plans the tiles of the next zoom level covering the viewport, in the direction of the zoom motion.
+     * @param viewport_rect_px The viewport, in world pixels.
+     * @param zoom The current zoom.
+     * @param tile_size_px The tile size, in pixels.
+     * @param next_zoom Set to the zoom of the tiles.
+     * @return the tiles, nearest to the viewport center first (at most budget() of them, none if not zooming).
+     */
+    std::vector<QPoint> zoomTiles(const QRectF &viewport_rect_px, int zoom, int tile_size_px, int &next_zoom) const;
+
+private:
+    /*!
+     * Fetches the estimated motion. The mutex must be held.
+     * @param zoom The zoom the motion is requested for (no velocity if it is not the zoom of the last report).
+     * @return the motion.
+     */
+    Motion currentMotion(int zoom) const;
+
+    /// Mutex protecting the planner.
+    mutable QMutex m_mutex;
+
+    /// Monotonic clock timing the reports.
+    QElapsedTimer m_clock;
+
+    /// The maximum number of look-ahead tiles.
+    int m_budget;
+
+    /// The time to look ahead, in milliseconds.
+    int m_look_ahead_ms;
+
+    /// The last reported map focus point, in world pixels.
+    QPointF m_focus_px;
+
+    /// The zoom of the last report.
+    int m_zoom;
+
+    /// Time of the last focus report (see m_clock), negative if none.
+    qint64 m_focus_ms;
+
+    /// The smoothed velocity, in world pixels per second.
+    QPointF m_velocity_px_per_s;
+
+    /// The zoom direction.
+    int m_zoom_trend;
+
+    /// Time of the last zoom report (see m_clock), negative if none.
+    qint64 m_zoom_ms;
+};
+
+}
+
+#endif // QMAPCONTROL_PREFETCHPLANNER_H
@@ -30,6 +30,7 @@
 #include <QtWidgets/QStyleOption>
 
 // STL includes.
+#include <algorithm>
 #include <cmath>
 #include <utility>
 
@@ -39,6 +40,7 @@
 #include "GeometryPolygon.h"
 #include "ImageManager.h"
 #include "LayerGeometry.h"
+#include "LayerMapAdapter.h"
 #include "Projection.h"
 
 #include <QDebug>
@@ -78,7 +80,7 @@ QMapControl::QMapControl(const QSizeF &size_px, QWidget *parent, Qt::WindowFlags
           m_mouse_right_origin_center(false),
           m_mouse_position_pressed_px(0.0, 0.0),
           m_mouse_position_current_px(0.0, 0.0),
-          m_primary_screen(size_px.toSize() * 2),
+          m_primary_screen(size_px.toSize() * 2, QImage::Format_ARGB32_Premultiplied),
           m_primary_screen_map_focus_point_px(0.0, 0.0),
           m_primary_screen_backbuffer_rect_px(PointWorldPx(0.0, 0.0), PointWorldPx(0.0, 0.0)),
           m_primary_screen_scaled_enabled(false),
@@ -88,7 +90,9 @@ QMapControl::QMapControl(const QSizeF &size_px, QWidget *parent, Qt::WindowFlags
           m_zoom_control_button_in("+", this),
           m_zoom_control_slider(Qt::Vertical, this),
           m_zoom_control_button_out("-", this),
-          m_progress_indicator(this)
+          m_progress_indicator(this),
+          m_redraw_interval(1000 / 30),
+          m_prefetch_planner(std::make_shared<PrefetchPlanner>())
     {
         // Register meta types.
         qRegisterMetaType<RectWorldPx>("RectWorldPx");
@@ -101,8 +105,16 @@ QMapControl::QMapControl(const QSizeF &size_px, QWidget *parent, Qt::WindowFlags
         // Connect signal/slot for when the backbuffer is updated, so that primary screen is updated in the main thread.
         QObject::connect(this, &QMapControl::updatedBackBuffer, this, &QMapControl::updatePrimaryScreen);
 
+        // Default - parallel rendering disabled.
+        m_render_pool.setMaxThreadCount(1);
+
+        // Setup the redraw scheduler.
+        m_redraw_timer.setSingleShot(true);
+        QObject::connect(&m_redraw_timer, &QTimer::timeout, this, &QMapControl::redrawScheduled);
+        m_redraw_clock.start();
+
         // Connect signals from the Image Manager.
-        QObject::connect(&ImageManager::get(), &ImageManager::imageUpdated, this, &QMapControl::requestRedraw);
+        QObject::connect(&ImageManager::get(), &ImageManager::imagesUpdated, this, &QMapControl::requestRedraw);
         QObject::connect(&ImageManager::get(), &ImageManager::downloadingFinished, this, &QMapControl::loadingFinished);
 
         // Default - projection as Spherical Mercator.
@@ -159,12 +171,18 @@ void QMapControl::setProjection(const projection::EPSG &epsg)
 {
     // Set the projection.
     projection::set(epsg);
+
+    // The cached layer surfaces are out of date.
+    invalidateLayerSurfaces();
 }
 
 void QMapControl::setTileSizePx(const int &tile_size_px)
 {
     // Set the tile size used by the Image Manager.
     ImageManager::get().setTileSizePx(tile_size_px);
+
+    // The cached layer surfaces are out of date.
+    invalidateLayerSurfaces();
 }
 
 void QMapControl::setBackgroundColour(const QColor &colour)
@@ -189,6 +207,94 @@ void QMapControl::clearPersistentCache()
     ImageManager::get().clearPersistentCache();
 }
 
+void QMapControl::warmUpPersistentCache(const RectWorldCoord &bbox, int min_zoom, int max_zoom)
+{
+    // Fetch a copy of the current layers.
+    const auto layers = getLayers();
+
+    for (const auto &layer : layers) {
+        auto layer_mapadapter = std::dynamic_pointer_cast<LayerMapAdapter>(layer);
+        if (layer_mapadapter != nullptr) {
+            const auto mapadapter = layer_mapadapter->getMapAdapter();
+            if (mapadapter != nullptr) {
+                ImageManager::get().warmUpPersistentCache(*mapadapter, bbox, min_zoom, max_zoom);
+            }
+        }
+    }
+}
+
+void QMapControl::setTileCacheCapacity(std::size_t capacity_bytes)
+{
+    ImageManager::get().setMemoryCacheCapacity(capacity_bytes);
+}
+
+TileCache::Statistics QMapControl::tileCacheStatistics() const
+{
+    return ImageManager::get().memoryCacheStatistics();
+}
+
+void QMapControl::setPersistentCacheCapacity(qint64 capacity_bytes)
+{
+    ImageManager::get().setPersistentCacheCapacity(capacity_bytes);
+}
+
+PersistentCache::Statistics QMapControl::persistentCacheStatistics() const
+{
+    return ImageManager::get().persistentCacheStatistics();
+}
+
+void QMapControl::setMaxTileDownloadsPerHost(const int &max_downloads)
+{
+    ImageManager::get().setMaxDownloadsPerHost(max_downloads);
+}
+
+void QMapControl::setPrefetchBudget(const int &tiles)
+{
+    m_prefetch_planner->setBudget(tiles);
+}
+
+void QMapControl::setPrefetchLookAhead(const std::chrono::milliseconds &look_ahead)
+{
+    m_prefetch_planner->setLookAheadMs(static_cast<int>(look_ahead.count()));
+}
+
+int QMapControl::redrawFrameRate() const
+{
+    return static_cast<int>(1000 / m_redraw_interval.count());
+}
+
+void QMapControl::setRedrawFrameRate(const int &frames_per_second)
+{
+    // At least one redraw per second, at most one per millisecond.
+    m_redraw_interval = std::chrono::milliseconds(1000 / qBound(1, frames_per_second, 1000));
+}
+
+int QMapControl::renderThreadCount() const
+{
+    return m_render_pool.maxThreadCount();
+}
+
+void QMapControl::setRenderThreadCount(const int &thread_count)
+{
+    m_render_pool.setMaxThreadCount(std::max(1, thread_count));
+}
+
+QMapControl::RedrawStatistics QMapControl::redrawStatistics() const
+{
+    RedrawStatistics statistics;
+    statistics.requested = m_redraw_requested;
+    statistics.scheduled = m_redraw_scheduled;
+    statistics.rendered = m_redraw_rendered;
+    return statistics;
+}
+
+void QMapControl::resetRedrawStatistics()
+{
+    m_redraw_requested = 0;
+    m_redraw_scheduled = 0;
+    m_redraw_rendered = 0;
+}
+
 void QMapControl::setProxy(const QNetworkProxy &proxy)
 {
     // Set the Image Manager's network proxy.
@@ -269,6 +375,13 @@ void QMapControl::enableScaledBackground(const bool &visible)
                 QObject::connect(static_cast<LayerGeometry*>(layer.get()), &LayerGeometry::geometryClicked, this, &QMapControl::geometryClicked);
             }
 
+            // Is it a map adapter layer?
+            if(layer->getLayerType() == Layer::LayerType::LayerMapAdapter)
+            {
+                // Share the prefetch planner.
+                static_cast<LayerMapAdapter*>(layer.get())->setPrefetchPlanner(m_prefetch_planner);
+            }
+
             // Scope the locker to ensure the mutex is release as soon as possible.
             {
                 // Gain a write lock to protect the layers container.
@@ -392,8 +505,11 @@ void QMapControl::enableScaledBackground(const bool &visible)
         mBackbufferSize = QSize(2 * sz, 2 * sz);
 
         // Create new pixmaps with the new size required (2 x viewport size to allow for panning backbuffer).
-        m_primary_screen = QPixmap(mBackbufferSize);
+        m_primary_screen = QImage(mBackbufferSize, QImage::Format_ARGB32_Premultiplied);
         m_primary_screen.fill(Qt::transparent);
+
+        // The pooled backbuffer surfaces of the previous size are no longer needed.
+        m_surface_pool.clear();
         m_primary_screen_scaled = QPixmap(mBackbufferSize);
         m_primary_screen_scaled.fill(Qt::transparent);
         m_primary_screen_scaled_offset = PointPx(0.0, 0.0);
@@ -454,6 +570,9 @@ void QMapControl::enableScaledBackground(const bool &visible)
         // Set the map focus point.
         m_map_focus_coord = point_coord;
 
+        // Report the motion to the prefetch planner.
+        m_prefetch_planner->focusChanged(projection::get().toPointWorldPx(m_map_focus_coord, m_current_zoom).rawPoint(), m_current_zoom);
+
         emit mapFocusPointChanged(m_map_focus_coord);
 
         // Request the primary screen to be redrawn.
@@ -1008,7 +1127,7 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
     {
         // Return the primary screen (ie: what is currently being displayed).
         // Note: m_viewport_center_px is the same as (m_viewport_size_px / 2)
-        return m_primary_screen.copy(QRect((m_viewport_center_px + mapFocusPointWorldPx() - m_primary_screen_map_focus_point_px).rawPoint().toPoint(), m_viewport_size_px.toSize()));
+        return QPixmap::fromImage(m_primary_screen.copy(QRect((m_viewport_center_px + mapFocusPointWorldPx() - m_primary_screen_map_focus_point_px).rawPoint().toPoint(), m_viewport_size_px.toSize())));
     }
 
 
@@ -1019,9 +1138,6 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
         // Check the current zoom is less than the maximum zoom
         if(m_current_zoom < m_zoom_maximum)
         {
-            // Cancel existing image loading.
-            ImageManager::get().abortLoading();
-
             /// @TODO Could we cancel current layer drawing as well?
 
             // Is the primary screen scaled enabled?
@@ -1044,6 +1160,10 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
             // Increase the zoom!
             m_current_zoom++;
 
+            // Report the zoom motion to the prefetch planner (the downloads of the previous zoom level are cancelled by
+            // the next draw, unless still needed).
+            m_prefetch_planner->zoomChanged(m_current_zoom);
+
             // Force the primary screen to be redrawn.
             redrawPrimaryScreen(true);
 
@@ -1057,9 +1177,6 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
         // Check the current zoom is greater than the minimum zoom.
         if(m_current_zoom > m_zoom_minimum)
         {
-            // Cancel existing image loading.
-            ImageManager::get().abortLoading();
-
             /// @TODO Could we cancel current layer drawing as well?
 
             // Is the primary screen scaled enabled?
@@ -1070,7 +1187,7 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
                 new_primary_screen_scaled.fill(Qt::transparent);
                 QPainter painter(&new_primary_screen_scaled);
                 painter.scale(0.5, 0.5);
-                painter.drawPixmap(PointWorldPx(m_viewport_size_px.width(), m_viewport_size_px.height()).rawPoint(), m_primary_screen);
+                painter.drawImage(PointWorldPx(m_viewport_size_px.width(), m_viewport_size_px.height()).rawPoint(), m_primary_screen);
 
                 // Store the new scaled primary screen.
                 m_primary_screen_scaled = new_primary_screen_scaled;
@@ -1082,6 +1199,10 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
             // Decrease the zoom!
             m_current_zoom--;
 
+            // Report the zoom motion to the prefetch planner (the downloads of the previous zoom level are cancelled by
+            // the next draw, unless still needed).
+            m_prefetch_planner->zoomChanged(m_current_zoom);
+
             // Force the primary screen to be redrawn.
             redrawPrimaryScreen(true);
 
@@ -1128,10 +1249,27 @@ void QMapControl::setMouseButtonLeft(const MouseButtonMode &mode, const bool &or
     }
 
     // Drawing management.
+    void QMapControl::invalidateLayerSurfaces()
+    {
+        // Loop through each layer and mark its cached surface as dirty.
+        for(const auto& layer : getLayers())
+        {
+            layer->invalidateSurface();
+        }
+    }
+
     void QMapControl::requestRedraw()
     {
-        // Force the primary screen to be redrawn.
-        redrawPrimaryScreen(true);
+        // Count the request.
+        ++m_redraw_requested;
+
+        // Is a redraw already scheduled? (this request is coalesced with it)
+        if(m_redraw_timer.isActive() == false)
+        {
+            // Schedule the redraw once the frame interval since the last one has elapsed.
+            const qint64 remaining_ms = m_redraw_interval.count() - m_redraw_clock.elapsed();
+            m_redraw_timer.start(static_cast<int>(std::max<qint64>(0, remaining_ms)));
+        }
     }
 
 
@@ -1455,7 +1593,7 @@ PointWorldPx QMapControl::mapFocusPointWorldPx() const
 
         // Draws the primary screen image to the pixmap.
 
-        painter->drawPixmap(px, py, m_primary_screen);
+        painter->drawImage(QPointF(px, py), m_primary_screen);
 
 /*
         painter->setPen(Qt::red);
@@ -1535,8 +1673,8 @@ bool QMapControl::checkBackbuffer() const
             // Start the progress indicator as we are going to start the redrawing process
             QTimer::singleShot(0, &m_progress_indicator, SLOT(startAnimation()));
 
-            // Generate a new backbuffer (2 x viewport size to allow for panning backbuffer).
-            QImage image_backbuffer(mBackbufferSize, QImage::Format_ARGB32);
+            // Fetch a backbuffer surface from the pool (2 x viewport size to allow for panning backbuffer).
+            QImage image_backbuffer(m_surface_pool.acquire(mBackbufferSize));
 
             // Clear the backbuffer.
             image_backbuffer.fill(Qt::transparent);
@@ -1544,15 +1682,17 @@ bool QMapControl::checkBackbuffer() const
             // Create a painter for the backbuffer.
             QPainter painter_back_buffer(&image_backbuffer);
 
-            // Capture the map focus point we are going to use for this backbuffer.
-            PointWorldPx backbuffer_map_focus_px(mapFocusPointWorldPx());
-
-            // Calculate the new backbuffer rect (based on the saved backbuffer map focus point).
+            // Calculate the new backbuffer rect (based on the current map focus point), snapped to whole pixels so the
+            // cached layer surfaces can be scrolled when panning.
             QRectF backbufferRect;
             backbufferRect.setSize(mBackbufferSize);
-            backbufferRect.moveCenter(backbuffer_map_focus_px.rawPoint());
+            backbufferRect.moveCenter(mapFocusPointWorldPx().rawPoint());
+            backbufferRect.moveTopLeft(QPointF(std::floor(backbufferRect.left()), std::floor(backbufferRect.top())));
             backbuffer_rect_px = RectWorldPx(backbufferRect);
 
+            // Capture the map focus point we are going to use for this backbuffer (the center of the snapped rect).
+            PointWorldPx backbuffer_map_focus_px(backbuffer_rect_px.centerPx());
+
             painter_back_buffer.save();
             // Translate to the backbuffer top/left point.
             painter_back_buffer.translate(-backbuffer_rect_px.topLeftPx().rawPoint());
@@ -1565,16 +1705,22 @@ bool QMapControl::checkBackbuffer() const
                 if (mAborted) {
                     return;
                 }
-                // Draw the layer to the backbuffer.
-                layer->draw(painter_back_buffer, backbuffer_rect_px, m_current_zoom);
+                // Draw the layer to the backbuffer (only re-rendered if it has changed).
+                layer->drawCached(painter_back_buffer, backbuffer_rect_px, m_current_zoom, &m_render_pool);
             }
 
             read_locker.unlock();
 
             painter_back_buffer.restore();
 
+            // Count the rendered backbuffer.
+            ++m_redraw_rendered;
+
+            // Finish painting, the surface is handed to the main thread without copy.
+            painter_back_buffer.end();
+
             // Inform the main thread that we have a new backbuffer.
-            emit updatedBackBuffer(QPixmap::fromImage(image_backbuffer), backbuffer_rect_px, backbuffer_map_focus_px);
+            emit updatedBackBuffer(image_backbuffer, backbuffer_rect_px, backbuffer_map_focus_px);
 
             // Stop the progress indicator as we have finished the redrawing process.
             QTimer::singleShot(0, &m_progress_indicator, SLOT(stopAnimation()));
@@ -1583,6 +1729,17 @@ bool QMapControl::checkBackbuffer() const
 
 
     /// Private slots...
+    // Drawing management.
+    void QMapControl::redrawScheduled()
+    {
+        // Count the scheduled redraw, and start the next frame interval.
+        ++m_redraw_scheduled;
+        m_redraw_clock.restart();
+
+        // Force the primary screen to be redrawn.
+        redrawPrimaryScreen(true);
+    }
+
     // Geometry management.
     void QMapControl::geometryPositionChanged(const Geometry* geometry)
     {
@@ -1642,10 +1799,10 @@ bool QMapControl::checkBackbuffer() const
         redrawPrimaryScreen();
     }
 
-    void QMapControl::updatePrimaryScreen(QPixmap backbuffer_pixmap, RectWorldPx backbuffer_rect_px, PointWorldPx backbuffer_map_focus_px)
+    void QMapControl::updatePrimaryScreen(QImage backbuffer_image, RectWorldPx backbuffer_rect_px, PointWorldPx backbuffer_map_focus_px)
     {
-        // Backbuffer image is ready, save it to the primary screen.
-        m_primary_screen = backbuffer_pixmap;
+        // Backbuffer image is ready, save it to the primary screen (the previous surface goes back to the pool).
+        m_primary_screen = backbuffer_image;
 
         // Update the backbuffer rect that is available.
         m_primary_screen_backbuffer_rect_px = backbuffer_rect_px;
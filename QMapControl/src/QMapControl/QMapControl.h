@@ -27,9 +27,11 @@
 
 // Qt includes.
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QList>
 #include <QtCore/QObject>
 #include <QtCore/QReadWriteLock>
+#include <QtCore/QThreadPool>
 #include <QtCore/QTimer>
 #include <QtGui/QMouseEvent>
 #include <QtGui/QPaintEvent>
@@ -41,15 +43,20 @@
 #include <QMutex>
 
 // STL includes.
+#include <atomic>
 #include <chrono>
 
 // Local includes.
 #include "qmapcontrol_global.h"
 #include "Geometry.h"
 #include "Layer.h"
+#include "PersistentCache.h"
+#include "PrefetchPlanner.h"
 #include "Point.h"
 #include "Projection.h"
 #include "QProgressIndicator.h"
+#include "SurfacePool.h"
+#include "TileCache.h"
 
 //! QMapControl namespace
 namespace qmapcontrol
@@ -168,19 +175,125 @@ namespace qmapcontrol
                                    const QDir &path = PersistentCacheDefaultPath);
 
         /**
-         * @brief Starts the Persistent cache housekeeping. Scan the current cache for expired enties, and remove them.
-         * This function should be called just after the enablePersistentCache(), preferably in a separate thread using
-         * QtConcurrent for example.
-         * Indeed the ImageManager::persistentCacheFind only removes the files that are searched for, this means that
-         * even if a file has expired, it will remain in cache forever if never accessed.
+         * @brief Starts the Persistent cache housekeeping. Remove the expired entries (on the cache I/O thread).
+         * This function should be called just after the enablePersistentCache().
+         * Indeed the persistent cache lookups never remove the expired tiles (they are served while revalidated), this
+         * means that even if a tile has expired, it will remain in cache until the housekeeping or an eviction removes it.
          */
         void startPersistentCacheHousekeeping();
 
         /**
-         * @brief Remove all the files in the persistent cache, regardless of the expiration.
+         * @brief Remove all the tiles in the persistent cache, regardless of the expiration.
          */
         void clearPersistentCache();
 
+        /**
+         * @brief Reads ahead the persistent cache tiles of an area for all the map adapter layers, loading them into
+         * the in-memory cache on the persistent cache I/O thread (eg: before going offline, or at startup).
+         * @param bbox The area to read, in world coordinates.
+         * @param min_zoom The lowest zoom to read.
+         * @param max_zoom The highest zoom to read.
+         */
+        void warmUpPersistentCache(const RectWorldCoord &bbox, int min_zoom, int max_zoom);
+
+        /*!
+         * Set the byte budget of the in-memory tile cache.
+         * When exceeded, the least recently used tiles are evicted (they will be fetched again from the persistent
+         * cache or the network when needed).
+         * @param capacity_bytes The maximum number of bytes the cached tiles can use.
+         */
+        void setTileCacheCapacity(std::size_t capacity_bytes = TileCache::DefaultCapacityBytes);
+
+        /*!
+         * Fetches the in-memory tile cache usage counters (hits, misses, evictions, size).
+         * @return the in-memory tile cache statistics.
+         */
+        TileCache::Statistics tileCacheStatistics() const;
+
+        /*!
+         * Set the byte quota of the persistent cache (unbounded by default).
+         * When exceeded, the least recently used tiles are evicted in the background; the overview (low zoom) tiles
+         * are kept longer than the deep zoom ones.
+         * @param capacity_bytes The maximum number of bytes the stored tiles can use, 0 if unbounded.
+         */
+        void setPersistentCacheCapacity(qint64 capacity_bytes);
+
+        /*!
+         * Fetches the persistent cache usage counters (bytes stored, hit rate, evictions).
+         * @return the persistent cache statistics.
+         */
+        PersistentCache::Statistics persistentCacheStatistics() const;
+
+        /*!
+         * Set the maximum number of concurrent tile downloads for each host (default 6).
+         * Further downloads are queued, visible tiles first and nearest to the viewport center first.
+         * @param max_downloads The maximum number of concurrent downloads for each host.
+         */
+        void setMaxTileDownloadsPerHost(const int& max_downloads);
+
+        /*!
+         * Set the maximum number of look-ahead tiles prefetched by the map adapter layers (default 32).
+         * While the map moves (panning, flinging, following a geometry), the tiles of the corridor the viewport is
+         * heading to are prefetched; while zooming, the tiles of the next zoom level.
+         * @param tiles The maximum number of look-ahead tiles (0 disables the look-ahead prefetch).
+         */
+        void setPrefetchBudget(const int& tiles);
+
+        /*!
+         * Set how far ahead of the map motion the tiles are prefetched (default 3 seconds).
+         * @param look_ahead The time to look ahead.
+         */
+        void setPrefetchLookAhead(const std::chrono::milliseconds& look_ahead);
+
+        /// Counters describing the redraw scheduler activity since creation (or the last resetRedrawStatistics()).
+        struct RedrawStatistics {
+            /// Number of redraw requests (see requestRedraw()).
+            quint64 requested = 0;
+            /// Number of backbuffer redraws scheduled (at most one per frame interval).
+            quint64 scheduled = 0;
+            /// Number of backbuffer redraws actually rendered.
+            quint64 rendered = 0;
+        };
+
+        /*!
+         * Fetch the target frame rate of the redraw scheduler.
+         * @return the maximum number of backbuffer redraws per second triggered by requestRedraw().
+         */
+        int redrawFrameRate() const;
+
+        /*!
+         * Set the target frame rate of the redraw scheduler (default 30).
+         * Redraw requests (geometry changes, tile arrivals, layer changes) are coalesced into at most one backbuffer
+         * redraw per frame interval. Panning and zooming are not throttled.
+         * @param frames_per_second The maximum number of backbuffer redraws per second triggered by requestRedraw().
+         */
+        void setRedrawFrameRate(const int& frames_per_second);
+
+        /*!
+         * Fetch the number of threads used to render a layer.
+         * @return the number of threads used to render a layer (1 when parallel rendering is disabled).
+         */
+        int renderThreadCount() const;
+
+        /*!
+         * Set the number of threads used to render a layer (default 1, ie: disabled).
+         * When greater than 1, layers that support concurrent drawing (eg: geometry layers) are rendered as one
+         * horizontal band per thread, drawn concurrently, each querying only its own region.
+         * @param thread_count The number of threads (eg: QThread::idealThreadCount()).
+         */
+        void setRenderThreadCount(const int& thread_count);
+
+        /*!
+         * Fetches the redraw scheduler counters.
+         * @return the redraw statistics.
+         */
+        RedrawStatistics redrawStatistics() const;
+
+        /*!
+         * Resets the redraw scheduler counters.
+         */
+        void resetRedrawStatistics();
+
         /*!
          * Sets the proxy for HTTP connections.
          * @param proxy The proxy details.
@@ -471,6 +584,7 @@ namespace qmapcontrol
         // Drawing management.
         /*!
          * Called when something requires the view to be redrawn.
+         * Requests are coalesced: the backbuffer is redrawn at most once per frame interval (see setRedrawFrameRate()).
          */
         void requestRedraw();
 
@@ -559,6 +673,11 @@ namespace qmapcontrol
          */
         bool checkBackbuffer() const;
 
+        /*!
+         * Marks the cached surface of every layer as dirty (eg: after a projection change).
+         */
+        void invalidateLayerSurfaces();
+
         /*!
          * Redraws the primary screen image.
          * @param force_redraw Whether to force the backbuffer to be redrawn, even if checkBackbuffer() states we do not need to.
@@ -585,6 +704,11 @@ namespace qmapcontrol
         void animatedTick();
 
         // Drawing management.
+        /*!
+         * Called by the redraw scheduler when the coalesced redraw requests are due.
+         */
+        void redrawScheduled();
+
         /*!
          * Called when the Image Manager has loaded all requested images (removes the zoom image).
          */
@@ -592,11 +716,11 @@ namespace qmapcontrol
 
         /*!
          * Called when the backbuffer has been updated, to replace the existing primary screen and request a QWidget::update().
-         * @param backbuffer_pixmap The updated backbuffer pixmap.
+         * @param backbuffer_image The updated backbuffer image (a pooled surface, shared without copy).
          * @param backbuffer_rect_px The updated backbuffer rect in pixels.
          * @param backbuffer_map_focus_px The updated backbuffer map foucs point in pixels.
          */
-        void updatePrimaryScreen(QPixmap backbuffer_pixmap, RectWorldPx backbuffer_rect_px, PointWorldPx backbuffer_map_focus_px);
+        void updatePrimaryScreen(QImage backbuffer_image, RectWorldPx backbuffer_rect_px, PointWorldPx backbuffer_map_focus_px);
 
     signals:
         // Geometry management.
@@ -647,11 +771,11 @@ namespace qmapcontrol
         // Drawing management.
         /*!
          * Signal emitted when the backbuffer has been updated.
-         * @param backbuffer_pixmap The updated backbuffer pixmap.
+         * @param backbuffer_image The updated backbuffer image (a pooled surface, shared without copy).
          * @param backbuffer_rect_px The updated backbuffer rect in pixels.
          * @param backbuffer_map_focus_px The updated backbuffer map foucs point in pixels.
          */
-        void updatedBackBuffer(QPixmap backbuffer_pixmap, RectWorldPx backbuffer_rect_px,
+        void updatedBackBuffer(QImage backbuffer_image, RectWorldPx backbuffer_rect_px,
                                PointWorldPx backbuffer_map_focus_px);
 
         /**
@@ -757,8 +881,8 @@ namespace qmapcontrol
         /// The current mouse position in pixels (set after every mouse event).
         PointViewportPx m_mouse_position_current_px;
 
-        /// Primary screen pixmap (always 2 x viewport size to allow for panning backbuffer).
-        QPixmap m_primary_screen;
+        /// Primary screen image (always 2 x viewport size to allow for panning backbuffer), a pooled surface.
+        QImage m_primary_screen;
 
         /// The map focus point when the primary screen was created.
         PointWorldPx m_primary_screen_map_focus_point_px;
@@ -787,6 +911,12 @@ namespace qmapcontrol
         /// The zoom control's '-' zoom out button.
         QPushButton m_zoom_control_button_out;
 
+        /// Pool of backbuffer surfaces, recycled once the primary screen no longer uses them.
+        SurfacePool m_surface_pool;
+
+        /// Thread pool rendering the layer bands (see setRenderThreadCount()).
+        QThreadPool m_render_pool;
+
         /// Mutex to protect the backbuffer during the redraw process.
         QMutex m_backbuffer_mutex;
 
@@ -796,6 +926,27 @@ namespace qmapcontrol
         /// Progress indicator to alert user to redrawing progress.
         QProgressIndicator m_progress_indicator;
 
+        /// Redraw scheduler timer (fires once the coalesced redraw requests are due).
+        QTimer m_redraw_timer;
+
+        /// Time since the last scheduled redraw.
+        QElapsedTimer m_redraw_clock;
+
+        /// Minimum interval between two scheduled redraws.
+        std::chrono::milliseconds m_redraw_interval;
+
+        /// Planner of the look-ahead tiles, shared with the map adapter layers.
+        std::shared_ptr<PrefetchPlanner> m_prefetch_planner;
+
+        /// Number of redraw requests.
+        quint64 m_redraw_requested = 0;
+
+        /// Number of scheduled redraws.
+        quint64 m_redraw_scheduled = 0;
+
+        /// Number of backbuffer redraws rendered (updated by the rendering thread).
+        std::atomic<quint64> m_redraw_rendered{0};
+
         QAtomicInt mAborted = false;
 
         // Viewport management.
@@ -26,6 +26,7 @@
 #pragma once
 
 // STD includes.
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <vector>
@@ -77,30 +78,38 @@ namespace qmapcontrol
          */
         void query(std::set<T>& return_points, const RectWorldCoord& range_coord) const
         {
-            // Does the range intersect with our boundary.
-            if(range_coord.rawRect().intersects(m_boundary_coord.rawRect()))
-            {
-                // Check whether any of our points are contained in the range.
-                for(const auto& point : m_points)
-                {
-                    // Is the point contained by the query range.
-                    if(range_coord.rawRect().contains(point.first.rawPoint()))
-                    {
-                        // Add to the return points.
-                        return_points.insert(point.second);
-                    }
-                }
+            // Add each object found to the return points.
+            visit(range_coord, [&return_points](const T& object) { return_points.insert(object); });
+        }
 
-                // Do we have any child quad tree nodes?
-                if(m_child_north_east != nullptr)
-                {
-                    // Search each child and add the points they return.
-                    m_child_north_east->query(return_points, range_coord);
-                    m_child_north_west->query(return_points, range_coord);
-                    m_child_south_east->query(return_points, range_coord);
-                    m_child_south_west->query(return_points, range_coord);
-                }
-            }
+        /*!
+         * Fetches objects within the specified bounding box range, without any intermediate container.
+         * An object inserted at several points is written once for each of its points within the range.
+         * @param output The output iterator the objects are written to (eg: a back inserter into a reused vector).
+         * @param range_coord The bounding box range.
+         * @return the output iterator past the last object written.
+         */
+        template <class OutputIterator>
+        OutputIterator query(OutputIterator output, const RectWorldCoord& range_coord) const
+        {
+            // Write each object found to the output.
+            visit(range_coord, [&output](const T& object) { *output++ = object; });
+
+            // Return the output past the objects.
+            return output;
+        }
+
+        /*!
+         * Calls a visitor for each object within the specified bounding box range, as the tree is walked.
+         * No allocation is made and the objects are not copied. The visitor must not modify the container.
+         * @param range_coord The bounding box range.
+         * @param visitor The callable, called with each object (const T&), once for each of its points within the range.
+         */
+        template <class Visitor>
+        void visit(const RectWorldCoord& range_coord, Visitor&& visitor) const
+        {
+            // Walk the tree with the range fetched once.
+            visitNode(range_coord.rawRect(), visitor);
         }
 
         /*!
@@ -171,6 +180,25 @@ namespace qmapcontrol
             return success;
         }
 
+        /*!
+         * Inserts many objects into the quad tree container at once.
+         * The free slots of each node are filled first, then the remaining objects are partitioned in place between
+         * the child nodes, so each object is placed with a single pass per level rather than descending the tree once.
+         * @param points The objects and their points in coordinates (the points outside the boundary are dropped).
+         * @return the number of objects inserted.
+         */
+        size_t bulkInsert(std::vector<std::pair<PointWorldCoord, T>> points)
+        {
+            // Drop the points outside our boundary.
+            const auto end = std::partition(points.begin(), points.end(), [this](const std::pair<PointWorldCoord, T>& point) { return m_boundary_coord.rawRect().contains(point.first.rawPoint()); });
+
+            // Insert the remaining points.
+            insertRange(points.begin(), end);
+
+            // Return the number of points inserted.
+            return size_t(end - points.begin());
+        }
+
         /*!
          * Removes an object from the quad tree container.
          * @param point_coord The objects's point in coordinates.
@@ -229,9 +257,87 @@ namespace qmapcontrol
         //! Disable copy constructor.
         QuadTreeContainer(const QuadTreeContainer&); /// @todo remove once MSVC supports default/delete syntax.
 
+        /*!
+         * Calls a visitor for each object of this quad tree node (and its children) within the range.
+         * @param range The bounding box range.
+         * @param visitor The callable, called with each object.
+         */
+        template <class Visitor>
+        void visitNode(const QRectF& range, Visitor& visitor) const
+        {
+            // Does the range intersect with our boundary.
+            if(range.intersects(m_boundary_coord.rawRect()))
+            {
+                // Check whether any of our points are contained in the range.
+                for(const auto& point : m_points)
+                {
+                    // Is the point contained by the query range.
+                    if(range.contains(point.first.rawPoint()))
+                    {
+                        // Visit the object.
+                        visitor(point.second);
+                    }
+                }
+
+                // Do we have any child quad tree nodes?
+                if(m_child_north_east != nullptr)
+                {
+                    // Search each child.
+                    m_child_north_east->visitNode(range, visitor);
+                    m_child_north_west->visitNode(range, visitor);
+                    m_child_south_east->visitNode(range, visitor);
+                    m_child_south_west->visitNode(range, visitor);
+                }
+            }
+        }
+
         //! Disable copy assignment.
         QuadTreeContainer& operator=(const QuadTreeContainer&); /// @todo remove once MSVC supports default/delete syntax.
 
+        /*!
+         * Inserts a range of objects, all within our boundary, into this quad tree node (and its children).
+         * @param first The first object.
+         * @param last Past the last object.
+         */
+        template <class Iterator>
+        void insertRange(Iterator first, Iterator last)
+        {
+            // Fill our free slots.
+            while(first != last && m_points.size() < m_capacity)
+            {
+                // Add the point.
+                m_points.push_back(std::move(*first));
+                ++first;
+            }
+
+            // Do we have points left?
+            if(first != last)
+            {
+                // Do we already have child quad tree nodes?
+                if(m_child_north_east == nullptr)
+                {
+                    // We need to create the child quad tree nodes before we continue.
+                    subdivide();
+                }
+
+                // Partition the points between the children, in the same order as insert() tries them.
+                for(QuadTreeContainer* child : { m_child_north_east.get(), m_child_north_west.get(), m_child_south_east.get(), m_child_south_west.get() })
+                {
+                    // Move the points the child contains to the front, and insert them.
+                    const auto middle = std::partition(first, last, [child](const std::pair<PointWorldCoord, T>& point) { return child->m_boundary_coord.rawRect().contains(point.first.rawPoint()); });
+                    child->insertRange(first, middle);
+                    first = middle;
+                }
+
+                // Are there points no child could take?
+                if(first != last)
+                {
+                    // We cannot insert, fail!
+                    throw std::runtime_error("Unable to insert into quad tree container.");
+                }
+            }
+        }
+
         /*!
          * Creates the child nodes.
          */
@@ -0,0 +1,641 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_RTREECONTAINER_H
+#define QMAPCONTROL_RTREECONTAINER_H
+
+#include "qmapcontrol_global.h"
+#include "Point.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace qmapcontrol {
+
+/*!
+ * Spatial index of objects keyed on their bounding box (envelope), based on the R*-tree.
+ * Each object is stored once, whatever its extent: a polygon or a line string is found by any range overlapping its
+ * envelope, even when none of its vertices lie in the range. Leaf nodes hold up to max_entries objects, inner nodes up
+ * to max_entries children, each node knowing the envelope of its content so a query only visits the overlapping
+ * subtrees.
+ *
+ * Insertions descend to the subtree needing the least enlargement and split overflowing nodes with the R* topological
+ * split (the axis minimising the margins, then the distribution minimising the overlap). Erasures collapse the
+ * underflowing nodes and reinsert their objects, so the tree stays balanced under churn (eg: moving vehicles).
+ *
+ * Threading contract: none, the owner protects the container (const queries can run concurrently).
+ */
+template <class T>
+class QMAPCONTROL_EXPORT RTreeContainer {
+public:
+    /*!
+     * Constructs an empty container.
+     * @param max_entries The maximum number of entries (objects or children) of a node, at least 4.
+     */
+    explicit RTreeContainer(const std::size_t &max_entries = 16)
+            : m_max_entries(std::max<std::size_t>(max_entries, 4)),
+              m_min_entries(std::max<std::size_t>(m_max_entries * 2 / 5, 2)),
+              m_size(0)
+    {
+    }
+
+    RTreeContainer(const RTreeContainer &) = delete;
+
+    RTreeContainer &operator=(const RTreeContainer &) = delete;
+
+    /*!
+     * Fetches the objects whose envelope overlaps the specified bounding box range.
+     * @param return_objects The objects that are within the specified range are added to this.
+     * @param range_coord The bounding box range.
+     */
+    void query(std::set<T> &return_objects, const RectWorldCoord &range_coord) const
+    {
+        visit(range_coord, [&return_objects](const T &object) { return_objects.insert(object); });
+    }
+
+    /*!
+     * Fetches the objects whose envelope overlaps the specified bounding box range, without any intermediate
+     * container. Each object is written once.
+     * @param output The output iterator the objects are written to (eg: a back inserter into a reused vector).
+     * @param range_coord The bounding box range.
+     * @return the output iterator past the last object written.
+     */
+    template <class OutputIterator>
+    OutputIterator query(OutputIterator output, const RectWorldCoord &range_coord) const
+    {
+        visit(range_coord, [&output](const T &object) { *output++ = object; });
+        return output;
+    }
+
+    /*!
+     * Calls a visitor for each object whose envelope overlaps the specified bounding box range, as the tree is walked.
+     * No allocation is made and the objects are not copied. The visitor must not modify the container.
+     * @param range_coord The bounding box range.
+     * @param visitor The callable, called once with each object (const T&).
+     */
+    template <class Visitor>
+    void visit(const RectWorldCoord &range_coord, Visitor &&visitor) const
+    {
+        const Envelope range(range_coord);
+        if (m_root != nullptr && range.intersects(m_root->envelope)) {
+            visitNode(*m_root, range, visitor);
+        }
+    }
+
+    /*!
+     * Inserts an object into the container.
+     * @param envelope_coord The object's bounding box in coordinates (a point is an empty box).
+     * @param object The object to insert.
+     */
+    void insert(const RectWorldCoord &envelope_coord, const T &object)
+    {
+        insertObject(Envelope(envelope_coord), object);
+        ++m_size;
+    }
+
+    /*!
+     * Inserts many objects at once. If the tree is empty or the batch is at least half its size, the whole tree is
+     * packed with the Sort-Tile-Recursive algorithm: the objects (including the ones already stored) are sorted into
+     * vertical slabs by the x of their centre, each slab by the y, and grouped into full leaves; the levels above are
+     * packed the same way. Much faster than inserting the objects one by one, and the packed nodes hardly overlap.
+     * Smaller batches are inserted one by one, as repacking would cost more than the stored objects.
+     * @param objects The objects' bounding boxes in coordinates, and the objects.
+     */
+    void bulkInsert(const std::vector<std::pair<RectWorldCoord, T>> &objects)
+    {
+        // A small batch into a large tree.
+        if (objects.size() < m_size / 2) {
+            for (const auto &object : objects) {
+                insertObject(Envelope(object.first), object.second);
+            }
+            m_size += objects.size();
+            return;
+        }
+
+        // Gather the stored objects and the new ones.
+        std::vector<Entry> entries;
+        entries.reserve(m_size + objects.size());
+        if (m_root != nullptr) {
+            collect(*m_root, entries);
+            m_root.reset();
+        }
+        for (const auto &object : objects) {
+            entries.emplace_back(Envelope(object.first), object.second);
+        }
+        m_size = entries.size();
+        if (entries.empty()) {
+            return;
+        }
+
+        // Pack the leaves.
+        sortTiles(entries);
+        std::vector<std::unique_ptr<Node>> nodes;
+        nodes.reserve(entries.size() / m_max_entries + 1);
+        for (std::size_t first = 0; first < entries.size(); first += m_max_entries) {
+            std::unique_ptr<Node> leaf(new Node(true));
+            const std::size_t last = std::min(first + m_max_entries, entries.size());
+            std::move(entries.begin() + first, entries.begin() + last, std::back_inserter(leaf->objects));
+            leaf->updateEnvelope();
+            nodes.push_back(std::move(leaf));
+        }
+
+        // Pack the levels above, up to the root.
+        while (nodes.size() > 1) {
+            sortTiles(nodes);
+            std::vector<std::unique_ptr<Node>> parents;
+            parents.reserve(nodes.size() / m_max_entries + 1);
+            for (std::size_t first = 0; first < nodes.size(); first += m_max_entries) {
+                std::unique_ptr<Node> parent(new Node(false));
+                const std::size_t last = std::min(first + m_max_entries, nodes.size());
+                std::move(nodes.begin() + first, nodes.begin() + last, std::back_inserter(parent->children));
+                parent->updateEnvelope();
+                parents.push_back(std::move(parent));
+            }
+            nodes = std::move(parents);
+        }
+        m_root = std::move(nodes.front());
+    }
+
+    /*!
+     * Removes an object from the container (all its occurrences).
+     * If the object is not found within its envelope (eg: it has moved since inserted), the whole tree is searched.
+     * @param envelope_coord The object's bounding box in coordinates, as inserted.
+     * @param object The object to remove.
+     * @return whether the object was found.
+     */
+    bool erase(const RectWorldCoord &envelope_coord, const T &object)
+    {
+        if (m_root == nullptr) {
+            return false;
+        }
+
+        std::vector<Entry> orphans;
+        bool erased = eraseFrom(*m_root, Envelope(envelope_coord), object, orphans);
+        if (erased == false) {
+            erased = eraseFrom(*m_root, Envelope::everything(), object, orphans);
+        }
+
+        // Shorten the tree while the root has a single child.
+        while (m_root->leaf == false && m_root->children.size() <= 1) {
+            if (m_root->children.empty()) {
+                m_root.reset();
+                break;
+            }
+            std::unique_ptr<Node> child = std::move(m_root->children.front());
+            m_root = std::move(child);
+        }
+
+        // Reinsert the objects of the collapsed nodes.
+        for (const auto &orphan : orphans) {
+            insertObject(orphan.first, orphan.second);
+        }
+        return erased;
+    }
+
+    /*!
+     * Removes all objects from the container.
+     */
+    void clear()
+    {
+        m_root.reset();
+        m_size = 0;
+    }
+
+    /*!
+     * Fetches the number of objects stored.
+     * @return the number of objects.
+     */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    /// A normalised bounding box (coordinates may be given top to bottom or bottom to top).
+    struct Envelope {
+        qreal min_x;
+        qreal min_y;
+        qreal max_x;
+        qreal max_y;
+
+        Envelope()
+                : min_x(std::numeric_limits<qreal>::max()),
+                  min_y(std::numeric_limits<qreal>::max()),
+                  max_x(std::numeric_limits<qreal>::lowest()),
+                  max_y(std::numeric_limits<qreal>::lowest())
+        {
+        }
+
+        explicit Envelope(const RectWorldCoord &rect_coord)
+        {
+            const QRectF rect = rect_coord.rawRect();
+            min_x = std::min(rect.left(), rect.right());
+            max_x = std::max(rect.left(), rect.right());
+            min_y = std::min(rect.top(), rect.bottom());
+            max_y = std::max(rect.top(), rect.bottom());
+        }
+
+        /// The envelope overlapping everything.
+        static Envelope everything()
+        {
+            Envelope envelope;
+            std::swap(envelope.min_x, envelope.max_x);
+            std::swap(envelope.min_y, envelope.max_y);
+            return envelope;
+        }
+
+        /// Whether the envelopes overlap (touching counts, so points are found on the range edges).
+        bool intersects(const Envelope &other) const
+        {
+            return min_x <= other.max_x && other.min_x <= max_x && min_y <= other.max_y && other.min_y <= max_y;
+        }
+
+        void expand(const Envelope &other)
+        {
+            min_x = std::min(min_x, other.min_x);
+            min_y = std::min(min_y, other.min_y);
+            max_x = std::max(max_x, other.max_x);
+            max_y = std::max(max_y, other.max_y);
+        }
+
+        Envelope united(const Envelope &other) const
+        {
+            Envelope envelope(*this);
+            envelope.expand(other);
+            return envelope;
+        }
+
+        qreal area() const
+        {
+            return max_x < min_x || max_y < min_y ? 0.0 : (max_x - min_x) * (max_y - min_y);
+        }
+
+        qreal margin() const
+        {
+            return max_x < min_x || max_y < min_y ? 0.0 : (max_x - min_x) + (max_y - min_y);
+        }
+
+        qreal overlap(const Envelope &other) const
+        {
+            const qreal width = std::min(max_x, other.max_x) - std::max(min_x, other.min_x);
+            const qreal height = std::min(max_y, other.max_y) - std::max(min_y, other.min_y);
+            return width > 0.0 && height > 0.0 ? width * height : 0.0;
+        }
+
+        qreal lower(int axis) const
+        {
+            return axis == 0 ? min_x : min_y;
+        }
+
+        qreal upper(int axis) const
+        {
+            return axis == 0 ? max_x : max_y;
+        }
+    };
+
+    /// An object stored in a leaf, with its envelope.
+    using Entry = std::pair<Envelope, T>;
+
+    struct Node {
+        explicit Node(bool is_leaf)
+                : leaf(is_leaf)
+        {
+        }
+
+        /// Whether the node holds objects (or children).
+        bool leaf;
+
+        /// The envelope of the node content.
+        Envelope envelope;
+
+        /// The objects of a leaf node.
+        std::vector<Entry> objects;
+
+        /// The children of an inner node.
+        std::vector<std::unique_ptr<Node>> children;
+
+        std::size_t count() const
+        {
+            return leaf ? objects.size() : children.size();
+        }
+
+        void updateEnvelope()
+        {
+            envelope = Envelope();
+            for (const auto &object : objects) {
+                envelope.expand(object.first);
+            }
+            for (const auto &child : children) {
+                envelope.expand(child->envelope);
+            }
+        }
+    };
+
+    static const Envelope &envelopeOf(const Entry &entry)
+    {
+        return entry.first;
+    }
+
+    static const Envelope &envelopeOf(const std::unique_ptr<Node> &child)
+    {
+        return child->envelope;
+    }
+
+    template <class Visitor>
+    static void visitNode(const Node &node, const Envelope &range, Visitor &visitor)
+    {
+        if (node.leaf) {
+            for (const auto &object : node.objects) {
+                if (range.intersects(object.first)) {
+                    visitor(object.second);
+                }
+            }
+        } else {
+            for (const auto &child : node.children) {
+                if (range.intersects(child->envelope)) {
+                    visitNode(*child, range, visitor);
+                }
+            }
+        }
+    }
+
+    /*!
+     * Inserts an object from the root, growing the tree if the root splits.
+     * @param envelope The object's envelope.
+     * @param object The object.
+     */
+    void insertObject(const Envelope &envelope, const T &object)
+    {
+        if (m_root == nullptr) {
+            m_root.reset(new Node(true));
+        }
+
+        std::unique_ptr<Node> sibling = insertInto(*m_root, envelope, object);
+        if (sibling != nullptr) {
+            std::unique_ptr<Node> root(new Node(false));
+            root->children.push_back(std::move(m_root));
+            root->children.push_back(std::move(sibling));
+            root->updateEnvelope();
+            m_root = std::move(root);
+        }
+    }
+
+    /*!
+     * Inserts an object into a subtree.
+     * @param node The subtree root.
+     * @param envelope The object's envelope.
+     * @param object The object.
+     * @return the node split off the subtree root if it overflowed, nullptr otherwise.
+     */
+    std::unique_ptr<Node> insertInto(Node &node, const Envelope &envelope, const T &object)
+    {
+        node.envelope.expand(envelope);
+
+        if (node.leaf) {
+            node.objects.emplace_back(envelope, object);
+            return node.objects.size() > m_max_entries ? split(node) : nullptr;
+        }
+
+        // Descend into the child needing the least enlargement (then the smallest).
+        Node *best_child = nullptr;
+        qreal best_enlargement = std::numeric_limits<qreal>::max();
+        qreal best_area = std::numeric_limits<qreal>::max();
+        for (const auto &child : node.children) {
+            const qreal area = child->envelope.area();
+            const qreal enlargement = child->envelope.united(envelope).area() - area;
+            if (enlargement < best_enlargement || (enlargement == best_enlargement && area < best_area)) {
+                best_child = child.get();
+                best_enlargement = enlargement;
+                best_area = area;
+            }
+        }
+
+        std::unique_ptr<Node> sibling = insertInto(*best_child, envelope, object);
+        if (sibling != nullptr) {
+            node.children.push_back(std::move(sibling));
+            return node.children.size() > m_max_entries ? split(node) : nullptr;
+        }
+        return nullptr;
+    }
+
+    /*!
+     * Splits an overflowing node in two.
+     * @param node The node, keeps the first part of its entries.
+     * @return the new node holding the second part.
+     */
+    std::unique_ptr<Node> split(Node &node)
+    {
+        std::unique_ptr<Node> sibling(new Node(node.leaf));
+        if (node.leaf) {
+            const std::size_t index = chooseSplit(node.objects);
+            std::move(node.objects.begin() + index, node.objects.end(), std::back_inserter(sibling->objects));
+            node.objects.erase(node.objects.begin() + index, node.objects.end());
+        } else {
+            const std::size_t index = chooseSplit(node.children);
+            std::move(node.children.begin() + index, node.children.end(), std::back_inserter(sibling->children));
+            node.children.erase(node.children.begin() + index, node.children.end());
+        }
+        node.updateEnvelope();
+        sibling->updateEnvelope();
+        return sibling;
+    }
+
+    /*!
+     * Sorts the entries of an overflowing node for the R* split.
+     * The split axis minimises the sum of the margins of all the distributions, the distribution (along the lower or
+     * upper bounds) then minimises the overlap of the two parts, then their areas.
+     * @param entries The entries, sorted on return.
+     * @return the index of the first entry of the second part.
+     */
+    template <class E>
+    std::size_t chooseSplit(std::vector<E> &entries) const
+    {
+        const std::size_t count = entries.size();
+        std::vector<Envelope> head(count);
+        std::vector<Envelope> tail(count);
+
+        // Compute the envelopes of every head/tail part of the sorted entries.
+        auto sortAndSweep = [&](int axis, bool by_upper) {
+            std::sort(entries.begin(), entries.end(), [axis, by_upper](const E &a, const E &b) {
+                const Envelope &envelope_a = envelopeOf(a);
+                const Envelope &envelope_b = envelopeOf(b);
+                return by_upper ? envelope_a.upper(axis) < envelope_b.upper(axis) : envelope_a.lower(axis) < envelope_b.lower(axis);
+            });
+            head[0] = envelopeOf(entries.front());
+            for (std::size_t i = 1; i < count; ++i) {
+                head[i] = head[i - 1].united(envelopeOf(entries[i]));
+            }
+            tail[count - 1] = envelopeOf(entries.back());
+            for (std::size_t i = count - 1; i > 0; --i) {
+                tail[i - 1] = tail[i].united(envelopeOf(entries[i - 1]));
+            }
+        };
+
+        // Choose the axis.
+        int best_axis = 0;
+        qreal best_margin = std::numeric_limits<qreal>::max();
+        for (int axis = 0; axis < 2; ++axis) {
+            qreal margin = 0.0;
+            for (bool by_upper : {false, true}) {
+                sortAndSweep(axis, by_upper);
+                for (std::size_t index = m_min_entries; index <= count - m_min_entries; ++index) {
+                    margin += head[index - 1].margin() + tail[index].margin();
+                }
+            }
+            if (margin < best_margin) {
+                best_axis = axis;
+                best_margin = margin;
+            }
+        }
+
+        // Choose the distribution.
+        bool best_by_upper = false;
+        std::size_t best_index = count / 2;
+        qreal best_overlap = std::numeric_limits<qreal>::max();
+        qreal best_area = std::numeric_limits<qreal>::max();
+        for (bool by_upper : {false, true}) {
+            sortAndSweep(best_axis, by_upper);
+            for (std::size_t index = m_min_entries; index <= count - m_min_entries; ++index) {
+                const qreal overlap = head[index - 1].overlap(tail[index]);
+                const qreal area = head[index - 1].area() + tail[index].area();
+                if (overlap < best_overlap || (overlap == best_overlap && area < best_area)) {
+                    best_by_upper = by_upper;
+                    best_index = index;
+                    best_overlap = overlap;
+                    best_area = area;
+                }
+            }
+        }
+
+        // Leave the entries in the chosen order.
+        if (best_by_upper == false) {
+            sortAndSweep(best_axis, false);
+        }
+        return best_index;
+    }
+
+    /*!
+     * Sorts entries in Sort-Tile-Recursive order: into vertical slabs of whole nodes by the x of their centre, then
+     * each slab by the y of their centre, so consecutive runs of max_entries entries make compact nodes.
+     * @param entries The entries, sorted on return.
+     */
+    template <class E>
+    void sortTiles(std::vector<E> &entries) const
+    {
+        const std::size_t node_count = (entries.size() + m_max_entries - 1) / m_max_entries;
+        const std::size_t slab_count = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(node_count))));
+        const std::size_t slab_size = slab_count * m_max_entries;
+
+        std::sort(entries.begin(), entries.end(), [](const E &a, const E &b) {
+            return envelopeOf(a).min_x + envelopeOf(a).max_x < envelopeOf(b).min_x + envelopeOf(b).max_x;
+        });
+        for (std::size_t first = 0; first < entries.size(); first += slab_size) {
+            const std::size_t last = std::min(first + slab_size, entries.size());
+            std::sort(entries.begin() + first, entries.begin() + last, [](const E &a, const E &b) {
+                return envelopeOf(a).min_y + envelopeOf(a).max_y < envelopeOf(b).min_y + envelopeOf(b).max_y;
+            });
+        }
+    }
+
+    /*!
+     * Removes an object from a subtree, collapsing the underflowing nodes.
+     * @param node The subtree root.
+     * @param envelope The envelope to search.
+     * @param object The object.
+     * @param orphans The objects of the collapsed nodes are added to this, to be reinserted.
+     * @return whether the object was found.
+     */
+    bool eraseFrom(Node &node, const Envelope &envelope, const T &object, std::vector<Entry> &orphans)
+    {
+        bool erased = false;
+        if (node.leaf) {
+            auto itr = node.objects.begin();
+            while (itr != node.objects.end()) {
+                if (itr->second == object) {
+                    itr = node.objects.erase(itr);
+                    --m_size;
+                    erased = true;
+                } else {
+                    ++itr;
+                }
+            }
+        } else {
+            auto itr = node.children.begin();
+            while (itr != node.children.end()) {
+                Node &child = **itr;
+                if (envelope.intersects(child.envelope) && eraseFrom(child, envelope, object, orphans)) {
+                    erased = true;
+                    if (child.count() < m_min_entries) {
+                        collect(child, orphans);
+                        itr = node.children.erase(itr);
+                        continue;
+                    }
+                }
+                ++itr;
+            }
+        }
+
+        if (erased) {
+            node.updateEnvelope();
+        }
+        return erased;
+    }
+
+    /*!
+     * Moves all the objects of a subtree.
+     * @param node The subtree root.
+     * @param orphans The objects are added to this.
+     */
+    static void collect(Node &node, std::vector<Entry> &orphans)
+    {
+        std::move(node.objects.begin(), node.objects.end(), std::back_inserter(orphans));
+        for (auto &child : node.children) {
+            collect(*child, orphans);
+        }
+    }
+
+    /// The maximum number of entries of a node.
+    const std::size_t m_max_entries;
+
+    /// The minimum number of entries of a node (but the root).
+    const std::size_t m_min_entries;
+
+    /// The number of objects stored.
+    std::size_t m_size;
+
+    /// The root node, nullptr if empty.
+    std::unique_ptr<Node> m_root;
+};
+
+}
+
+#endif // QMAPCONTROL_RTREECONTAINER_H
@@ -0,0 +1,123 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#include "SurfacePool.h"
+
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+#include <vector>
+
+namespace qmapcontrol {
+
+struct SurfacePool::State {
+    /// Mutex protecting the state (surfaces are released from any thread).
+    mutable QMutex mutex;
+    /// The maximum number of free surfaces kept.
+    std::size_t max_free_surfaces;
+    /// The free surfaces.
+    std::vector<std::unique_ptr<uchar[]>> free_buffers;
+    /// The size in bytes of each free surface.
+    std::vector<std::size_t> free_bytes;
+    /// The usage counters.
+    Statistics statistics;
+};
+
+struct SurfacePool::Surface {
+    /// The pool the surface belongs to.
+    std::shared_ptr<State> state;
+    /// The pixel buffer.
+    std::unique_ptr<uchar[]> buffer;
+    /// The size in bytes of the pixel buffer.
+    std::size_t bytes;
+};
+
+SurfacePool::SurfacePool(std::size_t max_free_surfaces)
+        : m_state(std::make_shared<State>())
+{
+    m_state->max_free_surfaces = max_free_surfaces;
+}
+
+QImage SurfacePool::acquire(const QSize &size, QImage::Format format)
+{
+    const int bytes_per_line = size.width() * 4;
+    const std::size_t bytes = static_cast<std::size_t>(bytes_per_line) * size.height();
+
+    auto surface = new Surface{m_state, nullptr, bytes};
+    {
+        QMutexLocker locker(&m_state->mutex);
+
+        // Look for a free surface of the same size.
+        for (std::size_t i = 0; i < m_state->free_bytes.size(); ++i) {
+            if (m_state->free_bytes[i] == bytes) {
+                surface->buffer = std::move(m_state->free_buffers[i]);
+                m_state->free_buffers.erase(m_state->free_buffers.begin() + i);
+                m_state->free_bytes.erase(m_state->free_bytes.begin() + i);
+                ++m_state->statistics.reuses;
+                break;
+            }
+        }
+
+        if (surface->buffer == nullptr) {
+            ++m_state->statistics.allocations;
+        }
+    }
+
+    if (surface->buffer == nullptr) {
+        surface->buffer.reset(new uchar[bytes]);
+    }
+
+    // The image does not own the buffer: it is handed back to the pool by release() once the last copy is gone.
+    return QImage(surface->buffer.get(), size.width(), size.height(), bytes_per_line, format, &SurfacePool::release,
+                  surface);
+}
+
+void SurfacePool::clear()
+{
+    QMutexLocker locker(&m_state->mutex);
+    m_state->free_buffers.clear();
+    m_state->free_bytes.clear();
+}
+
+SurfacePool::Statistics SurfacePool::statistics() const
+{
+    QMutexLocker locker(&m_state->mutex);
+    auto statistics = m_state->statistics;
+    statistics.free_surfaces = m_state->free_buffers.size();
+    return statistics;
+}
+
+void SurfacePool::release(void *info)
+{
+    std::unique_ptr<Surface> surface(static_cast<Surface *>(info));
+
+    QMutexLocker locker(&surface->state->mutex);
+    if (surface->state->free_buffers.size() < surface->state->max_free_surfaces) {
+        surface->state->free_buffers.push_back(std::move(surface->buffer));
+        surface->state->free_bytes.push_back(surface->bytes);
+    }
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_SURFACEPOOL_H
+#define QMAPCONTROL_SURFACEPOOL_H
+
+#include "qmapcontrol_global.h"
+
+#include <QtCore/QSize>
+#include <QtGui/QImage>
+
+#include <cstddef>
+#include <memory>
+
+namespace qmapcontrol {
+
+/*!
+ * Pool of render surfaces (QImage pixel buffers) recycled between frames.
+ * Surfaces handed out by acquire() are plain QImages: they can be painted, copied (implicitly shared) and passed
+ * across threads. Once the last QImage sharing a surface is destroyed, its pixel buffer goes back to the pool instead
+ * of being freed, so the next acquire() of the same size reuses it. The pool can be destroyed before its surfaces.
+ */
+class QMAPCONTROL_EXPORT SurfacePool {
+public:
+    /// Counters describing the pool usage.
+    struct Statistics {
+        /// Number of surfaces allocated.
+        quint64 allocations = 0;
+        /// Number of surfaces reused from the pool.
+        quint64 reuses = 0;
+        /// Number of free surfaces in the pool.
+        std::size_t free_surfaces = 0;
+    };
+
+    /*!
+     * Constructs an empty pool.
+     * @param max_free_surfaces The maximum number of free surfaces kept for reuse (3 allows for triple buffering).
+     */
+    explicit SurfacePool(std::size_t max_free_surfaces = 3);
+
+    /*!
+     * Fetches a surface, reusing a free one of the same size if possible.
+     * @param size The surface size.
+     * @param format The surface format (must be 32 bits per pixel).
+     * @return the surface, its content is undefined.
+     */
+    QImage acquire(const QSize &size, QImage::Format format = QImage::Format_ARGB32_Premultiplied);
+
+    /*!
+     * Frees the surfaces kept for reuse (the surfaces in use are returned to the pool when released).
+     */
+    void clear();
+
+    /*!
+     * Fetches the usage counters.
+     * @return the pool statistics.
+     */
+    Statistics statistics() const;
+
+private:
+    struct State;
+    struct Surface;
+
+    /*!
+     * QImage cleanup function: gives the pixel buffer back to its pool.
+     * @param info The surface.
+     */
+    static void release(void *info);
+
+    /// The pool state, shared with the surfaces in use.
+    std::shared_ptr<State> m_state;
+};
+
+}
+
+#endif // QMAPCONTROL_SURFACEPOOL_H
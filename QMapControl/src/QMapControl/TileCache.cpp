@@ -0,0 +1,192 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#include "TileCache.h"
+
+#include <QtCore/QMutexLocker>
+
+#include <limits>
+
+namespace qmapcontrol {
+
+namespace {
+std::size_t pixmapBytes(const QPixmap &pixmap)
+{
+    return static_cast<std::size_t>(pixmap.width()) * pixmap.height() * pixmap.depth() / 8;
+}
+}
+
+const std::size_t TileCache::DefaultCapacityBytes = 128 * 1024 * 1024;
+
+const std::size_t TileCache::ShardCount;
+
+TileCache::TileCache(std::size_t capacity_bytes)
+        : m_capacity_bytes(capacity_bytes)
+{
+    for (auto &shard : m_shards) {
+        shard.capacity_bytes = capacity_bytes / ShardCount;
+    }
+}
+
+bool TileCache::find(const Key &key, QPixmap &pixmap)
+{
+    auto &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+
+    auto itr = shard.index.find(key);
+    if (itr == shard.index.end()) {
+        ++shard.statistics.misses;
+        return false;
+    }
+
+    // Move the entry to the front, it is now the most recently used.
+    shard.entries.splice(shard.entries.begin(), shard.entries, itr->second);
+
+    ++shard.statistics.hits;
+    pixmap = itr->second->pixmap;
+    return true;
+}
+
+bool TileCache::peek(const Key &key, QPixmap &pixmap)
+{
+    auto &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+
+    auto itr = shard.index.find(key);
+    if (itr == shard.index.end()) {
+        return false;
+    }
+
+    shard.entries.splice(shard.entries.begin(), shard.entries, itr->second);
+
+    pixmap = itr->second->pixmap;
+    return true;
+}
+
+void TileCache::insert(const Key &key, const QPixmap &pixmap)
+{
+    const auto bytes = pixmapBytes(pixmap);
+
+    auto &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+
+    auto itr = shard.index.find(key);
+    if (itr != shard.index.end()) {
+        // Replace the existing entry, and refresh its recency.
+        shard.statistics.bytes -= itr->second->bytes;
+        itr->second->pixmap = pixmap;
+        itr->second->bytes = bytes;
+        shard.entries.splice(shard.entries.begin(), shard.entries, itr->second);
+    } else {
+        shard.entries.push_front(Entry{key, pixmap, bytes});
+        shard.index.emplace(key, shard.entries.begin());
+        ++shard.statistics.tiles;
+    }
+
+    shard.statistics.bytes += bytes;
+    ++shard.statistics.insertions;
+
+    evict(shard);
+}
+
+void TileCache::clear()
+{
+    for (auto &shard : m_shards) {
+        QMutexLocker locker(&shard.mutex);
+
+        shard.index.clear();
+        shard.entries.clear();
+        shard.statistics.tiles = 0;
+        shard.statistics.bytes = 0;
+    }
+}
+
+std::size_t TileCache::capacity() const
+{
+    return m_capacity_bytes;
+}
+
+void TileCache::setCapacity(std::size_t capacity_bytes)
+{
+    m_capacity_bytes = capacity_bytes;
+
+    for (auto &shard : m_shards) {
+        QMutexLocker locker(&shard.mutex);
+
+        shard.capacity_bytes = capacity_bytes / ShardCount;
+        evict(shard);
+    }
+}
+
+TileCache::Statistics TileCache::statistics() const
+{
+    Statistics statistics;
+    for (const auto &shard : m_shards) {
+        QMutexLocker locker(&shard.mutex);
+
+        statistics.hits += shard.statistics.hits;
+        statistics.misses += shard.statistics.misses;
+        statistics.insertions += shard.statistics.insertions;
+        statistics.evictions += shard.statistics.evictions;
+        statistics.tiles += shard.statistics.tiles;
+        statistics.bytes += shard.statistics.bytes;
+    }
+    statistics.capacity_bytes = m_capacity_bytes;
+    return statistics;
+}
+
+void TileCache::resetStatistics()
+{
+    for (auto &shard : m_shards) {
+        QMutexLocker locker(&shard.mutex);
+
+        shard.statistics.hits = 0;
+        shard.statistics.misses = 0;
+        shard.statistics.insertions = 0;
+        shard.statistics.evictions = 0;
+    }
+}
+
+TileCache::Shard &TileCache::shardFor(const Key &key)
+{
+    // Use the top bits of the hash (whatever the width of std::size_t), the low bits select the buckets within the shard.
+    return m_shards[(key.hash() >> (std::numeric_limits<std::size_t>::digits - 8)) % ShardCount];
+}
+
+void TileCache::evict(Shard &shard)
+{
+    // Always keep the most recently used tile, even if it alone exceeds the budget.
+    while (shard.statistics.bytes > shard.capacity_bytes && shard.entries.size() > 1) {
+        const auto &last = shard.entries.back();
+        shard.statistics.bytes -= last.bytes;
+        shard.index.erase(last.key);
+        shard.entries.pop_back();
+
+        --shard.statistics.tiles;
+        ++shard.statistics.evictions;
+    }
+}
+
+}
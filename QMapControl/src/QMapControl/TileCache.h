@@ -0,0 +1,187 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_TILECACHE_H
+#define QMAPCONTROL_TILECACHE_H
+
+#include "qmapcontrol_global.h"
+#include "TileKey.h"
+
+#include <QtCore/QMutex>
+#include <QtGui/QPixmap>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+
+namespace qmapcontrol {
+
+/*!
+ * In-memory cache of decoded map tiles.
+ * The cache is bounded by a byte budget: when an insertion pushes the total size of the stored pixmaps above the
+ * budget, the least recently used tiles are evicted until it fits again. Lookups and insertions are O(1).
+ *
+ * Threading contract: every method can be called concurrently from any thread (typically lookups from the rendering
+ * thread and insertions from the GUI thread). The tiles are spread over ShardCount shards by key, each with its own
+ * lock, LRU list and share of the byte budget, so a lookup only contends with operations on the same shard. Pixmaps
+ * are returned by (implicitly shared) copy, and are never modified once inserted.
+ */
+class QMAPCONTROL_EXPORT TileCache {
+public:
+    /// Compact key identifying a tile.
+    using Key = TileKey;
+
+    /// Counters describing the cache usage since creation (or the last resetStatistics()).
+    struct Statistics {
+        /// Number of lookups that found the tile.
+        quint64 hits = 0;
+        /// Number of lookups that did not find the tile.
+        quint64 misses = 0;
+        /// Number of tiles inserted.
+        quint64 insertions = 0;
+        /// Number of tiles evicted to honour the byte budget.
+        quint64 evictions = 0;
+        /// Number of tiles currently stored.
+        std::size_t tiles = 0;
+        /// Number of bytes currently stored.
+        std::size_t bytes = 0;
+        /// The byte budget.
+        std::size_t capacity_bytes = 0;
+    };
+
+    /// Default byte budget (128 MiB, about 500 tiles of 256x256 ARGB32).
+    static const std::size_t DefaultCapacityBytes;
+
+    /// Number of independently locked shards.
+    static const std::size_t ShardCount = 16;
+
+    /*!
+     * Constructs an empty cache.
+     * @param capacity_bytes The maximum number of bytes the stored pixmaps can use.
+     */
+    explicit TileCache(std::size_t capacity_bytes = DefaultCapacityBytes);
+
+    /*!
+     * Looks for a tile, marking it as the most recently used one if found.
+     * @param key The tile key.
+     * @param pixmap Set to the cached pixmap if found, untouched otherwise.
+     * @return whether the tile was found.
+     */
+    bool find(const Key &key, QPixmap &pixmap);
+
+    /*!
+     * Looks for a tile without counting the lookup in the statistics (eg: to draw it in place of another tile).
+     * It is still marked as the most recently used one if found, as it is in use.
+     * @param key The tile key.
+     * @param pixmap Set to the cached pixmap if found, untouched otherwise.
+     * @return whether the tile was found.
+     */
+    bool peek(const Key &key, QPixmap &pixmap);
+
+    /*!
+     * Inserts (or replaces) a tile, evicting the least recently used tiles of its shard if the shard's share of the
+     * byte budget is exceeded.
+     * @param key The tile key.
+     * @param pixmap The tile pixmap.
+     */
+    void insert(const Key &key, const QPixmap &pixmap);
+
+    /*!
+     * Removes all the tiles from the cache.
+     */
+    void clear();
+
+    /*!
+     * Fetches the byte budget.
+     * @return the maximum number of bytes the stored pixmaps can use.
+     */
+    std::size_t capacity() const;
+
+    /*!
+     * Changes the byte budget, evicting tiles immediately if the new budget is smaller than the stored size.
+     * @param capacity_bytes The maximum number of bytes the stored pixmaps can use.
+     */
+    void setCapacity(std::size_t capacity_bytes);
+
+    /*!
+     * Fetches the usage counters.
+     * @return the cache statistics.
+     */
+    Statistics statistics() const;
+
+    /*!
+     * Resets the hits/misses/insertions/evictions counters.
+     */
+    void resetStatistics();
+
+private:
+    struct Entry {
+        Key key;
+        QPixmap pixmap;
+        std::size_t bytes;
+    };
+
+    struct Shard {
+        /// Mutex protecting the shard, lookups reorder the recency list.
+        mutable QMutex mutex;
+
+        /// The tiles, most recently used first.
+        std::list<Entry> entries;
+
+        /// Index of the tiles by key.
+        std::unordered_map<Key, std::list<Entry>::iterator> index;
+
+        /// The shard's share of the byte budget.
+        std::size_t capacity_bytes = 0;
+
+        /// The shard's usage counters.
+        Statistics statistics;
+    };
+
+    /*!
+     * Fetches the shard holding a key.
+     * @param key The tile key.
+     * @return the shard.
+     */
+    Shard &shardFor(const Key &key);
+
+    /*!
+     * Evicts the least recently used tiles of a shard until its byte budget is honoured. Its mutex must be held.
+     * @param shard The shard.
+     */
+    static void evict(Shard &shard);
+
+    /// The shards.
+    std::array<Shard, ShardCount> m_shards;
+
+    /// The byte budget.
+    std::atomic<std::size_t> m_capacity_bytes;
+};
+
+}
+
+#endif // QMAPCONTROL_TILECACHE_H
@@ -0,0 +1,61 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#include "TileKey.h"
+
+#include <stdexcept>
+#include <string>
+
+namespace qmapcontrol {
+
+TileKey::TileKey(quint32 source_id, int zoom, int x, int y, int epsg, int tile_size_px)
+        : m_high((quint64(source_id) << 32) | ((quint64(epsg) & MaxEpsg) << 16) | (quint64(tile_size_px) & 0xFFFF)),
+          m_low(((quint64(zoom) & 0x3F) << 58) | ((quint64(x) & XYMask) << 29) | (quint64(y) & XYMask))
+{
+    // A truncated code would collide with another projection's keys.
+    if (epsg <= 0 || epsg > MaxEpsg) {
+        throw std::out_of_range("EPSG:" + std::to_string(epsg) + " does not fit in a tile key (1 to 65535).");
+    }
+}
+
+std::size_t TileKey::hash() const
+{
+    // Mix both words (splitmix64 finaliser), the low bits of x/y alone would cluster.
+    quint64 h = m_high * 0x9E3779B97F4A7C15ULL ^ m_low;
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return static_cast<std::size_t>(h);
+}
+
+QString TileKey::toString() const
+{
+    return QString::number(m_high, 16).rightJustified(16, QLatin1Char('0')) +
+           QString::number(m_low, 16).rightJustified(16, QLatin1Char('0'));
+}
+
+}
@@ -0,0 +1,139 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_TILEKEY_H
+#define QMAPCONTROL_TILEKEY_H
+
+#include "qmapcontrol_global.h"
+
+#include <QtCore/QString>
+
+#include <cstddef>
+#include <functional>
+
+namespace qmapcontrol {
+
+/*!
+ * Identifies a map tile: the tile source (map adapter), the zoom, the x/y tile indexes, the projection and the tile
+ * size. All the fields are packed into two 64 bit integers, so the key can be compared and hashed without any string
+ * formatting.
+ *
+ * Packing layout:
+ *  - high: source id (32 bits) | epsg (16 bits) | tile size in pixels (16 bits)
+ *  - low:  zoom (6 bits) | x (29 bits) | y (29 bits)
+ *
+ * The EPSG code is limited to 1 to 65535 (MaxEpsg): larger codes (eg: ESRI or IGNF codes used through PROJ) are
+ * rejected rather than truncated, as they would collide with the keys of another projection in the caches.
+ */
+class QMAPCONTROL_EXPORT TileKey {
+public:
+    /// The largest EPSG number a key can hold.
+    static const int MaxEpsg = 0xFFFF;
+
+    //! Constructs an invalid key.
+    TileKey() = default;
+
+    /*!
+     * Constructs a key.
+     * @param source_id The id of the tile source (see MapAdapter::sourceId()).
+     * @param zoom The controller zoom (0 to 63).
+     * @param x The x tile index (0 to 2^29 - 1).
+     * @param y The y tile index (0 to 2^29 - 1).
+     * @param epsg The EPSG number of the projection (1 to MaxEpsg).
+     * @param tile_size_px The tile size in pixels.
+     * @throws std::out_of_range if the EPSG number does not fit in the key.
+     */
+    TileKey(quint32 source_id, int zoom, int x, int y, int epsg, int tile_size_px);
+
+    /*!
+     * Constructs a key from its packed representation (see high() and low()).
+     * @param high The packed source id, epsg and tile size.
+     * @param low The packed zoom and x/y tile indexes.
+     * @return the key.
+     */
+    static inline TileKey fromPacked(quint64 high, quint64 low)
+    {
+        TileKey key;
+        key.m_high = high;
+        key.m_low = low;
+        return key;
+    }
+
+    inline bool isValid() const { return m_high != 0; }
+
+    inline quint32 sourceId() const { return static_cast<quint32>(m_high >> 32); }
+    inline int epsg() const { return static_cast<int>((m_high >> 16) & 0xFFFF); }
+    inline int tileSizePx() const { return static_cast<int>(m_high & 0xFFFF); }
+    inline int zoom() const { return static_cast<int>(m_low >> 58); }
+    inline int x() const { return static_cast<int>((m_low >> 29) & XYMask); }
+    inline int y() const { return static_cast<int>(m_low & XYMask); }
+
+    inline quint64 high() const { return m_high; }
+    inline quint64 low() const { return m_low; }
+
+    /*!
+     * Fetches a well distributed hash of the key.
+     * @return the hash.
+     */
+    std::size_t hash() const;
+
+    /*!
+     * Formats the key as a 32 digits hex string (eg: for file names).
+     * @return the formatted key.
+     */
+    QString toString() const;
+
+    inline bool operator==(const TileKey &other) const { return m_high == other.m_high && m_low == other.m_low; }
+    inline bool operator!=(const TileKey &other) const { return !(*this == other); }
+    inline bool operator<(const TileKey &other) const
+    {
+        return m_high < other.m_high || (m_high == other.m_high && m_low < other.m_low);
+    }
+
+private:
+    static const quint64 XYMask = (quint64(1) << 29) - 1;
+
+    quint64 m_high = 0;
+    quint64 m_low = 0;
+};
+
+inline uint qHash(const TileKey &key, uint seed = 0)
+{
+    return static_cast<uint>(key.hash()) ^ seed;
+}
+
+}
+
+namespace std {
+template<>
+struct hash<qmapcontrol::TileKey> {
+    std::size_t operator()(const qmapcontrol::TileKey &key) const
+    {
+        return key.hash();
+    }
+};
+}
+
+#endif // QMAPCONTROL_TILEKEY_H
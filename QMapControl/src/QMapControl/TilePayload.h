@@ -0,0 +1,55 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_TILEPAYLOAD_H
+#define QMAPCONTROL_TILEPAYLOAD_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QDateTime>
+#include <QtCore/QString>
+
+namespace qmapcontrol {
+
+/*!
+ * A tile image as served by the tile server: the encoded bytes (PNG, JPEG, WebP...) and the HTTP metadata needed to
+ * revalidate it. The persistent cache stores the payload as is, so the tile is never re-encoded.
+ */
+struct TilePayload {
+    /// The encoded image.
+    QByteArray data;
+
+    /// The Content-Type header (eg: "image/png").
+    QString content_type;
+
+    /// The ETag header.
+    QByteArray etag;
+
+    /// The Last-Modified header.
+    QDateTime last_modified;
+};
+
+}
+
+#endif // QMAPCONTROL_TILEPAYLOAD_H
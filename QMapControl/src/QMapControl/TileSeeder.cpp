@@ -0,0 +1,364 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#include "TileSeeder.h"
+
+#include "ImageManager.h"
+#include "MapAdapter.h"
+#include "Projection.h"
+#include "TilePayload.h"
+
+#include <QtCore/QBuffer>
+#include <QtGui/QImageReader>
+#include <QtNetwork/QNetworkRequest>
+
+#include <algorithm>
+#include <cmath>
+
+namespace qmapcontrol {
+
+namespace {
+/// Minimum time between two progress reports.
+const qint64 ProgressIntervalMs = 500;
+}
+
+const int TileSeeder::DefaultMaxConcurrentDownloads;
+
+const int TileSeeder::DefaultMaxAttempts;
+
+TileSeeder::TileSeeder(const std::shared_ptr<MapAdapter> &mapadapter, PersistentCache &cache, QObject *parent)
+        : QObject(parent),
+          m_mapadapter(mapadapter),
+          m_cache(cache)
+{
+    QObject::connect(&m_nam, &QNetworkAccessManager::finished, this, &TileSeeder::downloadFinished);
+}
+
+TileSeeder::~TileSeeder()
+{
+    stop();
+}
+
+void TileSeeder::setArea(const RectWorldCoord &bbox)
+{
+    reset();
+    m_area = QPolygonF(bbox.rawRect());
+}
+
+void TileSeeder::setArea(const std::vector<PointWorldCoord> &polygon)
+{
+    reset();
+    m_area.clear();
+    for (const auto &point : polygon) {
+        m_area.append(point.rawPoint());
+    }
+}
+
+void TileSeeder::setZoomRange(int min_zoom, int max_zoom)
+{
+    reset();
+    m_min_zoom = std::min(min_zoom, max_zoom);
+    m_max_zoom = std::max(min_zoom, max_zoom);
+}
+
+int TileSeeder::maxConcurrentDownloads() const
+{
+    return m_max_downloads;
+}
+
+void TileSeeder::setMaxConcurrentDownloads(int max_downloads)
+{
+    m_max_downloads = std::max(1, max_downloads);
+
+    // Use the new slots straight away.
+    if (m_running) {
+        dispatch();
+    }
+}
+
+void TileSeeder::setMaxAttempts(int max_attempts)
+{
+    m_max_attempts = std::max(1, max_attempts);
+}
+
+void TileSeeder::setProxy(const QNetworkProxy &proxy)
+{
+    m_nam.setProxy(proxy);
+}
+
+qint64 TileSeeder::tileCount()
+{
+    buildSpans();
+    return m_progress.total;
+}
+
+TileSeeder::Progress TileSeeder::progress() const
+{
+    Progress progress = m_progress;
+    if (m_running) {
+        progress.elapsed_ms = m_elapsed_before_ms + m_timer.elapsed();
+    }
+    return progress;
+}
+
+bool TileSeeder::isRunning() const
+{
+    return m_running;
+}
+
+void TileSeeder::start()
+{
+    if (m_running) {
+        return;
+    }
+
+    // Start over if the last run completed.
+    buildSpans();
+    if (m_next_span >= m_spans.size() && m_retries.isEmpty()) {
+        rewind();
+    }
+
+    // The fresh tiles are skipped, as answered by the index.
+    m_cache.waitForIndex();
+
+    m_running = true;
+    m_timer.start();
+    m_last_report_ms = 0;
+    dispatch();
+}
+
+void TileSeeder::stop()
+{
+    if (!m_running) {
+        return;
+    }
+    m_running = false;
+
+    // Abort the downloads in-flight, they are requested again when resumed (aborting emits finished synchronously, so
+    // take them out first).
+    QHash<QNetworkReply *, TileKey> aborted;
+    aborted.swap(m_replies);
+    for (auto itr = aborted.constBegin(); itr != aborted.constEnd(); ++itr) {
+        m_retries.prepend(itr.value());
+        itr.key()->abort();
+    }
+
+    m_elapsed_before_ms += m_timer.elapsed();
+    m_progress.elapsed_ms = m_elapsed_before_ms;
+
+    // Write what has been stored so far.
+    m_cache.flush();
+    emit progressChanged(m_progress);
+}
+
+void TileSeeder::downloadFinished(QNetworkReply *reply)
+{
+    reply->deleteLater();
+
+    // Ignore the aborted replies.
+    auto itr = m_replies.find(reply);
+    if (itr == m_replies.end()) {
+        return;
+    }
+    const TileKey key = itr.value();
+    m_replies.erase(itr);
+
+    // Store the tile as served, as long as it is an image (not an error page).
+    bool stored = false;
+    if (reply->error() == QNetworkReply::NoError) {
+        TilePayload payload;
+        payload.data = reply->readAll();
+        payload.content_type = reply->header(QNetworkRequest::ContentTypeHeader).toString();
+        payload.etag = reply->rawHeader("ETag");
+        payload.last_modified = reply->header(QNetworkRequest::LastModifiedHeader).toDateTime();
+
+        QBuffer buffer;
+        buffer.setData(payload.data);
+        QImageReader image_reader(&buffer);
+        if (image_reader.canRead()) {
+            m_cache.insertTile(key, payload);
+            ++m_progress.downloaded;
+            m_progress.bytes += payload.data.size();
+            stored = true;
+        }
+    }
+
+    if (stored) {
+        m_attempts.remove(key);
+    } else if (++m_attempts[key] < m_max_attempts) {
+        // Try again once all the other tiles have been requested.
+        m_retries.append(key);
+    } else {
+        m_attempts.remove(key);
+        ++m_progress.failed;
+    }
+
+    reportProgress();
+    dispatch();
+}
+
+void TileSeeder::buildSpans()
+{
+    if (m_spans_built) {
+        return;
+    }
+    m_spans_built = true;
+    m_spans.clear();
+
+    qint64 total = 0;
+    if (m_area.size() >= 3) {
+        const int tile_size = ImageManager::get().tileSizePx();
+
+        for (int zoom = m_min_zoom; zoom <= m_max_zoom; ++zoom) {
+            // The area at this zoom.
+            QPolygonF area_px;
+            for (const auto &point : m_area) {
+                area_px.append(projection::get().toPointWorldPx(PointWorldCoord(point.x(), point.y()), zoom).rawPoint());
+            }
+            const QRectF bounds = area_px.boundingRect();
+
+            const int y_min = std::max(0, static_cast<int>(std::floor(bounds.top() / tile_size)));
+            const int y_max = std::min(projection::get().tilesY(zoom) - 1,
+                                       std::max(y_min, static_cast<int>(std::ceil(bounds.bottom() / tile_size)) - 1));
+            for (int y = y_min; y <= y_max; ++y) {
+                // The part of the area crossed by the row of tiles.
+                const QRectF band(bounds.left() - 1.0, y * tile_size, bounds.width() + 2.0, tile_size);
+                const QPolygonF row = area_px.intersected(QPolygonF(band));
+                if (row.isEmpty()) {
+                    continue;
+                }
+
+                const QRectF row_bounds = row.boundingRect();
+                const int x_min = std::max(0, static_cast<int>(std::floor(row_bounds.left() / tile_size)));
+                const int x_max = std::min(projection::get().tilesX(zoom) - 1,
+                                           std::max(x_min, static_cast<int>(std::ceil(row_bounds.right() / tile_size)) - 1));
+                if (x_min > x_max) {
+                    continue;
+                }
+
+                m_spans.push_back(Span{zoom, y, x_min, x_max});
+                total += x_max - x_min + 1;
+            }
+        }
+    }
+
+    rewind();
+    m_progress.total = total;
+}
+
+void TileSeeder::reset()
+{
+    stop();
+    m_spans_built = false;
+    m_spans.clear();
+    rewind();
+}
+
+void TileSeeder::rewind()
+{
+    m_next_span = 0;
+    m_next_x = m_spans.empty() ? 0 : m_spans.front().x_min;
+    m_retries.clear();
+    m_attempts.clear();
+
+    const qint64 total = m_progress.total;
+    m_progress = Progress();
+    m_progress.total = total;
+    m_elapsed_before_ms = 0;
+}
+
+bool TileSeeder::nextTile(TileKey &key)
+{
+    while (m_next_span < m_spans.size()) {
+        // Advance the cursor.
+        const Span &span = m_spans[m_next_span];
+        const int x = m_next_x;
+        if (++m_next_x > span.x_max) {
+            ++m_next_span;
+            if (m_next_span < m_spans.size()) {
+                m_next_x = m_spans[m_next_span].x_min;
+            }
+        }
+
+        if (!m_mapadapter->isTileValid(x, span.y, span.zoom)) {
+            ++m_progress.skipped;
+            continue;
+        }
+
+        // Resume: skip what is already stored.
+        key = m_mapadapter->tileKey(x, span.y, span.zoom);
+        if (m_cache.isFresh(key)) {
+            ++m_progress.skipped;
+            continue;
+        }
+        return true;
+    }
+
+    // All the tiles have been requested, try the failed ones again.
+    if (!m_retries.isEmpty()) {
+        key = m_retries.takeFirst();
+        return true;
+    }
+    return false;
+}
+
+void TileSeeder::dispatch()
+{
+    while (m_running && m_replies.size() < m_max_downloads) {
+        TileKey key;
+        if (!nextTile(key)) {
+            break;
+        }
+
+        QNetworkRequest request(m_mapadapter->tileQuery(key.x(), key.y(), key.zoom()));
+        request.setRawHeader("User-Agent", "QMapControl");
+        request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+        m_replies.insert(m_nam.get(request), key);
+    }
+
+    // Everything has been processed.
+    if (m_running && m_replies.isEmpty()) {
+        m_running = false;
+        m_elapsed_before_ms += m_timer.elapsed();
+        m_progress.elapsed_ms = m_elapsed_before_ms;
+
+        m_cache.flush();
+        emit progressChanged(m_progress);
+        emit finished(m_progress);
+    }
+}
+
+void TileSeeder::reportProgress()
+{
+    const qint64 elapsed_ms = m_timer.elapsed();
+    m_progress.elapsed_ms = m_elapsed_before_ms + elapsed_ms;
+
+    if (elapsed_ms - m_last_report_ms >= ProgressIntervalMs) {
+        m_last_report_ms = elapsed_ms;
+        emit progressChanged(m_progress);
+    }
+}
+
+}
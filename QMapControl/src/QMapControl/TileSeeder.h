@@ -0,0 +1,315 @@
+/*
+ *
+ * This file is part of QMapControl,
+ * an open-source cross-platform map widget
+ *
+ * Copyright (C) 2009 - Federico Fuga <fuga@studiofuga.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with QMapControl. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact e-mail: fuga@studiofuga.com
+ * Program URL   : http://qmapcontrol.sourceforge.net/
+ *
+ */
+
+#ifndef QMAPCONTROL_TILESEEDER_H
+#define QMAPCONTROL_TILESEEDER_H
+
+#include "qmapcontrol_global.h"
+#include "PersistentCache.h"
+#include "Point.h"
+#include "TileKey.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtGui/QPolygonF>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkProxy>
+#include <QtNetwork/QNetworkReply>
+
+#include <memory>
+#include <vector>
+
+namespace qmapcontrol {
+
+class MapAdapter;
+
+/*!
+ * Headless downloader filling a persistent cache with the tiles of an area, for offline use.
+ * The tiles of the area (a bounding box or a polygon) are enumerated for each zoom level of a range, downloaded with a
+ * bounded number of concurrent requests, and written to the cache as served (no decoding, the data is only checked to
+ * be a readable image). A failed tile is retried at the end of the run, up to a maximum number of attempts.
+ *
+ * Seeding is resumable: the tiles already fresh in the cache are skipped, so a run interrupted (or stopped) is resumed
+ * by running it again. Progress and throughput are reported through progressChanged() while running.
+ *
+ * Threading contract: the seeder lives in the thread it was created in, which must run an event loop. Its methods
+ * must be called from that thread.
+ */
+class QMAPCONTROL_EXPORT TileSeeder : public QObject {
+    Q_OBJECT
+public:
+    /// Progress of a seeding run.
+    struct Progress {
+        /// Number of tiles of the area.
+        qint64 total = 0;
+        /// Number of tiles downloaded and stored.
+        qint64 downloaded = 0;
+        /// Number of tiles skipped (already fresh in the cache, or not provided by the map adapter).
+        qint64 skipped = 0;
+        /// Number of tiles given up after the maximum number of attempts.
+        qint64 failed = 0;
+        /// Number of bytes downloaded and stored.
+        qint64 bytes = 0;
+        /// Time spent running, in milliseconds.
+        qint64 elapsed_ms = 0;
+
+        /// The number of tiles processed so far.
+        qint64 processed() const
+        {
+            return downloaded + skipped + failed;
+        }
+
+        /// The download throughput, in tiles per second.
+        double tilesPerSecond() const
+        {
+            return elapsed_ms > 0 ? downloaded * 1000.0 / elapsed_ms : 0.0;
+        }
+
+        /// The download throughput, in bytes per second.
+        double bytesPerSecond() const
+        {
+            return elapsed_ms > 0 ? bytes * 1000.0 / elapsed_ms : 0.0;
+        }
+    };
+
+    /// Default number of concurrent downloads.
+    static const int DefaultMaxConcurrentDownloads = 4;
+
+    /// Default number of attempts before giving up a tile.
+    static const int DefaultMaxAttempts = 3;
+
+    /*!
+     * Constructs a seeder.
+     * @param mapadapter The map adapter providing the tiles.
+     * @param cache The persistent cache to fill (must outlive the seeder).
+     * @param parent QObject parent ownership.
+     */
+    TileSeeder(const std::shared_ptr<MapAdapter> &mapadapter, PersistentCache &cache, QObject *parent = nullptr);
+
+    /*!
+     * Aborts the downloads in-flight (the tiles stored so far are kept).
+     */
+    ~TileSeeder() override;
+
+    /*!
+     * Set the area to seed (the previous run can no longer be resumed, the fresh tiles are still skipped).
+     * @param bbox The bounding box of the area.
+     */
+    void setArea(const RectWorldCoord &bbox);
+
+    /*!
+     * Set the area to seed (the previous run can no longer be resumed, the fresh tiles are still skipped).
+     * @param polygon The polygon of the area (the tiles crossed by each row of tiles are seeded, concave parts are
+     * filled).
+     */
+    void setArea(const std::vector<PointWorldCoord> &polygon);
+
+    /*!
+     * Set the zoom levels to seed (the previous run can no longer be resumed, the fresh tiles are still skipped).
+     * @param min_zoom The minimum zoom level.
+     * @param max_zoom The maximum zoom level.
+     */
+    void setZoomRange(int min_zoom, int max_zoom);
+
+    /*!
+     * Fetch the maximum number of concurrent downloads.
+     * @return the maximum number of concurrent downloads.
+     */
+    int maxConcurrentDownloads() const;
+
+    /*!
+     * Set the maximum number of concurrent downloads (be nice with the tile servers).
+     * @param max_downloads The maximum number of concurrent downloads (at least 1).
+     */
+    void setMaxConcurrentDownloads(int max_downloads);
+
+    /*!
+     * Set the number of attempts before giving up a tile.
+     * @param max_attempts The maximum number of attempts (at least 1).
+     */
+    void setMaxAttempts(int max_attempts);
+
+    /*!
+     * Set the network proxy to use.
+     * @param proxy The network proxy to use.
+     */
+    void setProxy(const QNetworkProxy &proxy);
+
+    /*!
+     * Fetch the number of tiles of the area, over the zoom range.
+     * @return the number of tiles.
+     */
+    qint64 tileCount();
+
+    /*!
+     * Fetch the progress of the current (or last) run.
+     * @return the progress.
+     */
+    Progress progress() const;
+
+    /*!
+     * Whether a run is in progress.
+     * @return whether the seeder is running.
+     */
+    bool isRunning() const;
+
+public slots:
+    /*!
+     * Start seeding, or resume the run stopped by stop(). Blocks until the index of the cache is loaded.
+     */
+    void start();
+
+    /*!
+     * Stop seeding, aborting the downloads in-flight (they are requested again when the run is resumed).
+     */
+    void stop();
+
+signals:
+    /*!
+     * Signal emitted periodically while running.
+     * @param progress The progress of the run.
+     */
+    void progressChanged(const qmapcontrol::TileSeeder::Progress &progress);
+
+    /*!
+     * Signal emitted when all the tiles have been processed (not when stopped).
+     * @param progress The progress of the run.
+     */
+    void finished(const qmapcontrol::TileSeeder::Progress &progress);
+
+private slots:
+    /*!
+     * Slot to handle a download that has finished.
+     * @param reply The reply that contains the downloaded data.
+     */
+    void downloadFinished(QNetworkReply *reply);
+
+private:
+    /// The tiles of a zoom level crossed by a row of tiles.
+    struct Span {
+        int zoom;
+        int y;
+        int x_min;
+        int x_max;
+    };
+
+    /*!
+     * Enumerates the rows of tiles of the area, if not done yet.
+     */
+    void buildSpans();
+
+    /*!
+     * Stops, and forgets the enumeration and the current run (the area or zoom range changed).
+     */
+    void reset();
+
+    /*!
+     * Restarts the run from the first tile, keeping the enumeration.
+     */
+    void rewind();
+
+    /*!
+     * Fetches the next tile to download, skipping the fresh ones.
+     * @param key Set to the key of the tile.
+     * @return whether a tile is left.
+     */
+    bool nextTile(TileKey &key);
+
+    /*!
+     * Sends requests while there are free download slots, and finishes the run once everything is processed.
+     */
+    void dispatch();
+
+    /*!
+     * Emits the progress, at most every few hundred milliseconds.
+     */
+    void reportProgress();
+
+    /// The map adapter providing the tiles.
+    std::shared_ptr<MapAdapter> m_mapadapter;
+
+    /// The persistent cache to fill.
+    PersistentCache &m_cache;
+
+    /// The network access manager.
+    QNetworkAccessManager m_nam;
+
+    /// The area to seed, in world coordinates.
+    QPolygonF m_area;
+
+    /// The minimum zoom level to seed.
+    int m_min_zoom = 0;
+
+    /// The maximum zoom level to seed.
+    int m_max_zoom = 0;
+
+    /// The maximum number of concurrent downloads.
+    int m_max_downloads = DefaultMaxConcurrentDownloads;
+
+    /// The maximum number of attempts for a tile.
+    int m_max_attempts = DefaultMaxAttempts;
+
+    /// The rows of tiles of the area.
+    std::vector<Span> m_spans;
+
+    /// Whether the spans are up to date.
+    bool m_spans_built = false;
+
+    /// The row of the next tile.
+    std::size_t m_next_span = 0;
+
+    /// The column of the next tile.
+    int m_next_x = 0;
+
+    /// Tiles to request again (failed or aborted), once all the other tiles have been requested.
+    QList<TileKey> m_retries;
+
+    /// The number of failed attempts of the tiles to retry.
+    QHash<TileKey, int> m_attempts;
+
+    /// The tile each in-flight reply is downloading.
+    QHash<QNetworkReply *, TileKey> m_replies;
+
+    /// Whether a run is in progress.
+    bool m_running = false;
+
+    /// The progress of the run.
+    Progress m_progress;
+
+    /// Time spent running in the previous sessions of the run (before stop()).
+    qint64 m_elapsed_before_ms = 0;
+
+    /// Time of the current session of the run.
+    QElapsedTimer m_timer;
+
+    /// Time of the last progress report (see m_timer).
+    qint64 m_last_report_ms = 0;
+};
+
+}
+
+#endif // QMAPCONTROL_TILESEEDER_H